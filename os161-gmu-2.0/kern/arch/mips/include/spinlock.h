@@ -46,6 +46,10 @@ SPINLOCK_INLINE
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 SPINLOCK_INLINE
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+SPINLOCK_INLINE
+bool spinlock_data_compareandswap(volatile spinlock_data_t *sd,
+				  spinlock_data_t oldval,
+				  spinlock_data_t newval);
 
 ////////////////////////////////////////////////////////////
 
@@ -96,5 +100,38 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+SPINLOCK_INLINE
+bool
+spinlock_data_compareandswap(volatile spinlock_data_t *sd,
+			     spinlock_data_t oldval, spinlock_data_t newval)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Compare-and-swap using LL/SC.
+	 *
+	 * Load the existing value into X; if it isn't OLDVAL, skip
+	 * the store. Otherwise store Y (NEWVAL), after which Y
+	 * contains 1 if the store succeeded, 0 if it failed.
+	 *
+	 * As with test-and-set, a failed SC counts as failure; the
+	 * caller is presumably retrying anyway.
+	 */
+
+	y = newval;
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"ll %0, 0(%3);"		/*   x = *sd */
+		"bne %0, %2, 1f;"	/*   if (x != oldval) don't store */
+		"sc %1, 0(%3);"		/*   *sd = y; y = success? */
+		"1:"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "+r" (y) : "r" (oldval), "r" (sd) : "memory");
+	return x == oldval && y != 0;
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -30,6 +30,8 @@
 #ifndef _MIPS_VM_H_
 #define _MIPS_VM_H_
 
+#include <platform/maxcpus.h>
+
 
 /*
  * Machine-dependent VM system definitions.
@@ -66,6 +68,7 @@
  * a valid address, and will make a *huge* mess if you scribble on it.
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
 
 /*
  * The top of user space. (Actually, the address immediately above the
@@ -116,14 +119,24 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* address space it belongs to */
+	vaddr_t ts_vaddr;		/* user page to invalidate */
 };
 
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * Machine-dependent part of an address space: the TLB address space
+ * ID it currently has on each CPU, as assigned by mmu.c. The value
+ * includes the CPU's ASID generation above the 6 hardware bits; 0
+ * means none yet.
+ */
+struct addrspace_machdep {
+	uint32_t am_asid[MAXCPUS];
+};
+
 
 #endif /* _MIPS_VM_H_ */
@@ -215,6 +215,51 @@ syscall(struct trapframe *tf)
         err = sys_fork(tf,(pid_t*)&retval);
         break;
 
+	    /* memory calls */
+
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+
+	    case SYS_mmap:
+		{
+			/*
+			 * The fd and the 64-bit offset are on the stack;
+			 * the offset is aligned, so it is at sp+24.
+			 */
+			int fd;
+			uint64_t offset;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &fd, sizeof(int));
+			if (err) {
+				break;
+			}
+			err = copyin((userptr_t)tf->tf_sp + 24,
+				     &offset, sizeof(uint64_t));
+			if (err) {
+				break;
+			}
+
+			err = sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1,
+				       tf->tf_a2, tf->tf_a3, fd, offset,
+				       &retval);
+		}
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+
+	    case SYS_mprotect:
+		err = sys_mprotect((userptr_t)tf->tf_a0, tf->tf_a1,
+				   tf->tf_a2);
+		break;
+
+	    case SYS___vmstat:
+		err = sys___vmstat(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
@@ -37,6 +37,7 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <coremap.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -58,49 +59,32 @@
 /* (this must be > 64K so argument blocks of size ARG_MAX will fit) */
 #define DUMBVM_STACKPAGES    18
 
-/*
- * Wrap ram_stealmem in a spinlock.
- */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-
 void
 vm_bootstrap(void)
 {
 	/* Do nothing. */
 }
 
+/*
+ * Get NPAGES contiguous user frames for AS mapped at VBASE. The
+ * coremap hands user frames back pinned; dumbvm never pages anything,
+ * so just unpin them straight away.
+ */
 static
 paddr_t
-getppages(unsigned long npages)
+getppages(struct addrspace *as, vaddr_t vbase, unsigned long npages)
 {
 	paddr_t addr;
+	unsigned long i;
 
-	spinlock_acquire(&stealmem_lock);
-
-	addr = ram_stealmem(npages);
-
-	spinlock_release(&stealmem_lock);
-	return addr;
-}
-
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t
-alloc_kpages(unsigned npages)
-{
-	paddr_t pa;
-	pa = getppages(npages);
-	if (pa==0) {
+	addr = coremap_alloc(npages, as, vbase);
+	if (addr == 0) {
 		return 0;
 	}
-	return PADDR_TO_KVADDR(pa);
-}
-
-void
-free_kpages(vaddr_t addr)
-{
-	/* nothing - leak the memory. */
-
-	(void)addr;
+	for (i=0; i<npages; i++) {
+		coremap_unpin(addr + i * PAGE_SIZE);
+	}
+	return addr;
 }
 
 void
@@ -212,9 +196,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return 0;
 	}
 
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
+	/* No free slot; let the processor pick one to replace. */
+	ehi = faultaddress;
+	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	tlb_random(ehi, elo);
 	splx(spl);
-	return EFAULT;
+	return 0;
 }
 
 struct addrspace *
@@ -239,6 +227,15 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+	if (as->as_pbase1 != 0) {
+		coremap_free(as->as_pbase1);
+	}
+	if (as->as_pbase2 != 0) {
+		coremap_free(as->as_pbase2);
+	}
+	if (as->as_stackpbase != 0) {
+		coremap_free(as->as_stackpbase);
+	}
 	kfree(as);
 }
 
@@ -322,17 +319,19 @@ as_prepare_load(struct addrspace *as)
 	KASSERT(as->as_pbase2 == 0);
 	KASSERT(as->as_stackpbase == 0);
 
-	as->as_pbase1 = getppages(as->as_npages1);
+	as->as_pbase1 = getppages(as, as->as_vbase1, as->as_npages1);
 	if (as->as_pbase1 == 0) {
 		return ENOMEM;
 	}
 
-	as->as_pbase2 = getppages(as->as_npages2);
+	as->as_pbase2 = getppages(as, as->as_vbase2, as->as_npages2);
 	if (as->as_pbase2 == 0) {
 		return ENOMEM;
 	}
 
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
+	as->as_stackpbase = getppages(as,
+				      USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE,
+				      DUMBVM_STACKPAGES);
 	if (as->as_stackpbase == 0) {
 		return ENOMEM;
 	}
@@ -360,6 +359,51 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_sbrk(struct addrspace *as, intptr_t change, vaddr_t *oldbrk)
+{
+	/* dumbvm can't grow anything. */
+	(void)as;
+	(void)change;
+	(void)oldbrk;
+	return ENOSYS;
+}
+
+int
+as_mmap(struct addrspace *as, vaddr_t addr, size_t len, int perm, int flags,
+	struct vnode *v, off_t offset, vaddr_t *ret)
+{
+	/* nor map files. */
+	(void)as;
+	(void)addr;
+	(void)len;
+	(void)perm;
+	(void)flags;
+	(void)v;
+	(void)offset;
+	(void)ret;
+	return ENOSYS;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	(void)as;
+	(void)addr;
+	(void)len;
+	return ENOSYS;
+}
+
+int
+as_mprotect(struct addrspace *as, vaddr_t addr, size_t len, int perm)
+{
+	(void)as;
+	(void)addr;
+	(void)len;
+	(void)perm;
+	return ENOSYS;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
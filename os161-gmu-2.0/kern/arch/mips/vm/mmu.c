@@ -0,0 +1,496 @@
+/*
+ * MIPS TLB management for the VM system.
+ *
+ * TLB entries are tagged with a 6-bit address space ID, so switching
+ * between processes doesn't have to throw the TLB away. ASIDs are
+ * handed out per CPU, on first activation of an address space on that
+ * CPU, from a counter. When the 63 usable values run out, the CPU
+ * starts a new generation: it flushes its TLB and every address space
+ * has to get a new ASID next time it runs there. The generation is
+ * kept in the value stored in the address space (above the hardware
+ * bits), so a stale ASID is recognized without visiting every address
+ * space. ASID 0 is never handed out; it's loaded when no user address
+ * space has been activated yet.
+ *
+ * Each CPU also keeps a shadow of which TLB slots are in use and by
+ * which ASID, so refills never have to read the TLB back to find a
+ * slot. A free slot is used if there is one (searching from a hint
+ * below which all slots are known to be in use); otherwise a victim
+ * is chosen not-recently-used style by a clock hand, preferring
+ * entries belonging to other address spaces.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <vm.h>
+
+#define ASID_MAX		(TLBHI_PID >> TLBHI_PIDSHIFT)
+#define ASID_GEN(asid)		((asid) >> TLBHI_PIDSHIFT)
+#define ASID_PID(asid)		(((asid) << TLBHI_PIDSHIFT) & TLBHI_PID)
+
+/*
+ * Per-CPU MMU state. Each CPU only touches its own entry, with
+ * interrupts off.
+ */
+struct mmu_cpu {
+	uint32_t mc_generation;		/* current ASID generation */
+	uint32_t mc_lastasid;		/* last hardware ASID handed out */
+	uint32_t mc_curasid;		/* ASID loaded in EntryHi, or 0 */
+
+	/* TLB slot shadow */
+	uint32_t mc_slotasid[NUM_TLB];	/* ASID of each entry, 0 if free */
+	bool mc_slotused[NUM_TLB];	/* loaded since the hand passed */
+	unsigned mc_nused;		/* number of slots in use */
+	unsigned mc_freehint;		/* no free slots below this */
+	unsigned mc_hand;		/* clock hand for replacement */
+
+	/* statistics */
+	unsigned mc_refills;		/* translations loaded */
+	unsigned mc_replaced;		/* ...that displaced another */
+	unsigned mc_preloads;		/* fault-around translations */
+	unsigned mc_activations;	/* address space activations... */
+	unsigned mc_kept;		/* ...that found it already loaded */
+	unsigned mc_flushes;		/* whole-TLB flushes */
+	unsigned mc_rollovers;		/* ASID generations started */
+};
+
+static struct mmu_cpu mmu_cpus[MAXCPUS];
+
+/* Refill counts as of the last mmu_printstats, for computing rates. */
+static unsigned mmu_lastrefills[MAXCPUS];
+static struct timespec mmu_lasttime;
+
+/*
+ * Load ASID into the PID field of EntryHi. There is no separate way
+ * to set it, but every TLB operation leaves the EntryHi value it was
+ * given behind, and probing for an unmapped address does no harm.
+ */
+static
+void
+mmu_loadpid(uint32_t asid)
+{
+	(void)tlb_probe(TLBHI_INVALID(0) | ASID_PID(asid), 0);
+}
+
+/*
+ * Return the ASID AS has on this CPU, or 0 if it has none from the
+ * current generation. Interrupts must be off.
+ */
+static
+uint32_t
+mmu_getasid(struct addrspace *as)
+{
+	struct mmu_cpu *mc;
+	uint32_t asid;
+
+	mc = &mmu_cpus[curcpu->c_number];
+	asid = as->as_machdep.am_asid[curcpu->c_number];
+	if (asid == 0 || ASID_GEN(asid) != mc->mc_generation) {
+		return 0;
+	}
+	return asid;
+}
+
+/*
+ * Choose a TLB slot for a new entry. Interrupts must be off.
+ */
+static
+unsigned
+mmu_pickslot(struct mmu_cpu *mc)
+{
+	unsigned ix, n;
+
+	if (mc->mc_nused < NUM_TLB) {
+		for (ix = mc->mc_freehint; ix < NUM_TLB; ix++) {
+			if (mc->mc_slotasid[ix] == 0) {
+				mc->mc_freehint = ix + 1;
+				return ix;
+			}
+		}
+		panic("mmu: TLB slot count is wrong\n");
+	}
+
+	mc->mc_replaced++;
+
+	/* Two passes at most: the first clears every used flag. */
+	for (n=0; n < 2*NUM_TLB; n++) {
+		ix = mc->mc_hand;
+		mc->mc_hand = (ix + 1) % NUM_TLB;
+		if (mc->mc_slotasid[ix] != mc->mc_curasid) {
+			break;
+		}
+		if (!mc->mc_slotused[ix]) {
+			break;
+		}
+		mc->mc_slotused[ix] = false;
+	}
+	return ix;
+}
+
+/*
+ * Write a translation for the current address space into slot IX.
+ */
+static
+void
+mmu_setslot(struct mmu_cpu *mc, unsigned ix, uint32_t ehi, uint32_t elo,
+	    bool used)
+{
+	if (mc->mc_slotasid[ix] == 0) {
+		mc->mc_nused++;
+	}
+	tlb_write(ehi, elo, ix);
+	mc->mc_slotasid[ix] = mc->mc_curasid;
+	mc->mc_slotused[ix] = used;
+}
+
+/*
+ * Invalidate slot IX.
+ */
+static
+void
+mmu_clearslot(struct mmu_cpu *mc, unsigned ix)
+{
+	tlb_write(TLBHI_INVALID(ix) | ASID_PID(mc->mc_curasid),
+		  TLBLO_INVALID(), ix);
+	if (mc->mc_slotasid[ix] != 0) {
+		mc->mc_slotasid[ix] = 0;
+		mc->mc_nused--;
+		if (ix < mc->mc_freehint) {
+			mc->mc_freehint = ix;
+		}
+	}
+}
+
+void
+mmu_initas(struct addrspace *as)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		as->as_machdep.am_asid[i] = 0;
+	}
+}
+
+/*
+ * Make AS the address space the processor translates user addresses
+ * with. If it's already loaded there is nothing to do; otherwise it
+ * keeps the ASID it had here if that is still good, and its entries
+ * from last time may still be in the TLB.
+ */
+void
+mmu_activate(struct addrspace *as)
+{
+	struct mmu_cpu *mc;
+	uint32_t asid;
+	int spl;
+
+	spl = splhigh();
+
+	mc = &mmu_cpus[curcpu->c_number];
+	mc->mc_activations++;
+
+	asid = mmu_getasid(as);
+	if (asid != 0 && asid == mc->mc_curasid) {
+		mc->mc_kept++;
+		splx(spl);
+		return;
+	}
+
+	if (asid == 0) {
+		if (mc->mc_lastasid == ASID_MAX) {
+			/* Out of ASIDs; start over with an empty TLB. */
+			mc->mc_generation++;
+			mc->mc_lastasid = 0;
+			mc->mc_rollovers++;
+			mmu_flush();
+		}
+		mc->mc_lastasid++;
+		asid = (mc->mc_generation << TLBHI_PIDSHIFT) | mc->mc_lastasid;
+		as->as_machdep.am_asid[curcpu->c_number] = asid;
+	}
+
+	mc->mc_curasid = asid;
+	mmu_loadpid(asid);
+
+	splx(spl);
+}
+
+/*
+ * Throw away every translation AS has on every CPU, by taking away
+ * its ASIDs; it gets new ones the next time it's activated anywhere.
+ * If it is the address space loaded on this CPU, that happens right
+ * away. The caller must be the only thread running in AS.
+ */
+void
+mmu_forget(struct addrspace *as)
+{
+	struct mmu_cpu *mc;
+	uint32_t asid;
+	int spl;
+
+	spl = splhigh();
+
+	mc = &mmu_cpus[curcpu->c_number];
+	asid = mmu_getasid(as);
+
+	mmu_initas(as);
+	if (asid != 0 && asid == mc->mc_curasid) {
+		mc->mc_curasid = 0;
+		mmu_activate(as);
+	}
+
+	splx(spl);
+}
+
+/*
+ * Load a translation for VA in the current address space. If the TLB
+ * already holds one (e.g. a read-only entry being upgraded) overwrite
+ * it in place, since the same virtual page must never be in two slots
+ * with the same ASID.
+ */
+void
+mmu_map(vaddr_t va, paddr_t pa, bool writeable)
+{
+	struct mmu_cpu *mc;
+	uint32_t ehi, elo;
+	int spl, ix;
+
+	KASSERT((va & PAGE_FRAME) == va);
+	KASSERT((pa & PAGE_FRAME) == pa);
+
+	elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
+	if (writeable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	mc = &mmu_cpus[curcpu->c_number];
+	KASSERT(mc->mc_curasid != 0);
+	mc->mc_refills++;
+
+	ehi = (va & TLBHI_VPAGE) | ASID_PID(mc->mc_curasid);
+	ix = tlb_probe(ehi, 0);
+	if (ix < 0) {
+		ix = mmu_pickslot(mc);
+	}
+	mmu_setslot(mc, ix, ehi, elo, true);
+
+	splx(spl);
+}
+
+/*
+ * Like mmu_map, but only if there is a free TLB slot to put it in.
+ * A translation already loaded for VA is left alone. Returns false
+ * if the TLB is full.
+ */
+bool
+mmu_preload(vaddr_t va, paddr_t pa, bool writeable)
+{
+	struct mmu_cpu *mc;
+	uint32_t ehi, elo;
+	int spl;
+
+	KASSERT((va & PAGE_FRAME) == va);
+	KASSERT((pa & PAGE_FRAME) == pa);
+
+	elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
+	if (writeable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	spl = splhigh();
+
+	mc = &mmu_cpus[curcpu->c_number];
+	KASSERT(mc->mc_curasid != 0);
+	if (mc->mc_nused == NUM_TLB) {
+		splx(spl);
+		return false;
+	}
+
+	ehi = (va & TLBHI_VPAGE) | ASID_PID(mc->mc_curasid);
+	if (tlb_probe(ehi, 0) < 0) {
+		/* Not used yet, so it's the first to go if never touched. */
+		mmu_setslot(mc, mmu_pickslot(mc), ehi, elo, false);
+		mc->mc_preloads++;
+	}
+
+	splx(spl);
+	return true;
+}
+
+/*
+ * Drop this CPU's translation for VA in AS, if there is one. AS need
+ * not be the address space currently loaded.
+ */
+void
+mmu_unmap(struct addrspace *as, vaddr_t va)
+{
+	struct mmu_cpu *mc;
+	uint32_t asid;
+	int spl, ix;
+
+	spl = splhigh();
+
+	mc = &mmu_cpus[curcpu->c_number];
+	asid = mmu_getasid(as);
+	if (asid != 0) {
+		ix = tlb_probe((va & TLBHI_VPAGE) | ASID_PID(asid), 0);
+		if (ix >= 0) {
+			mmu_clearslot(mc, ix);
+		}
+		else if (asid != mc->mc_curasid) {
+			mmu_loadpid(mc->mc_curasid);
+		}
+	}
+
+	splx(spl);
+}
+
+/*
+ * Shootdown batches. The whole batch goes out with interrupts off
+ * (see ipi_tlbshootdown_broadcast), including the part done on this
+ * CPU, so nothing is missed if the caller migrates in between.
+ */
+void
+mmu_batch_init(struct tlbbatch *tb)
+{
+	tb->tb_num = 0;
+}
+
+void
+mmu_batch_add(struct tlbbatch *tb, struct addrspace *as, vaddr_t va)
+{
+	if (tb->tb_num < TLBSHOOTDOWN_MAX) {
+		tb->tb_ts[tb->tb_num].ts_as = as;
+		tb->tb_ts[tb->tb_num].ts_vaddr = va & PAGE_FRAME;
+	}
+	if (tb->tb_num <= TLBSHOOTDOWN_MAX) {
+		tb->tb_num++;
+	}
+}
+
+void
+mmu_batch_send(struct tlbbatch *tb, bool wait)
+{
+	if (tb->tb_num == 0) {
+		return;
+	}
+	if (tb->tb_num > TLBSHOOTDOWN_MAX) {
+		ipi_tlbshootdown_broadcast(NULL, TLBSHOOTDOWN_ALL, wait);
+	}
+	else {
+		ipi_tlbshootdown_broadcast(tb->tb_ts, tb->tb_num, wait);
+	}
+	tb->tb_num = 0;
+}
+
+/*
+ * Drop any translation for VA in AS on every CPU, and don't return
+ * until they're all gone. Used when a page is taken away from a
+ * process that might be running elsewhere, or might have run there
+ * recently enough to still have entries in that TLB.
+ */
+void
+mmu_shootdown(struct addrspace *as, vaddr_t va)
+{
+	struct tlbbatch tb;
+
+	mmu_batch_init(&tb);
+	mmu_batch_add(&tb, as, va);
+	mmu_batch_send(&tb, true);
+}
+
+/*
+ * Drop every translation on this CPU, for all address spaces.
+ */
+void
+mmu_flush(void)
+{
+	struct mmu_cpu *mc;
+	unsigned i;
+	int spl;
+
+	spl = splhigh();
+
+	mc = &mmu_cpus[curcpu->c_number];
+	mc->mc_flushes++;
+
+	for (i=0; i<NUM_TLB; i++) {
+		mmu_clearslot(mc, i);
+	}
+
+	splx(spl);
+}
+
+/*
+ * Print the per-CPU counters. The refill (TLB miss) rate is over the
+ * time since the previous call, so running this before and after a
+ * workload gives the workload's miss rate.
+ */
+void
+mmu_printstats(void)
+{
+	struct mmu_cpu *mc;
+	struct timespec now, elapsed;
+	uint64_t msecs;
+	unsigned i, refills;
+	bool first;
+
+	gettime(&now);
+	first = mmu_lasttime.tv_sec == 0 && mmu_lasttime.tv_nsec == 0;
+	timespec_sub(&now, &mmu_lasttime, &elapsed);
+	mmu_lasttime = now;
+	msecs = elapsed.tv_sec * (uint64_t)1000 + elapsed.tv_nsec / 1000000;
+	if (msecs == 0) {
+		msecs = 1;
+	}
+
+	for (i=0; i<MAXCPUS; i++) {
+		mc = &mmu_cpus[i];
+		if (mc->mc_activations == 0 && mc->mc_refills == 0) {
+			continue;
+		}
+		refills = mc->mc_refills - mmu_lastrefills[i];
+		mmu_lastrefills[i] = mc->mc_refills;
+
+		kprintf("cpu%u: %u refills", i, mc->mc_refills);
+		if (!first) {
+			kprintf(" (%llu/sec)",
+				refills * (uint64_t)1000 / msecs);
+		}
+		kprintf(", %u replacements, %u preloads\n",
+			mc->mc_replaced, mc->mc_preloads);
+		kprintf("      %u activations (%u already loaded), "
+			"%u flushes, %u ASID rollovers\n",
+			mc->mc_activations, mc->mc_kept, mc->mc_flushes,
+			mc->mc_rollovers);
+	}
+	if (!first) {
+		kprintf("Rates are over the last %llu.%03llu seconds.\n",
+			msecs / 1000, msecs % 1000);
+	}
+}
+
+/*
+ * TLB shootdown requests, from other CPUs or from this one via
+ * ipi_tlbshootdown_broadcast.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+	mmu_flush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	mmu_unmap(ts->ts_as, ts->ts_vaddr);
+}
@@ -850,8 +850,9 @@ static
 int
 emufs_mmap(struct vnode *v)
 {
+	/* paged through emufs_read/emufs_write like anything else */
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
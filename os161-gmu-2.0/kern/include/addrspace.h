@@ -36,9 +36,56 @@
 
 
 #include <vm.h>
+#include <kern/vmstat.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
+struct pagetable;
+
+
+/*
+ * A region of an address space: NPAGES pages starting at BASE, with
+ * the given permissions. Regions never overlap and are kept on a
+ * singly-linked list hanging off the address space.
+ *
+ * The permission bits are the same values as the ELF PF_R/PF_W/PF_X
+ * segment flags. Note that the MIPS MMU can only enforce write
+ * permission per page; a region that is executable or readable can
+ * be both read and executed.
+ *
+ * A region may be backed by a file: the FILESIZE bytes starting at
+ * user address FILEBASE come from the vnode at offset FILEOFF, and
+ * are read in page by page as they are first touched. Everything
+ * else in the region is zero-filled on demand.
+ *
+ * Regions made by mmap (VR_MMAP) are instead backed by whole pages of
+ * the file from FILEOFF on, through the page cache; VR_SHARED ones
+ * see and make changes to the file, others get private copies of any
+ * page they write. VR_MAYWRITE says mprotect may add write permission.
+ */
+struct vm_region {
+	vaddr_t vr_base;
+	size_t vr_npages;
+	int vr_perm;
+	int vr_flags;			/* VR_MMAP etc. */
+	struct vnode *vr_vnode;		/* backing file, or NULL */
+	off_t vr_fileoff;		/* file offset of vr_filebase */
+	vaddr_t vr_filebase;		/* first file-backed address */
+	size_t vr_filesize;		/* file-backed length */
+	struct vm_region *vr_next;
+};
+
+#define VR_EXEC		0x1
+#define VR_WRITE	0x2
+#define VR_READ		0x4
+
+#define VR_MMAP		0x1
+#define VR_SHARED	0x2
+#define VR_MAYWRITE	0x4
+
+/* Size of the user stack region (pages are allocated on demand). */
+#define VM_STACKPAGES	1024
 
 
 /*
@@ -58,7 +105,13 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Put stuff here for your VM system */
+        struct lock *as_lock;		/* protects everything below */
+        struct pagetable *as_pt;	/* two-level page table */
+        struct vm_region *as_regions;	/* list of regions */
+        struct vm_region *as_heap;	/* heap region (in as_regions) */
+        vaddr_t as_brk;			/* current break */
+        struct addrspace_machdep as_machdep; /* MMU state (ASIDs) */
+        struct vmstat as_stats;		/* fault counts etc. (vmstat.h) */
 #endif
 };
 
@@ -93,12 +146,28 @@ struct addrspace {
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. Sets up the (empty) heap.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_sbrk   - move the break (the end of the heap) by CHANGE
+ *                bytes, which may be negative, and return the old
+ *                break. Not supported with dumbvm.
+ *
+ *    as_define_backing - make the FILESIZE bytes at VADDR come from
+ *                file V at OFFSET. VADDR must be in a region already
+ *                defined. Used by load_elf instead of reading the
+ *                segments in; not available with dumbvm.
+ *
+ *    as_findregion - return the region containing VADDR, or NULL.
+ *                The caller should hold as_lock.
+ *
+ *    as_mmap/as_munmap/as_mprotect - add, remove, or change file
+ *                mappings, for the system calls of the same names.
+ *                Not supported with dumbvm.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -117,6 +186,21 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_sbrk(struct addrspace *as, intptr_t change,
+                          vaddr_t *oldbrk);
+int               as_mmap(struct addrspace *as, vaddr_t addr, size_t len,
+                          int perm, int flags, struct vnode *v, off_t offset,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+int               as_mprotect(struct addrspace *as, vaddr_t addr, size_t len,
+                              int perm);
+
+#if !OPT_DUMBVM
+int               as_define_backing(struct addrspace *as, vaddr_t vaddr,
+                                    struct vnode *v, off_t offset,
+                                    size_t filesize);
+struct vm_region *as_findregion(struct addrspace *as, vaddr_t vaddr);
+#endif
 
 
 /*
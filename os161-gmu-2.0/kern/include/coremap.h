@@ -0,0 +1,140 @@
+/*
+ * Physical page frame management.
+ */
+
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+struct addrspace;
+struct tlbbatch;
+
+/*
+ * The coremap owns every physical page frame left over after the
+ * kernel image is loaded. It is set up by coremap_bootstrap, which
+ * must be called after ram_bootstrap and before anything calls
+ * kmalloc; from then on ram_stealmem is no longer used.
+ *
+ * Each frame is either free, in use by the kernel, or in use by a
+ * user address space; user frames record their owner and the virtual
+ * address they are mapped at. A frame can also be pinned, which
+ * means the VM system must not touch it (e.g. because I/O is in
+ * progress on it).
+ *
+ * Functions:
+ *
+ *    coremap_alloc - allocate NPAGES physically contiguous frames
+ *                (at most 1024, the largest buddy block).
+ *                If AS is NULL they are kernel frames; otherwise
+ *                they are user frames belonging to AS, mapped
+ *                starting at VADDR. User frames are handed back
+ *                pinned. Returns 0 if no memory is available; for
+ *                user frames this happens while a few frames are
+ *                still held back for the kernel, and the caller is
+ *                expected to evict something and try again.
+ *
+ *    coremap_alloc_zeroed - allocate a single zero-filled frame as
+ *                coremap_alloc would. It comes from the pool of
+ *                frames cleared in advance if possible, and is
+ *                cleared here otherwise.
+ *
+ *    coremap_free - release a run previously returned by
+ *                coremap_alloc. The whole run is freed, unless it is
+ *                a shared user frame, in which case one reference is
+ *                dropped.
+ *
+ *    coremap_share - add a reference to a single user frame, for
+ *                mapping it into another address space (copy-on-write).
+ *
+ *    coremap_claim - if a user frame is no longer shared, make AS and
+ *                VADDR its owner and return true; else return false.
+ *
+ *    coremap_pin/coremap_unpin - set or clear the pinned state of
+ *                a single user frame.
+ *
+ *    coremap_reference - mark a user frame recently used.
+ *
+ *    coremap_age - return whether a user frame was used since the
+ *                last call, and clear the mark. For frames the clock
+ *                passes over (shared ones), whose owner runs its own.
+ *
+ *    coremap_setslot/coremap_takeslot - attach a swap slot holding a
+ *                clean copy of a user frame, or detach and return it.
+ *                A slot still attached when the frame is freed is
+ *                released then.
+ *
+ *    coremap_pickvictim - choose a frame to evict with the clock
+ *                algorithm and mark it busy. Returns false if there
+ *                is none. Frames passed over because they were
+ *                recently used are added to AGED (if not NULL), for
+ *                the caller to shoot down without waiting.
+ *
+ *    coremap_unbusy - finish with a victim: free it if EVICTED is
+ *                true, else just make it available again.
+ *
+ *    coremap_pageout_wait - sleep until free memory is low.
+ *
+ *    coremap_pageout_wanted - true while free memory is below the
+ *                pageout thread's target.
+ *
+ *    coremap_low - true while free memory is below the low water mark,
+ *                i.e. the pageout thread is (or should be) running.
+ *
+ *    coremap_wait - if free memory is low, wake the pageout thread and
+ *                sleep until it is back above the low water mark or
+ *                the pageout thread has finished a pass. Returns
+ *                false without sleeping if memory wasn't low. Used by
+ *                reclaim_wait (see reclaim.h).
+ *
+ *    coremap_zero_wanted - true while the pool of pre-cleared frames
+ *                is short and there is free memory to refill it.
+ *
+ *    coremap_zero_one - clear one free frame and add it to the pool.
+ *                Returns true if more are wanted. Called by the idle
+ *                workers (see thread_fork_idleworkers).
+ *
+ *    coremap_usage - report the number of frames in all, free, and in
+ *                use by user address spaces (now and at most).
+ *
+ *    coremap_printstats - dump frame usage, including the size of
+ *                the zero pool and how often it had a frame ready,
+ *                to the console.
+ *
+ * The kernel heap page functions alloc_kpages and free_kpages (see
+ * vm.h) are implemented on top of these.
+ */
+
+void coremap_bootstrap(void);
+
+paddr_t coremap_alloc(unsigned npages, struct addrspace *as, vaddr_t vaddr);
+paddr_t coremap_alloc_zeroed(struct addrspace *as, vaddr_t vaddr);
+void coremap_free(paddr_t paddr);
+
+void coremap_share(paddr_t paddr);
+bool coremap_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+
+void coremap_pin(paddr_t paddr);
+void coremap_unpin(paddr_t paddr);
+void coremap_reference(paddr_t paddr);
+bool coremap_age(paddr_t paddr);
+
+void coremap_setslot(paddr_t paddr, unsigned slot);
+unsigned coremap_takeslot(paddr_t paddr);
+
+bool coremap_pickvictim(paddr_t *paddr, struct addrspace **as,
+			vaddr_t *vaddr, struct tlbbatch *aged);
+void coremap_unbusy(paddr_t paddr, bool evicted);
+
+void coremap_pageout_wait(void);
+bool coremap_pageout_wanted(void);
+bool coremap_low(void);
+bool coremap_wait(void);
+
+bool coremap_zero_wanted(void);
+bool coremap_zero_one(void);
+
+void coremap_usage(unsigned *total, unsigned *nfree, unsigned *nuser,
+		   unsigned *peakuser);
+void coremap_printstats(void);
+
+
+#endif /* _COREMAP_H_ */
@@ -35,6 +35,9 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+/* Number of scheduler priority levels (see schedule() in thread.c) */
+#define SCHED_NLEVELS 4
+
 
 /*
  * Per-cpu structure
@@ -61,14 +64,19 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_steals;		/* Threads taken from other cpus */
+	unsigned c_pushes;		/* Threads sent to other cpus */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues, by priority */
+	unsigned c_runcount;		/* Threads on all of them */
 	struct spinlock c_runqueue_lock;
+	struct thread *c_idleworker;	/* Runs instead of idling */
+	bool c_idleworker_parked;	/* True if it's waiting to */
 
 	/*
 	 * Accessed by other cpus.
@@ -87,7 +95,16 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdowns_received;	/* Shootdown IPIs handled */
+	unsigned c_shootdowns_sent;	/* Shootdown IPIs sent (by us) */
 	struct spinlock c_ipi_lock;
+
+	/*
+	 * Dead threads kept for reuse (see thread.c).
+	 * Protected by the thread pool lock.
+	 */
+	struct threadlist c_threadpool;
+	struct spinlock c_threadpool_lock;
 };
 
 #define TLBSHOOTDOWN_ALL  (-1)
@@ -152,7 +169,17 @@ void cpu_halt(void);
  *
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
- * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown is like ipi_send but carries NUM TLB shootdowns
+ * (or, if NUM is TLBSHOOTDOWN_ALL, a request to flush everything).
+ * They are added to whatever is already queued for the target, and
+ * if an IPI is already on its way no second one is sent. Returns the
+ * target's c_shootdowns_received as of queueing; the request has been
+ * handled once that count changes.
+ * ipi_tlbshootdown_broadcast does the shootdowns on the current CPU
+ * and sends them to all the others, all in one go with interrupts
+ * off so the caller can't migrate halfway. If WAIT is true, it then
+ * waits (with interrupts on) until every other CPU has handled them.
+ * ipi_printstats prints the per-CPU shootdown counts.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,7 +193,11 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mappings, int num);
+void ipi_tlbshootdown_broadcast(const struct tlbshootdown *mappings, int num,
+				bool wait);
+void ipi_printstats(void);
 
 void interprocessor_interrupt(void);
 
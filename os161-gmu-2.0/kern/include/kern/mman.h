@@ -0,0 +1,20 @@
+/*
+ * Flags for mmap() and mprotect(), shared by kernel and userland.
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/* Protections (PROT_NONE means no access at all) */
+#define PROT_NONE	0
+#define PROT_READ	1
+#define PROT_WRITE	2
+#define PROT_EXEC	4
+
+/* Mapping flags; exactly one of MAP_SHARED and MAP_PRIVATE is given */
+#define MAP_SHARED	0x1	/* writes go to the file */
+#define MAP_PRIVATE	0x2	/* writes are private (copy-on-write) */
+#define MAP_FIXED	0x10	/* use exactly the address given */
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,37 @@
+/*
+ * Virtual memory statistics, as returned by __vmstat().
+ */
+
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/* "which" codes for __vmstat() */
+#define VMSTAT_SELF	0	/* the calling process */
+#define VMSTAT_SYSTEM	1	/* everything, since boot */
+
+/*
+ * Counts are of pages (or page faults). A page fault is either a TLB
+ * miss or a write to a page that isn't writeable yet (clean, or
+ * copy-on-write); only the former are counted in vs_tlbmisses.
+ *
+ * The last three fields are for the whole system either way.
+ */
+struct vmstat {
+	__u32 vs_faults;	/* page faults */
+	__u32 vs_tlbmisses;	/* ...that were TLB misses */
+	__u32 vs_zerofill;	/* pages zero-filled */
+	__u32 vs_pagein;	/* pages read from files */
+	__u32 vs_cachehit;	/* file pages found already in memory */
+	__u32 vs_swapin;	/* pages read back from swap */
+	__u32 vs_swapout;	/* pages written to swap */
+	__u32 vs_evicted;	/* pages taken away to free memory */
+	__u32 vs_cowcopy;	/* copy-on-write pages copied */
+	__u32 vs_cowclaim;	/* ...or taken over without a copy */
+	__u32 vs_resident;	/* pages in memory now */
+	__u32 vs_maxresident;	/* most pages in memory at once */
+	__u32 vs_totalpages;	/* physical pages for general use */
+	__u32 vs_freepages;	/* ...that are free */
+	__u32 vs_userpages;	/* ...that are user pages */
+};
+
+#endif /* _KERN_VMSTAT_H_ */
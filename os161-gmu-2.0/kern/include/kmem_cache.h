@@ -0,0 +1,56 @@
+/*
+ * Object caches.
+ */
+
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * An object cache hands out fixed-size objects that are already in
+ * their constructed state: whatever the constructor sets up (locks,
+ * wait channels, arrays, and so on) is done once when the object is
+ * first made, not on every allocation. The caller must give objects
+ * back in that same state, i.e. undo whatever it changed after
+ * kmem_cache_alloc. Freed objects are kept, up to a limit, for the
+ * next kmem_cache_alloc; beyond that they are destroyed.
+ *
+ * Functions:
+ *
+ *    kmem_cache_create - make a cache of objects of SIZE bytes. CTOR,
+ *                if not NULL, is called on each new object and
+ *                returns an error code; DTOR, if not NULL, is called
+ *                on each object before its memory is released.
+ *                NAME is for diagnostics and should be a string
+ *                constant. Returns NULL if out of memory.
+ *
+ *    kmem_cache_destroy - destroy a cache. All its objects must have
+ *                been freed.
+ *
+ *    kmem_cache_alloc - get an object. Returns NULL if out of memory
+ *                (or if the constructor failed).
+ *
+ *    kmem_cache_free - give an object back.
+ *
+ *    kmem_cache_reap - destroy the objects kept for reuse, in every
+ *                cache, until NPAGES pages' worth are gone. A
+ *                shrinker for memory reclaim (see reclaim.h).
+ *
+ *    kmem_cache_printstats - print how often each cache had to
+ *                construct a new object.
+ */
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+unsigned kmem_cache_reap(unsigned npages);
+
+void kmem_cache_printstats(void);
+
+
+#endif /* _KMEM_CACHE_H_ */
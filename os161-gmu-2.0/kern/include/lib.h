@@ -125,10 +125,15 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ * kheap_magstats prints the per-CPU magazine hit rates.
+ * kheap_shrink frees heap pages held only by the magazines; it is a
+ * shrinker for memory reclaim (see reclaim.h).
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_magstats(void);
+unsigned kheap_shrink(unsigned npages);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
@@ -0,0 +1,84 @@
+/*
+ * Shared file pages.
+ */
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+struct vnode;
+struct uio;
+struct addrspace;
+
+/*
+ * File pages that are mapped into user address spaces are kept in a
+ * cache indexed by file and offset, so that everyone mapping the same
+ * part of a file maps the same frame instead of reading a copy of
+ * their own. This is used for program text (and other read-only
+ * segments), which is then shared by every process running the same
+ * executable, and for mmap. Mapped cache pages are marked PTE_CACHED
+ * in the page table.
+ *
+ * A cached page is identified by its vnode V, the file offset OFFSET
+ * of its first file-backed byte, where in the page that byte goes
+ * (PGOFF), and how many bytes come from the file (LEN); the rest of
+ * the page is zero. A whole page (PGOFF 0, LEN PAGE_SIZE) is a plain
+ * page of the file: it may run past the end of the file, and only
+ * whole pages can be written to (by MAP_SHARED mappings) or are kept
+ * coherent with read() and write().
+ *
+ * Each mapping holds a reference to the frame, and the cache holds
+ * one more, so the ordinary pageout clock never picks cached frames.
+ * Instead the cache records every mapping of each page and
+ * pagecache_shrink takes pages away from all their mappers at once.
+ * A page is also dropped when its last mapping goes away. Dirty pages
+ * are written back to the file (but never past its end) then. Since
+ * each mapping region holds a reference to V, the cache is always
+ * empty for V by the time V can be reclaimed.
+ *
+ * Functions:
+ *
+ *    pagecache_bootstrap - set up. Call from vm_bootstrap.
+ *
+ *    pagecache_get - find the page, or read it into a frame got with
+ *                vm_allocpage(AS, VA, ...), and return its frame with
+ *                a reference added for the mapping at VA in AS. The
+ *                caller holds AS's lock and must enter the mapping in
+ *                the page table before releasing it.
+ *
+ *    pagecache_dup - add a mapping at VA in AS of the cached frame PA
+ *                (e.g. when forking). The same locking rules apply.
+ *
+ *    pagecache_put - drop the mapping at VA in AS of PA; DIRTY says
+ *                whether it was written through. The caller holds
+ *                AS's lock and has already removed the translation
+ *                from every TLB.
+ *
+ *    pagecache_shrink - for the pageout thread: evict up to NPAGES
+ *                pages that haven't been used lately, writing back
+ *                dirty ones. Returns the number of frames freed.
+ *
+ *    pagecache_rw - do a read or write on V, using the cached copy of
+ *                any whole pages V has in the cache so that the data
+ *                seen through mappings and through read/write agree.
+ *                Used by the read and write system calls.
+ *
+ *    pagecache_printstats - print usage and hit counts.
+ */
+
+void pagecache_bootstrap(void);
+
+int pagecache_get(struct vnode *v, off_t offset, unsigned pgoff,
+		  unsigned len, struct addrspace *as, vaddr_t va,
+		  paddr_t *ret);
+int pagecache_dup(paddr_t pa, struct addrspace *as, vaddr_t va);
+void pagecache_put(paddr_t pa, struct addrspace *as, vaddr_t va,
+		   bool dirty);
+
+unsigned pagecache_shrink(unsigned npages);
+
+int pagecache_rw(struct vnode *v, struct uio *uio);
+
+void pagecache_printstats(void);
+
+
+#endif /* _PAGECACHE_H_ */
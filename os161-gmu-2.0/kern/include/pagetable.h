@@ -0,0 +1,79 @@
+/*
+ * Two-level user page tables.
+ */
+
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+#include <vm.h>
+
+/*
+ * A page table entry is one 32-bit word. When PTE_VALID is set the
+ * page is resident and the top 20 bits hold its physical frame. When
+ * PTE_SWAPPED is set instead, they hold the swap slot the page was
+ * written to. An entry of 0 means the page has not been touched (or
+ * was clean and dropped), and is refilled from the region's backing.
+ *
+ * PTE_DIRTY means the resident page differs from its backing copy
+ * (swap slot, file, or zeros). The MIPS has no hardware dirty bit, so
+ * clean pages are mapped read-only and the first write sets it.
+ *
+ * PTE_CACHED means the frame is a file page shared through the page
+ * cache (see pagecache.h), and its reference must be dropped with
+ * pagecache_put rather than coremap_free. MAP_PRIVATE mappings of
+ * such pages also have PTE_COW set.
+ */
+typedef uint32_t pte_t;
+
+#define PTE_FRAME	0xfffff000	/* physical frame address / swap slot */
+#define PTE_VALID	0x00000001	/* page is in memory */
+#define PTE_COW		0x00000002	/* frame may be shared; copy on write */
+#define PTE_DIRTY	0x00000004	/* modified since paged in */
+#define PTE_SWAPPED	0x00000008	/* page is in swap */
+#define PTE_CACHED	0x00000010	/* frame is in the page cache */
+
+#define PTE_PADDR(pte)	((paddr_t)((pte) & PTE_FRAME))
+#define PTE_SLOT(pte)	((unsigned)(pte) >> 12)
+#define PTE_MKSWAP(slot) (((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+/*
+ * The top ten bits of a user address index the directory, the next
+ * ten index a second-level table, so each second-level table is
+ * exactly one page. User space ends at 2G, so only half of the
+ * directory is ever used and it fits in a single kmalloc block.
+ */
+#define PT_L1SHIFT	22
+#define PT_L2SHIFT	12
+#define PT_L2SIZE	(PAGE_SIZE / sizeof(pte_t))
+#define PT_L1SIZE	(USERSPACETOP >> PT_L1SHIFT)
+
+#define PT_L1INDEX(va)	((va) >> PT_L1SHIFT)
+#define PT_L2INDEX(va)	(((va) >> PT_L2SHIFT) & (PT_L2SIZE - 1))
+
+struct pagetable {
+	pte_t *pt_dir[PT_L1SIZE];	/* second-level tables, or NULL */
+};
+
+/*
+ * Functions in pagetable.c:
+ *
+ *    pt_create - make an empty page table. Returns NULL if out of
+ *                memory.
+ *
+ *    pt_destroy - free the table pages. The caller is responsible for
+ *                releasing whatever the entries point to first.
+ *
+ *    pt_lookup - return a pointer to the PTE for user address VA. If
+ *                there is no second-level table for VA, one is
+ *                allocated if CREATE is true; otherwise (or if that
+ *                allocation fails) NULL is returned.
+ *
+ * The page table has no lock of its own; it is protected by the lock
+ * of the address space that owns it.
+ */
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t va, bool create);
+
+
+#endif /* _PAGETABLE_H_ */
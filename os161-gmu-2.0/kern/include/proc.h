@@ -106,4 +106,14 @@ struct addrspace *proc_setas(struct addrspace *);
 
 struct proc* proc_getProc(pid_t pid);
 
+/*
+ * Make CHILD a child of PARENT, for fork; or undo that, if the fork
+ * fails after all. Both are done under ptable_lk.
+ */
+int proc_addchild(struct proc *parent, struct proc *child);
+void proc_remchild(struct proc *child);
+
+/* Free an exited child once waitpid has its exit status. */
+void proc_reap(struct proc *child);
+
 #endif /* _PROC_H_ */
@@ -0,0 +1,61 @@
+/*
+ * Memory reclaim.
+ */
+
+#ifndef _RECLAIM_H_
+#define _RECLAIM_H_
+
+/*
+ * Parts of the kernel that hold on to memory they could do without
+ * (caches of threads, objects, heap blocks, file pages) register a
+ * shrinker: a function that frees up to NPAGES pages' worth of it and
+ * returns how many pages it actually gave back to the coremap. The
+ * shrinkers are run, in the order they were registered (so cheapest
+ * first), by the pageout thread whenever free memory falls below the
+ * low water mark, and directly by anyone whose allocation fails.
+ *
+ * A kernel page allocation that fails doesn't give up at once: if the
+ * caller can sleep, it runs the shrinkers itself and then waits for
+ * the pageout thread to make room, for up to RECLAIM_TIMEOUT seconds,
+ * before returning NULL. Threads that are themselves reclaiming
+ * memory (t_reclaiming) never wait, since they would be waiting for
+ * themselves.
+ *
+ * Functions:
+ *
+ *    reclaim_bootstrap - register the kernel's own shrinkers and allow
+ *                allocations to wait from then on. Call once the
+ *                clock is running.
+ *
+ *    reclaim_register - add a shrinker. NAME is for the statistics
+ *                and should be a string constant.
+ *
+ *    reclaim_run - run shrinkers until NPAGES pages have been freed or
+ *                every one has been tried. Returns the pages freed.
+ *
+ *    reclaim_wait - for an allocator whose allocation of NPAGES pages
+ *                just failed: reclaim and/or wait for memory, and
+ *                return true if it is worth trying again. DEADLINE
+ *                must be 0 before the first call; it is used to keep
+ *                track of the timeout across retries.
+ *
+ *    reclaim_throttle - if free memory is low, wait (up to the
+ *                timeout) until it isn't. For fork, so that a burst
+ *                of new processes slows down instead of running the
+ *                system out of memory.
+ *
+ *    reclaim_printstats - print counts for each shrinker and for the
+ *                waiting done by allocators.
+ */
+
+#define RECLAIM_TIMEOUT	3	/* seconds */
+
+void reclaim_bootstrap(void);
+void reclaim_register(const char *name, unsigned (*shrink)(unsigned npages));
+unsigned reclaim_run(unsigned npages);
+bool reclaim_wait(unsigned npages, time_t *deadline);
+void reclaim_throttle(void);
+void reclaim_printstats(void);
+
+
+#endif /* _RECLAIM_H_ */
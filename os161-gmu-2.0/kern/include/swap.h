@@ -0,0 +1,40 @@
+/*
+ * Swap space.
+ */
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Pages are swapped to the raw disk device named by SWAP_DEVICE,
+ * one page per slot. If the device can't be opened at boot the
+ * system runs without swap and swap_alloc always fails.
+ *
+ * Functions:
+ *
+ *    swap_bootstrap - open the swap device. Call from vm_bootstrap.
+ *
+ *    swap_alloc - reserve a free slot; returns ENOSPC if there is
+ *                none.
+ *
+ *    swap_free - release a slot.
+ *
+ *    swap_in/swap_out - read/write one page between slot SLOT and
+ *                physical page PA. These sleep; the caller should
+ *                make sure the frame can't go away meanwhile.
+ */
+
+#define SWAP_DEVICE	"lhd1raw:"
+
+#define SWAP_NOSLOT	((unsigned)-1)
+
+void swap_bootstrap(void);
+
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+
+int swap_in(unsigned slot, paddr_t pa);
+int swap_out(unsigned slot, paddr_t pa);
+
+
+#endif /* _SWAP_H_ */
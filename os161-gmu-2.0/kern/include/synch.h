@@ -71,14 +71,26 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * lk_owner is the holder's struct thread pointer, or 0 when the lock
+ * is free, so taking and dropping an uncontended lock is a single
+ * compare-and-swap. Its low bit (LOCK_WAITERS in synch.c) is set when
+ * some thread may be asleep on lk_wchan; only then does lock_release
+ * need spin_lock, which protects lk_wchan.
+ *
+ * Threads asleep waiting for a lock lend their scheduling priority to
+ * whoever holds it, and on through any locks that thread is waiting
+ * for in turn, until it lets go (see synch.c).
  */
 struct lock {
         char *lk_name;
+        volatile spinlock_data_t lk_owner;
         struct wchan* lk_wchan;
 	    struct spinlock spin_lock;
-        volatile spinlock_data_t lk_busy;
-        struct cpu* lk_cpu;
-        struct thread* lk_thread;
+        uint64_t lk_acqtime;    /* when acquired, for lockstat; or 0 */
+        unsigned lk_waitprio;   /* best priority asleep on it */
+        struct lock *lk_lendnext; /* next on holder's t_lentlocks */
+        bool lk_lending;        /* on holder's t_lentlocks */
 };
 
 struct lock *lock_create(const char *name);
@@ -92,12 +104,27 @@ void lock_destroy(struct lock *);
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
  *                   false otherwise.
+ *    lock_tryacquire - Get the lock if it is free and return true;
+ *                   otherwise return false without waiting.
  *
  * These operations must be atomic. You get to write them.
  */
 void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
+bool lock_tryacquire(struct lock *);
+
+/*
+ * Lock statistics:
+ *    lockstat_enable - start (from zero) or stop timing every lock
+ *                   acquisition: how often locks were found held,
+ *                   whether the waiter got the lock by spinning or had
+ *                   to sleep, and how long locks were waited for and
+ *                   held. This slows locking down noticeably.
+ *    lockstat_print - print the figures.
+ */
+void lockstat_enable(bool on);
+void lockstat_print(void);
 
 
 /*
@@ -141,4 +168,11 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Call once during system startup, before anything creates a lock or
+ * CV, to set up the object caches they come from.
+ */
+void synch_bootstrap(void);
+
+
 #endif /* _SYNCH_H_ */
@@ -76,5 +76,12 @@ void sys__exit(int exitcode);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t* retval);
 int sys_fork(struct trapframe* tf, pid_t* retval);
 
+int sys_sbrk(intptr_t change, int *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_mprotect(userptr_t addr, size_t len, int prot);
+int sys___vmstat(int which, userptr_t buf);
+
 
 #endif /* _SYSCALL_H_ */
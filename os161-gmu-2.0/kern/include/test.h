@@ -57,6 +57,8 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int lockspeed(int, char **);
+int pitest(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -72,6 +74,7 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmalloctest5(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
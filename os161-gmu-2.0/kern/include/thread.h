@@ -41,6 +41,7 @@
 #include <threadlist.h>
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -83,6 +84,10 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_priority;		/* Scheduler level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_inherited;		/* Level lent by lock waiters */
+	unsigned t_runlevel;		/* Run queue it's on, if any */
 
 	/*
 	 * Interrupt state fields.
@@ -105,6 +110,10 @@ struct thread {
 	 * Public fields
 	 */
 
+	bool t_reclaiming;		/* Freeing memory; mustn't wait for it */
+	struct lock *t_waitlock;	/* Lock it's asleep waiting for */
+	struct lock *t_lentlocks;	/* Held locks lending it priority */
+
 	/* add more here as needed */
 };
 
@@ -157,16 +166,69 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Return true if thread T is running on a cpu right now. This is only
+ * a hint, for deciding whether to wait for T by spinning; it may be
+ * out of date by the time it returns.
+ */
+bool thread_isrunning(struct thread *t);
+
+/*
+ * Priority inheritance, for locks (see synch.c). A thread runs at the
+ * better (lower) of its own scheduler level and the level lent to it
+ * by threads waiting for locks it holds.
+ *
+ *    thread_priority - return T's effective level.
+ *    thread_inherit - set the level lent to T, replacing any lent
+ *                   before; SCHED_NLEVELS means none. If T is on a
+ *                   run queue it moves to its new level's queue.
+ */
+unsigned thread_priority(struct thread *t);
+void thread_inherit(struct thread *t, unsigned priority);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
+/*
+ * Charge the current thread for a hardclock, and switch to another
+ * if it has used up its time slice or a higher-priority thread is
+ * waiting. Called from the timer interrupt.
+ */
+void thread_tick(void);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
  */
 void thread_consider_migration(void);
 
+/*
+ * Free the threads (and stacks) that each cpu keeps around for reuse
+ * by thread_fork, until at least NPAGES pages are freed or the pools
+ * are empty. A shrinker for memory reclaim (see reclaim.h). Returns
+ * the number of pages freed.
+ */
+unsigned thread_pool_shrink(unsigned npages);
+
+/*
+ * Give every cpu a kernel thread, named NAME, to run when the cpu
+ * would otherwise go idle. It is only run if WANTED returns true;
+ * it then calls WORK, which should do a small piece of work and
+ * return true if there is more to do, until WORK returns false or
+ * some other thread becomes runnable. WANTED is called from the
+ * scheduler with the run queue locked and must not sleep or take
+ * locks. Returns an error code.
+ */
+int thread_fork_idleworkers(const char *name, bool (*wanted)(void),
+                            bool (*work)(void));
+
+/*
+ * Print, for each cpu, how many threads are waiting at each priority
+ * level and how many have been stolen by it and pushed away from it.
+ */
+void thread_printstats(void);
+
 
 #endif /* _THREAD_H_ */
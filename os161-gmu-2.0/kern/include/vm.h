@@ -51,6 +51,9 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/* Get a pinned user frame, paging something out if necessary */
+paddr_t vm_allocpage(struct addrspace *as, vaddr_t va, bool zero);
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
@@ -59,5 +62,54 @@ void free_kpages(vaddr_t addr);
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/*
+ * A batch of user pages to drop from every TLB with one round of
+ * shootdown IPIs. Filled in by mmu_batch_add; once more than
+ * TLBSHOOTDOWN_MAX pages have been added, sending it flushes every
+ * TLB instead.
+ */
+struct tlbbatch {
+	unsigned tb_num;
+	struct tlbshootdown tb_ts[TLBSHOOTDOWN_MAX];
+};
+
+/*
+ * Machine-dependent MMU operations, used by the machine-independent
+ * VM code (not by dumbvm). Except for mmu_shootdown these only affect
+ * the current CPU.
+ *
+ *    mmu_initas - set up the machine-dependent part of a new address
+ *              space.
+ *    mmu_activate - switch the processor to address space AS.
+ *    mmu_forget - drop all of AS's translations on all CPUs. AS must
+ *              not be running anywhere but on the current CPU.
+ *    mmu_map - install a translation for user page VA to physical
+ *              page PA in the current address space, writeable or
+ *              not, replacing any existing one.
+ *    mmu_preload - like mmu_map, but only if a TLB slot is free;
+ *              returns false if none is.
+ *    mmu_unmap - drop any translation for VA in AS.
+ *    mmu_shootdown - drop any translation for VA in AS on all CPUs,
+ *              waiting until it is gone everywhere.
+ *    mmu_batch_init/mmu_batch_add/mmu_batch_send - the same for a
+ *              batch of pages at once. mmu_batch_send only waits for
+ *              the other CPUs if WAIT is true; pass false when stale
+ *              entries do no harm for a while (for instance if the
+ *              point is just to make the next access fault).
+ *    mmu_flush - drop all user translations.
+ *    mmu_printstats - print TLB statistics.
+ */
+void mmu_initas(struct addrspace *as);
+void mmu_activate(struct addrspace *as);
+void mmu_forget(struct addrspace *as);
+void mmu_map(vaddr_t va, paddr_t pa, bool writeable);
+bool mmu_preload(vaddr_t va, paddr_t pa, bool writeable);
+void mmu_unmap(struct addrspace *as, vaddr_t va);
+void mmu_shootdown(struct addrspace *as, vaddr_t va);
+void mmu_batch_init(struct tlbbatch *tb);
+void mmu_batch_add(struct tlbbatch *tb, struct addrspace *as, vaddr_t va);
+void mmu_batch_send(struct tlbbatch *tb, bool wait);
+void mmu_flush(void);
+void mmu_printstats(void);
 
 #endif /* _VM_H_ */
@@ -0,0 +1,54 @@
+/*
+ * VM event counters.
+ */
+
+#ifndef _VMSTAT_H_
+#define _VMSTAT_H_
+
+#include <kern/vmstat.h>
+#include <platform/maxcpus.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+
+struct addrspace;
+
+/*
+ * Every address space has a struct vmstat (as_stats), and so does
+ * every CPU. VMSTAT_COUNT bumps a counter in both, for an event in
+ * AS that happened on the current CPU. The address space counters
+ * are protected by its lock, which the VM code holds anyway; the CPU
+ * ones need no lock, only interrupts off so that we can't be moved
+ * to another CPU halfway through.
+ *
+ * Only the event counters of the per-CPU copies are used; resident
+ * set sizes are kept per address space by vmstat_resident.
+ *
+ * Functions:
+ *
+ *    vmstat_resident - AS has gained (or, if negative, lost) DELTA
+ *                resident pages. The caller holds AS's lock.
+ *
+ *    vmstat_get - fill in VS for AS (which must be locked), or for
+ *                the whole system if AS is NULL.
+ *
+ *    vmstat_printstats - print the system counters, per CPU and in
+ *                total, and the change since the previous call.
+ */
+
+extern struct vmstat vmstat_cpus[MAXCPUS];
+
+#define VMSTAT_COUNT(as, field) \
+	do { \
+		int vmstat_spl = splhigh(); \
+		(as)->as_stats.field++; \
+		vmstat_cpus[curcpu->c_number].field++; \
+		splx(vmstat_spl); \
+	} while (0)
+
+void vmstat_resident(struct addrspace *as, int delta);
+void vmstat_get(struct addrspace *as, struct vmstat *vs);
+void vmstat_printstats(void);
+
+
+#endif /* _VMSTAT_H_ */
@@ -57,6 +57,8 @@ struct vnode {
 	void *vn_data;                  /* Filesystem-specific data */
 
 	const struct vnode_ops *vn_ops; /* Functions on this vnode */
+
+	unsigned vn_npages;             /* Pages in the page cache */
 };
 
 /*
@@ -120,9 +122,10 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check that the file can be mapped into memory.
+ *                      The mapping itself is set up by the VM system,
+ *                      which reads and writes the file's pages through
+ *                      the page cache with vop_read and vop_write.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
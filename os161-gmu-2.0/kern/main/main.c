@@ -43,8 +43,11 @@
 #include <current.h>
 #include <synch.h>
 #include <vm.h>
+#include <coremap.h>
+#include <reclaim.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <openfile.h>
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
@@ -107,10 +110,14 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	coremap_bootstrap();
+	synch_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
+	reclaim_bootstrap();
 	vfs_bootstrap();
+	openfile_bootstrap();
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -41,7 +41,15 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <coremap.h>
+#include <vm.h>
+#include <cpu.h>
+#include <kmem_cache.h>
+#include <pagecache.h>
+#include <vmstat.h>
+#include <reclaim.h>
 #include "opt-synchprobs.h"
+#include "opt-dumbvm.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "synch.h"
@@ -392,6 +400,30 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapmagstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_magstats();
+
+	return 0;
+}
+
+static
+int
+cmd_kmemcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kmem_cache_printstats();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -404,6 +436,101 @@ cmd_kheapgeneration(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_threadstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_reclaimstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	reclaim_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lockstat_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		lockstat_enable(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		lockstat_enable(false);
+	}
+	else {
+		kprintf("Usage: lks [on|off]\n");
+	}
+
+	return 0;
+}
+
+#if !OPT_DUMBVM
+static
+int
+cmd_tlbstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	mmu_printstats();
+	ipi_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_pagecachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	pagecache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vmstat_printstats();
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapdump(int nargs, char **args)
@@ -485,6 +612,7 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] kmalloc throughput test       ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -495,6 +623,8 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
+	"[sy5] Uncontended lock speed        ",
+	"[sy6] Lock priority inversion test  ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
 	"[fs3] FS write stress               ",
@@ -527,8 +657,19 @@ static const char *mainmenu[] = {
 	"[sp2] Bathroom                      ",
 #endif
 	"[kh] Kernel heap stats              ",
+	"[khmag] Kernel heap magazine stats  ",
+	"[kc] Kernel object cache stats      ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[rq] Run queue and migration stats  ",
+	"[cm] Coremap frame usage            ",
+	"[rc] Memory reclaim stats           ",
+	"[lks] Lock stats [on|off]           ",
+#if !OPT_DUMBVM
+	"[tlb] TLB statistics                ",
+	"[pc] Page cache stats               ",
+	"[vm] Page fault and paging stats    ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -583,8 +724,19 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "khmag",      cmd_kheapmagstats },
+	{ "kc",         cmd_kmemcachestats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "rq",         cmd_threadstats },
+	{ "cm",         cmd_coremapstats },
+	{ "rc",         cmd_reclaimstats },
+	{ "lks",        cmd_lockstats },
+#if !OPT_DUMBVM
+	{ "tlb",        cmd_tlbstats },
+	{ "pc",         cmd_pagecachestats },
+	{ "vm",         cmd_vmstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -594,6 +746,7 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -606,6 +759,8 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	lockspeed },
+	{ "sy6",	pitest },
 
 	/* file system assignment tests */
 	{ "fs1",	fstest },
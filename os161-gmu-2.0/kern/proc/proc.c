@@ -53,12 +53,19 @@
 #include <vnode.h>
 #include <filetable.h>
 #include <synch.h>
+#include <kmem_cache.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Proc structures come from here with their spinlock, thread and child
+ * arrays, and waitpid lock and CV already set up.
+ */
+static struct kmem_cache *proc_cache;
+
 static struct procarray proc_table;
 struct lock* ptable_lk;
 
@@ -66,6 +73,47 @@ static unsigned int num_processes;
 static struct lock* num_proc_lk;
 struct semaphore* no_proc_sem;
 
+/*
+ * Object cache constructor for struct proc.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->p_waitpid_lk = lock_create("p_waitpid_lk");
+	if (proc->p_waitpid_lk == NULL) {
+		return ENOMEM;
+	}
+	proc->p_waitpid_cv = cv_create("p_waitpid_cv");
+	if (proc->p_waitpid_cv == NULL) {
+		lock_destroy(proc->p_waitpid_lk);
+		return ENOMEM;
+	}
+
+	threadarray_init(&proc->p_threads);
+	procarray_init(&proc->p_children);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+/*
+ * Object cache destructor for struct proc.
+ */
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_cleanup(&proc->p_lock);
+	procarray_cleanup(&proc->p_children);
+	threadarray_cleanup(&proc->p_threads);
+	cv_destroy(proc->p_waitpid_cv);
+	lock_destroy(proc->p_waitpid_lk);
+}
+
 /*
  * Create a proc structure.
  */
@@ -79,18 +127,18 @@ proc_create(const char *name)
     }
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+	KASSERT(procarray_num(&proc->p_children) == 0);
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -123,22 +171,9 @@ proc_create(const char *name)
 
     // initialize other fields
     proc->p_parent = NULL;
-    procarray_init(&proc->p_children);
     proc->p_exitstatus = 0;
     proc->p_exitable = false;
 
-    proc->p_waitpid_lk = lock_create("p_waitpid_lk");
-    if (proc->p_waitpid_lk == NULL)
-    {
-        panic("proc_create(): failed to create p_waitpid_lk");
-    }
-
-    proc->p_waitpid_cv = cv_create("p_waitpid_cv");
-    if (proc->p_waitpid_cv == NULL)
-    {
-        panic("proc_create(): failed to create p_waitpid_cv");
-    }
-
     // increment number of processes
     if (proc->p_pid != 0)
     {
@@ -150,6 +185,21 @@ proc_create(const char *name)
 	return proc;
 }
 
+/*
+ * Return a dead proc to proc_cache, freeing its pid; the lock, cv,
+ * and arrays stay set up for the next proc_create. The caller holds
+ * ptable_lk.
+ */
+static
+void
+proc_free(struct proc *proc)
+{
+    KASSERT(lock_do_i_hold(ptable_lk));
+    procarray_set(&proc_table, proc->p_pid, NULL);
+    procarray_setsize(&proc->p_children, 0);
+    kmem_cache_free(proc_cache, proc);
+}
+
 /*
  * Destroy a proc structure.
  *
@@ -234,61 +284,80 @@ proc_destroy(struct proc *proc)
 		as_destroy(as);
 	}
 
-	threadarray_cleanup(&proc->p_threads);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	kfree(proc->p_name);
 
-    // detach all children from this process
-    spinlock_acquire(&proc->p_lock);
+    // decrement the process count, kproc is not included
+    // in this count
+    lock_acquire(num_proc_lk);
+    KASSERT(num_processes > 0);
+    num_processes--;
+    if (num_processes == 0)
+    {
+        V(no_proc_sem);
+    }
+    lock_release(num_proc_lk);
+
+    // Parent/child links are changed under ptable_lk (see
+    // proc_addchild). Children that already exited can't be waited
+    // for any more, so free them; the others free themselves.
+    lock_acquire(ptable_lk);
     for (unsigned i=0; i<procarray_num(&proc->p_children); i++)
     {
         struct proc* temp = procarray_get(&proc->p_children, i);
         KASSERT(temp != NULL);
         temp->p_parent = NULL;
-    }
-    spinlock_release(&proc->p_lock);
-
-    // detach this process from it's parent
-    struct proc* parent = proc->p_parent;
-    if (parent != NULL)
-    {
-        spinlock_acquire(&parent->p_lock);
-        for (unsigned i = 0; i < procarray_num(&parent->p_children); i++)
+        if (temp->p_exitable)
         {
-            struct proc* child = procarray_get(&proc_table, i);
-            if (child->p_pid == proc->p_pid)
-            {
-                procarray_remove(&parent->p_children, i);
-                break;
-            }
+            proc_free(temp);
         }
-        spinlock_release(&parent->p_lock);
     }
+    procarray_setsize(&proc->p_children, 0);
 
-	spinlock_cleanup(&proc->p_lock);
-
-    // delete this process from the process table if this proccess
-    // has no parent
-    if ( parent == NULL)
+    // With no parent to wait for us, go straight back to the cache.
+    // Otherwise stay on the parent's p_children until its waitpid
+    // reaps us; this must be the last we touch proc, since the
+    // parent can free it as soon as we let go of ptable_lk.
+    if (proc->p_parent == NULL)
     {
-        lock_destroy(proc->p_waitpid_lk);
-        cv_destroy(proc->p_waitpid_cv);
-        lock_acquire(ptable_lk);
-        procarray_set(&proc_table, proc->p_pid, NULL);
-        lock_release(ptable_lk);
-        kfree(proc);
+        proc_free(proc);
     }
+    else
+    {
+        lock_acquire(proc->p_waitpid_lk);
+        proc->p_exitable = true;
+        cv_broadcast(proc->p_waitpid_cv, proc->p_waitpid_lk);
+        lock_release(proc->p_waitpid_lk);
+    }
+    lock_release(ptable_lk);
+}
 
-    // decrement the process count, kproc is not included
-    // in this count
-    lock_acquire(num_proc_lk);
-    KASSERT(num_processes > 0);
-    num_processes--;
-    if (num_processes == 0)
+/*
+ * Reap an exited child for waitpid: unlink it from its parent and
+ * free it.
+ */
+void
+proc_reap(struct proc *child)
+{
+    struct proc* parent;
+
+    KASSERT(child->p_exitable);
+
+    lock_acquire(ptable_lk);
+    parent = child->p_parent;
+    KASSERT(parent != NULL);
+    for (unsigned i = 0; i < procarray_num(&parent->p_children); i++)
     {
-        V(no_proc_sem);
+        if (procarray_get(&parent->p_children, i) == child)
+        {
+            procarray_remove(&parent->p_children, i);
+            break;
+        }
     }
-    lock_release(num_proc_lk);
+    child->p_parent = NULL;
+    proc_free(child);
+    lock_release(ptable_lk);
 }
 
 /*
@@ -297,6 +366,12 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+    proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+                                   proc_ctor, proc_dtor);
+    if (proc_cache == NULL) {
+        panic("kmem_cache_create for proc_cache failed\n");
+    }
+
     procarray_init(&proc_table);
     ptable_lk = lock_create("ptable_lock");
     if (ptable_lk == NULL) {
@@ -391,8 +466,6 @@ proc_fork(struct proc **ret)
 	if (tbl != NULL) {
 		result = filetable_copy(tbl, &proc->p_filetable);
 		if (result) {
-			as_destroy(proc->p_addrspace);
-			proc->p_addrspace = NULL;
 			proc_destroy(proc);
 			return result;
 		}
@@ -530,11 +603,51 @@ proc_getProc(pid_t pid)
     for (unsigned i=0; i<procarray_num(&proc_table); i++)
     {
         ret = procarray_get(&proc_table, i);
-        if (ret->p_pid == pid)
+        if (ret != NULL && ret->p_pid == pid)
         {
             break;
         }
+        ret = NULL;
     }
     lock_release(ptable_lk);
     return ret;
 }
+
+int
+proc_addchild(struct proc *parent, struct proc *child)
+{
+    int result;
+
+    KASSERT(child->p_parent == NULL);
+
+    lock_acquire(ptable_lk);
+    result = procarray_add(&parent->p_children, child, NULL);
+    if (result == 0)
+    {
+        child->p_parent = parent;
+    }
+    lock_release(ptable_lk);
+    return result;
+}
+
+void
+proc_remchild(struct proc *child)
+{
+    struct proc* parent;
+
+    lock_acquire(ptable_lk);
+    parent = child->p_parent;
+    if (parent != NULL)
+    {
+        for (unsigned i = 0; i < procarray_num(&parent->p_children); i++)
+        {
+            if (procarray_get(&parent->p_children, i) == child)
+            {
+                procarray_remove(&parent->p_children, i);
+                break;
+            }
+        }
+        child->p_parent = NULL;
+    }
+    lock_release(ptable_lk);
+}
@@ -48,6 +48,8 @@
 #include <openfile.h>
 #include <filetable.h>
 #include <syscall.h>
+#include <pagecache.h>
+#include "opt-dumbvm.h"
 
 /*
  * open() - get the path with copyinstr, then use openfile_open and
@@ -107,7 +109,8 @@ sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval)
 /*
  * Common logic for read and write.
  *
- * Look up the fd, then use VOP_READ or VOP_WRITE.
+ * Look up the fd, then use VOP_READ or VOP_WRITE, going through the
+ * page cache so that we agree with anyone who has the file mapped.
  */
 static
 int
@@ -146,9 +149,13 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 	uio_uinit(&iov, &useruio, buf, size, pos, rw);
 
 	/* do the read or write */
+#if OPT_DUMBVM
 	result = (rw == UIO_READ) ?
 		VOP_READ(file->of_vnode, &useruio) :
 		VOP_WRITE(file->of_vnode, &useruio);
+#else
+	result = pagecache_rw(file->of_vnode, &useruio);
+#endif
 	if (result) {
 		goto fail;
 	}
@@ -59,6 +59,7 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-dumbvm.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -73,7 +74,12 @@
  * executable whose load address is in kernel space. If you should
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
+ *
+ * Only dumbvm loads segments eagerly; the real VM system just records
+ * where each segment lives in the file (see below) and pages it in
+ * on demand.
  */
+#if OPT_DUMBVM
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -144,6 +150,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -288,9 +295,24 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_DUMBVM
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#else
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > "
+				"segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		/*
+		 * Text and data are read from V on first touch; the
+		 * region holds a reference to V so the caller can
+		 * close it once we return.
+		 */
+		result = as_define_backing(as, ph.p_vaddr, v, ph.p_offset,
+					   ph.p_filesz);
+#endif
 		if (result) {
 			return result;
 		}
@@ -24,6 +24,7 @@
 #include <mips/trapframe.h>
 #include <addrspace.h>
 #include <thread.h>
+#include <reclaim.h>
 
 int
 sys_getpid(pid_t* ret)
@@ -48,12 +49,8 @@ sys__exit(int exitcode)
     proc_remthread(curthread);
 
     p->p_exitstatus = _MKWAIT_EXIT(exitcode);
-    p->p_exitable = true;
-
-    lock_acquire(p->p_waitpid_lk);
-        cv_broadcast(p->p_waitpid_cv, p->p_waitpid_lk);
-    lock_release(p->p_waitpid_lk);
 
+    // this wakes up waitpid once we're done with p
     proc_destroy(p);
     thread_exit();
     panic("sys__exit(): unexpected return from thread_exit()\n");
@@ -75,7 +72,10 @@ sys_waitpid(pid_t pid,
 
     struct proc* p = curproc;
     struct proc* child = proc_getProc(pid);
-    KASSERT(child != NULL);
+    if (child == NULL)
+    {
+        return(ESRCH);
+    }
     DEBUG(DB_EXEC, "sys_waitpid(): process %u waiting on %u\n",p->p_pid,child->p_pid);
     if (p != kproc && child->p_parent != p)
     {
@@ -93,6 +93,11 @@ sys_waitpid(pid_t pid,
     lock_release(child->p_waitpid_lk);
 
     exitstatus = child->p_exitstatus;
+    if (child->p_parent == p)
+    {
+        // done with it; back to the proc cache
+        proc_reap(child);
+    }
     result = copyout((void*)&exitstatus,status,sizeof(int));
     if(result)
     {
@@ -110,35 +115,38 @@ sys_fork(struct trapframe* tf, pid_t* retval)
     KASSERT(curproc != NULL);
     KASSERT(sizeof(struct trapframe)==(37*4));
 
+    // if memory is short, wait for some to be freed before making
+    // things worse
+    reclaim_throttle();
+
     char* child_name = kmalloc(sizeof(char)* NAME_MAX);
+    if (child_name == NULL)
+    {
+        return ENOMEM;
+    }
     strcpy(child_name, curproc->p_name);
     strcat(child_name, "_c");
 
-    // create PCB for child
+    // create PCB for child (this also copies the filetable)
     struct proc* child_proc = NULL;
-    proc_fork(&child_proc);
-    if (child_proc == NULL)
+    int result = proc_fork(&child_proc);
+    if (result)
     {
-        return ENOMEM;
+        kfree(child_name);
+        return result;
     }
     strcpy(child_proc->p_name, child_name);
     
     KASSERT(child_proc->p_pid > 0);
 
     // copy address space and registers from this process to child
-    struct addrspace* child_as = kmalloc(sizeof(struct addrspace));
-    if (child_as == NULL)
-    {
-        kfree(child_name);
-        proc_destroy(child_proc);
-        return ENOMEM;
-    }
+    // (as_copy creates the child's address space itself)
+    struct addrspace* child_as = NULL;
 
     struct trapframe* child_tf = kmalloc(sizeof(struct trapframe));
     if (child_tf == NULL)
     {
         kfree(child_name);
-        as_destroy(child_as);
         proc_destroy(child_proc);
         return ENOMEM;
     }
@@ -146,11 +154,11 @@ sys_fork(struct trapframe* tf, pid_t* retval)
     DEBUG(DB_EXEC,"sys_fork(): copying address space...\n");
     // copy the address space just created into the child process's
     // PCB structure
-    int result = as_copy(curproc->p_addrspace, &child_as);
+    result = as_copy(curproc->p_addrspace, &child_as);
     if (result)
     {
         kfree(child_name);
-        as_destroy(child_as);
+        kfree(child_tf);
         proc_destroy(child_proc);
         return result;
     }
@@ -160,34 +168,42 @@ sys_fork(struct trapframe* tf, pid_t* retval)
     // copy this process's trapframe to the child process
     memcpy(child_tf, tf, sizeof(struct trapframe));
 
-    
-    DEBUG(DB_EXEC, "sys_fork(): copying filetable...\n");
-    filetable_copy(curproc->p_filetable,&child_proc->p_filetable);
-
-    DEBUG(DB_EXEC,"sys_fork(): assigning child process's parent as this process...\n");
-    // assign child processes parent as this process
-    child_proc->p_parent = curproc;
-
-    DEBUG(DB_EXEC,"sys_fork(): adding child to children procarray...\n");
-    result = procarray_add(&curproc->p_children, child_proc, NULL);
-    if (result)
-    {
-        DEBUG(DB_EXEC, "sys_fork(): failed to add child process to proc_table...\n");
-    }
-
     DEBUG(DB_EXEC,"sys_fork(): allocating data...\n");
     void **data = kmalloc(2*sizeof(void*));
+    if (data == NULL)
+    {
+        kfree(child_name);
+        kfree(child_tf);
+        // proc_destroy frees child_as along with the process
+        proc_destroy(child_proc);
+        return ENOMEM;
+    }
     data[0] = (void*)child_tf;
     data[1] = (void*)child_as;
 
+    DEBUG(DB_EXEC,"sys_fork(): adding child to this process's children...\n");
+    // this must happen before the child can run (and exit)
+    result = proc_addchild(curproc, child_proc);
+    if (result)
+    {
+        kfree(child_name);
+        kfree(child_tf);
+        kfree(data);
+        // proc_destroy frees child_as along with the process
+        proc_destroy(child_proc);
+        return result;
+    }
+
     result = thread_fork(child_name, child_proc, &enter_forked_process, data, 0);
     if (result)
     {
         kfree(child_name);
         kfree(child_tf);
-        as_destroy(child_as);
+        kfree(data);
+        // unlink it again, so that proc_destroy frees it and its pid
+        proc_remchild(child_proc);
         proc_destroy(child_proc);
-        return ENOMEM;
+        return result;
     }
 
     *retval = child_proc->p_pid;
@@ -0,0 +1,216 @@
+/*
+ * Memory-related system call implementations.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/vmstat.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <copyinout.h>
+#include <synch.h>
+#include <syscall.h>
+#include "opt-dumbvm.h"
+#if !OPT_DUMBVM
+#include <vmstat.h>
+#endif
+
+/*
+ * sbrk: move the end of the heap by CHANGE bytes and return where it
+ * used to be.
+ */
+int
+sys_sbrk(intptr_t change, int *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbrk;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	result = as_sbrk(as, change, &oldbrk);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int)oldbrk;
+	return 0;
+}
+
+/*
+ * Turn PROT_* bits into region permissions.
+ */
+static
+int
+prot_to_perm(int prot)
+{
+	return ((prot & PROT_READ) ? VR_READ : 0) |
+		((prot & PROT_WRITE) ? VR_WRITE : 0) |
+		((prot & PROT_EXEC) ? VR_EXEC : 0);
+}
+
+/*
+ * mmap: map LEN bytes of file FD from OFFSET. The file must be open
+ * for reading, and for writing too if a shared mapping may ever be
+ * written. Without MAP_FIXED, ADDR is ignored.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int *retval)
+{
+	const int allprot = PROT_READ | PROT_WRITE | PROT_EXEC;
+	const int allflags = MAP_SHARED | MAP_PRIVATE | MAP_FIXED;
+
+	struct addrspace *as;
+	struct openfile *file;
+	vaddr_t va;
+	int vrflags;
+	int result;
+
+	if ((prot & allprot) != prot || (flags & allflags) != flags) {
+		return EINVAL;
+	}
+	/* exactly one of shared and private */
+	if (((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0)) {
+		return EINVAL;
+	}
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	va = 0;
+	if (flags & MAP_FIXED) {
+		va = (vaddr_t)addr;
+		if (va == 0 || va % PAGE_SIZE != 0) {
+			return EINVAL;
+		}
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	/* Private mappings can always be written; they never reach the file. */
+	vrflags = VR_MAYWRITE;
+	if (flags & MAP_SHARED) {
+		vrflags = VR_SHARED;
+		if (file->of_accmode == O_RDWR) {
+			vrflags |= VR_MAYWRITE;
+		}
+	}
+	if (file->of_accmode == O_WRONLY ||
+	    ((prot & PROT_WRITE) && (vrflags & VR_MAYWRITE) == 0)) {
+		result = EACCES;
+		goto out;
+	}
+
+	result = VOP_MMAP(file->of_vnode);
+	if (result) {
+		goto out;
+	}
+
+	result = as_mmap(as, va, len, prot_to_perm(prot), vrflags,
+			 file->of_vnode, offset, &va);
+	if (result) {
+		goto out;
+	}
+	*retval = (int)va;
+
+ out:
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+/*
+ * munmap: remove the mappings in [ADDR, ADDR+LEN).
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	if ((vaddr_t)addr % PAGE_SIZE != 0 || len == 0) {
+		return EINVAL;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_munmap(as, (vaddr_t)addr, ROUNDUP(len, PAGE_SIZE));
+}
+
+/*
+ * mprotect: change the protection of the mappings in [ADDR, ADDR+LEN).
+ */
+int
+sys_mprotect(userptr_t addr, size_t len, int prot)
+{
+	struct addrspace *as;
+
+	if ((prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) != prot ||
+	    (vaddr_t)addr % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_mprotect(as, (vaddr_t)addr, ROUNDUP(len, PAGE_SIZE),
+			   prot_to_perm(prot));
+}
+
+/*
+ * __vmstat: copy out the VM counters of the calling process
+ * (VMSTAT_SELF) or of the whole system (VMSTAT_SYSTEM).
+ */
+int
+sys___vmstat(int which, userptr_t buf)
+{
+#if OPT_DUMBVM
+	(void)which;
+	(void)buf;
+	return ENOSYS;
+#else
+	struct addrspace *as;
+	struct vmstat vs;
+
+	switch (which) {
+	    case VMSTAT_SELF:
+		as = proc_getas();
+		if (as == NULL) {
+			return EFAULT;
+		}
+		lock_acquire(as->as_lock);
+		vmstat_get(as, &vs);
+		lock_release(as->as_lock);
+		break;
+	    case VMSTAT_SYSTEM:
+		vmstat_get(NULL, &vs);
+		break;
+	    default:
+		return EINVAL;
+	}
+	return copyout(&vs, buf, sizeof(vs));
+#endif
+}
@@ -33,6 +33,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
@@ -378,3 +379,96 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Measure subpage kmalloc/kfree throughput with a large heap: fill
+ * KM5_NLIVE slots with blocks of assorted subpage sizes, then
+ * repeatedly free a random slot and allocate a new block in its
+ * place. Reports pairs per second. With kfree searching the heap
+ * page list this got slower as the heap grew; it shouldn't now.
+ */
+
+#define KM5_NLIVE   4096
+#define KM5_NPAIRS  200000
+#define KM5_MAXSIZE 2000
+
+static void *km5_ptrs[KM5_NLIVE];
+static uint32_t km5_seed;
+
+static
+uint32_t
+km5_random(void)
+{
+	/* Not the random device; we want this cheap and repeatable. */
+	km5_seed = km5_seed * 1103515245 + 12345;
+	return km5_seed >> 8;
+}
+
+static
+void *
+km5_alloc(void)
+{
+	size_t sz;
+	void *ptr;
+
+	sz = 1 + km5_random() % KM5_MAXSIZE;
+	ptr = kmalloc(sz);
+	if (ptr == NULL) {
+		panic("kmalloctest5: kmalloc of %zu failed\n", sz);
+	}
+	*(char *)ptr = 0;
+	return ptr;
+}
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	struct timespec start, end;
+	uint64_t nsecs;
+	unsigned npairs, i, slot;
+
+	npairs = KM5_NPAIRS;
+	if (nargs > 1) {
+		npairs = atoi(args[1]);
+		if (npairs == 0) {
+			kprintf("Usage: km5 [npairs]\n");
+			return EINVAL;
+		}
+	}
+
+	kprintf("Starting kmalloc throughput test...\n");
+	km5_seed = 1;
+
+	for (i=0; i<KM5_NLIVE; i++) {
+		km5_ptrs[i] = km5_alloc();
+	}
+
+	gettime(&start);
+	for (i=0; i<npairs; i++) {
+		slot = km5_random() % KM5_NLIVE;
+		kfree(km5_ptrs[slot]);
+		km5_ptrs[slot] = km5_alloc();
+	}
+	gettime(&end);
+
+	for (i=0; i<KM5_NLIVE; i++) {
+		kfree(km5_ptrs[i]);
+		km5_ptrs[i] = NULL;
+	}
+
+	timespec_sub(&end, &start, &end);
+	nsecs = end.tv_sec * 1000000000ULL + end.tv_nsec;
+	if (nsecs == 0) {
+		nsecs = 1;
+	}
+	kprintf("%u kmalloc/kfree pairs with %u live blocks "
+		"in %llu.%09lu seconds\n", npairs, KM5_NLIVE,
+		(unsigned long long)end.tv_sec, (unsigned long)end.tv_nsec);
+	kprintf("%llu pairs/sec\n",
+		(unsigned long long)(npairs * 1000000000ULL / nsecs));
+	kprintf("kmalloctest5: passed\n");
+	return 0;
+}
@@ -33,6 +33,7 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <clock.h>
 #include <thread.h>
 #include <synch.h>
@@ -399,3 +400,308 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Uncontended lock speed: how many cycles a lock_acquire/lock_release
+ * pair and a lock_do_i_hold take when no other thread wants the lock,
+ * next to a spinlock_acquire/spinlock_release pair and an empty call
+ * (the loop overhead included in each figure).
+ *
+ * Timing uses the cycle counter, with interrupts off so nothing else
+ * gets counted. The counter starts over from zero at every clock
+ * tick, interrupts or no; samples that span that are thrown away.
+ */
+
+#define SPEED_BATCH     100     /* operations per sample */
+#define SPEED_SAMPLES   500
+
+static struct lock *speedlock;
+static struct spinlock speedspinlock = SPINLOCK_INITIALIZER;
+static volatile bool speedheld;
+
+static
+uint32_t
+cyclecount(void)
+{
+	uint32_t count;
+
+	/*
+	 * $9 == c0_count; we can't use the symbolic name inside
+	 * the asm string.
+	 */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
+static
+void
+speed_nothing(void)
+{
+}
+
+static
+void
+speed_lock(void)
+{
+	lock_acquire(speedlock);
+	lock_release(speedlock);
+}
+
+static
+void
+speed_holdcheck(void)
+{
+	speedheld = lock_do_i_hold(speedlock);
+}
+
+static
+void
+speed_spinlock(void)
+{
+	spinlock_acquire(&speedspinlock);
+	spinlock_release(&speedspinlock);
+}
+
+static
+void
+speed_measure(const char *name, void (*op)(void))
+{
+	uint32_t before, after, cycles, best, total;
+	unsigned i, j, n;
+	int spl;
+
+	best = (uint32_t)-1;
+	total = 0;
+	n = 0;
+	for (i=0; i<SPEED_SAMPLES; i++) {
+		spl = splhigh();
+		before = cyclecount();
+		for (j=0; j<SPEED_BATCH; j++) {
+			op();
+		}
+		after = cyclecount();
+		splx(spl);
+
+		if (after < before) {
+			/* the counter started over */
+			continue;
+		}
+		cycles = after - before;
+		total += cycles;
+		if (cycles < best) {
+			best = cycles;
+		}
+		n++;
+	}
+
+	if (n == 0) {
+		kprintf("%-24s no usable samples\n", name);
+		return;
+	}
+	/* per operation, to a tenth of a cycle */
+	total = total * 10 / (n * SPEED_BATCH);
+	best = best * 10 / SPEED_BATCH;
+	kprintf("%-24s %5u.%u cycles average, %5u.%u best (%u samples)\n",
+		name, total / 10, total % 10, best / 10, best % 10, n);
+}
+
+int
+lockspeed(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	speedlock = lock_create("lockspeed");
+	if (speedlock == NULL) {
+		panic("lockspeed: lock_create failed\n");
+	}
+
+	kprintf("Uncontended lock speed (%u operations per sample):\n",
+		SPEED_BATCH);
+	speed_measure("empty call", speed_nothing);
+	speed_measure("acquire+release", speed_lock);
+	speed_measure("lock_do_i_hold", speed_holdcheck);
+	speed_measure("spinlock acquire+release", speed_spinlock);
+
+	lock_destroy(speedlock);
+	speedlock = NULL;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Priority inversion: a thread that has computed its way to the bottom
+ * scheduler level holds a lock for PI_HOLDMS milliseconds of work,
+ * while PI_NHOGS threads compute at that level too and the menu
+ * thread, which has been asleep and so sits near the top, waits for
+ * the lock. Without priority inheritance the holder shares the cpu
+ * with the hogs and the waiter waits several times as long as the
+ * work takes alone; with it, the holder runs at the waiter's level
+ * and the wait stays close to that. The test fails if the wait is
+ * more than PI_SLACK times as long as the work alone.
+ */
+
+#define PI_HOLDMS       500
+#define PI_SINKMS       300     /* time for the hogs to sink */
+#define PI_NHOGS        12
+#define PI_SLACK        2
+
+static struct lock *pilock;
+static struct semaphore *piheld;
+static struct semaphore *pidone;
+static volatile bool pistop;
+static unsigned piwork;         /* chunks of work in PI_HOLDMS alone */
+
+static
+unsigned
+pi_elapsedms(const struct timespec *start)
+{
+	struct timespec now, diff;
+
+	gettime(&now);
+	timespec_sub(&now, start, &diff);
+	return diff.tv_sec * 1000 + diff.tv_nsec / 1000000;
+}
+
+static
+void
+pi_chunk(void)
+{
+	volatile unsigned i;
+
+	for (i=0; i<10000; i++) {
+		/* nothing */
+	}
+}
+
+static
+void
+pi_calibrate(void *junk1, unsigned long junk2)
+{
+	struct timespec start;
+	unsigned n;
+
+	(void)junk1;
+	(void)junk2;
+
+	n = 0;
+	gettime(&start);
+	while (pi_elapsedms(&start) < PI_HOLDMS) {
+		pi_chunk();
+		n++;
+	}
+	piwork = n;
+	V(pidone);
+}
+
+static
+void
+pi_hog(void *junk1, unsigned long junk2)
+{
+	(void)junk1;
+	(void)junk2;
+
+	while (!pistop) {
+		pi_chunk();
+	}
+	V(pidone);
+}
+
+static
+void
+pi_holder(void *junk1, unsigned long junk2)
+{
+	struct timespec start;
+	unsigned i;
+
+	(void)junk1;
+	(void)junk2;
+
+	/* compute until we're down with the hogs */
+	gettime(&start);
+	while (pi_elapsedms(&start) < PI_SINKMS) {
+		pi_chunk();
+	}
+
+	lock_acquire(pilock);
+	V(piheld);
+	for (i=0; i<piwork; i++) {
+		pi_chunk();
+	}
+	lock_release(pilock);
+	V(pidone);
+}
+
+int
+pitest(int nargs, char **args)
+{
+	struct timespec start;
+	unsigned i, waitms;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	pilock = lock_create("pitest");
+	piheld = sem_create("piheld", 0);
+	pidone = sem_create("pidone", 0);
+	if (pilock == NULL || piheld == NULL || pidone == NULL) {
+		panic("pitest: out of memory\n");
+	}
+	pistop = false;
+
+	kprintf("Starting priority inversion test...\n");
+
+	result = thread_fork("pitest calibrate", NULL, pi_calibrate, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(pidone);
+	kprintf("%u chunks of work take %u ms alone\n", piwork, PI_HOLDMS);
+
+	for (i=0; i<PI_NHOGS; i++) {
+		result = thread_fork("pitest hog", NULL, pi_hog, NULL, i);
+		if (result) {
+			panic("pitest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	result = thread_fork("pitest holder", NULL, pi_holder, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+
+	P(piheld);
+	gettime(&start);
+	lock_acquire(pilock);
+	waitms = pi_elapsedms(&start);
+	lock_release(pilock);
+
+	pistop = true;
+	for (i=0; i<PI_NHOGS+1; i++) {
+		P(pidone);
+	}
+
+	sem_destroy(pidone);
+	sem_destroy(piheld);
+	lock_destroy(pilock);
+	pidone = piheld = NULL;
+	pilock = NULL;
+
+	kprintf("Waited %u ms for the lock, next to %u hogs\n",
+		waitms, PI_NHOGS);
+	if (waitms > PI_SLACK * PI_HOLDMS) {
+		kprintf("Test failed: more than %u times the work alone\n",
+			PI_SLACK);
+	}
+	kprintf("Priority inversion test done\n");
+	return 0;
+}
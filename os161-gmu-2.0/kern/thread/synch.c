@@ -33,12 +33,20 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <membar.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem_cache.h>
+#include <clock.h>
+#include <cpu.h>
+
+static struct kmem_cache *lock_cache;
+static struct kmem_cache *cv_cache;
 
 ////////////////////////////////////////////////////////////
 //
@@ -138,82 +146,500 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Locks are adaptive: a thread that finds the lock held spins,
+ * rather than going to sleep, for as long as the holder is running
+ * on another cpu and so is likely to let go soon. Sleeping and being
+ * woken costs two context switches, which is a lot more than most
+ * critical sections take. Once the holder is not running (it can't
+ * let go until it is scheduled again), or after LOCK_SPIN_MAX checks
+ * in all, the waiter sleeps.
+ */
+#define LOCK_SPIN_MAX   2000
+
+/*
+ * The lk_owner word (see synch.h). Thread structures are word
+ * aligned, so the low bit is free for LOCK_WAITERS.
+ *
+ * A waiter sets LOCK_WAITERS, holding spin_lock, before it sleeps; a
+ * holder that finds it set releases the lock by clearing the whole
+ * word and waking one waiter, also holding spin_lock, so no wakeup is
+ * lost. Since that clears the bit for any other sleepers too, a
+ * thread that has slept puts it back when it does get the lock.
+ */
+#define LOCK_WAITERS    ((spinlock_data_t)1)
+#define LOCK_OWNER(word) ((struct thread *)((word) & ~LOCK_WAITERS))
+#define LOCK_SELF()     ((spinlock_data_t)(uintptr_t)curthread)
+
+/*
+ * Priority inheritance. A thread that goes to sleep waiting for a
+ * lock lends its priority (see thread_priority) to the holder, so a
+ * holder of lower priority isn't kept off the cpu by threads in
+ * between while better ones wait for it. If the holder is itself
+ * asleep waiting for another lock (t_waitlock), the loan is passed on
+ * to that lock's holder, and so on, up to LOCK_PI_MAXDEPTH locks.
+ *
+ * Each lock keeps the best priority of the threads asleep on it
+ * (lk_waitprio), and each thread a list of the locks it holds that
+ * have lent it priority (t_lentlocks, linked through lk_lendnext).
+ * Letting go of one of those recomputes the loan from the rest.
+ * lk_waitprio is only reset once nobody is left asleep on the lock,
+ * so while some are it may be better than any of them still is; the
+ * error is toward lending too much, and never lasts past the wait.
+ *
+ * Only locks with LOCK_WAITERS set lend, and clearing that takes the
+ * slow path of lock_release, which takes lock_pilock to return the
+ * loan. So under lock_pilock, the owner of a lock with LOCK_WAITERS
+ * set can't change. lock_pilock covers lk_waitprio, lk_lendnext,
+ * lk_lending, t_waitlock and t_lentlocks; it nests inside a lock's
+ * spin_lock, and the run queue locks inside it.
+ */
+#define LOCK_PI_MAXDEPTH 16
+
+static struct spinlock lock_pilock = SPINLOCK_INITIALIZER;
+
+/*
+ * Lock statistics (see lockstat_enable). Times are in nanoseconds;
+ * waits are only counted for acquisitions that found the lock held.
+ */
+static struct spinlock lockstat_lock = SPINLOCK_INITIALIZER;
+static volatile bool lockstat_on;
+static struct {
+    unsigned acquires;          /* lock_acquire calls */
+    unsigned contended;         /* ...that found it held */
+    unsigned spun;              /* ...and got it without sleeping */
+    unsigned slept;             /* ...or slept at least once */
+    uint64_t waittime;          /* total time contended waiters waited */
+    uint64_t maxwait;
+    unsigned releases;
+    uint64_t holdtime;          /* total time between acquire and release */
+    uint64_t maxhold;
+} lockstat;
+
+static
+uint64_t
+lockstat_now(void)
+{
+    struct timespec ts;
+
+    gettime(&ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Turn the statistics on (clearing them) or off.
+ */
+void
+lockstat_enable(bool on)
+{
+    spinlock_acquire(&lockstat_lock);
+    if (on) {
+        bzero(&lockstat, sizeof(lockstat));
+    }
+    lockstat_on = on;
+    spinlock_release(&lockstat_lock);
+}
+
+void
+lockstat_print(void)
+{
+    unsigned acquires, contended, spun, slept, releases;
+    uint64_t waittime, maxwait, holdtime, maxhold;
+
+    spinlock_acquire(&lockstat_lock);
+    acquires = lockstat.acquires;
+    contended = lockstat.contended;
+    spun = lockstat.spun;
+    slept = lockstat.slept;
+    waittime = lockstat.waittime;
+    maxwait = lockstat.maxwait;
+    releases = lockstat.releases;
+    holdtime = lockstat.holdtime;
+    maxhold = lockstat.maxhold;
+    spinlock_release(&lockstat_lock);
+
+    kprintf("lockstat: %s\n", lockstat_on ? "on" : "off");
+    kprintf("%u acquires, %u contended: %u got it spinning, %u slept\n",
+            acquires, contended, spun, slept);
+    kprintf("wait: %llu ns average, %llu ns max (contended only)\n",
+            contended ? waittime / contended : 0, maxwait);
+    kprintf("hold: %llu ns average, %llu ns max\n",
+            releases ? holdtime / releases : 0, maxhold);
+}
+
+/*
+ * Record an acquisition of LOCK. START is when we first found it held,
+ * or 0 if we didn't.
+ */
+static
+void
+lockstat_acquired(struct lock *lock, uint64_t start, bool slept)
+{
+    uint64_t now, wait;
+
+    now = lockstat_now();
+    lock->lk_acqtime = now;
+
+    spinlock_acquire(&lockstat_lock);
+    lockstat.acquires++;
+    if (start != 0) {
+        wait = now - start;
+        lockstat.contended++;
+        if (slept) {
+            lockstat.slept++;
+        }
+        else {
+            lockstat.spun++;
+        }
+        lockstat.waittime += wait;
+        if (wait > lockstat.maxwait) {
+            lockstat.maxwait = wait;
+        }
+    }
+    spinlock_release(&lockstat_lock);
+}
+
+static
+void
+lockstat_released(struct lock *lock)
+{
+    uint64_t hold;
+
+    if (lock->lk_acqtime == 0) {
+        /* acquired before the statistics were turned on */
+        return;
+    }
+    hold = lockstat_now() - lock->lk_acqtime;
+    lock->lk_acqtime = 0;
+
+    spinlock_acquire(&lockstat_lock);
+    lockstat.releases++;
+    lockstat.holdtime += hold;
+    if (hold > lockstat.maxhold) {
+        lockstat.maxhold = hold;
+    }
+    spinlock_release(&lockstat_lock);
+}
+
+/*
+ * Locks come out of lock_cache with their wait channel and spinlock
+ * already set up, and unheld. Only the name is per-lock.
+ */
+static
+int
+lock_ctor(void *obj)
+{
+    struct lock *lock = obj;
+
+    lock->lk_name = NULL;
+    lock->lk_wchan = wchan_create("lock");
+    if (lock->lk_wchan == NULL) {
+        return ENOMEM;
+    }
+    spinlock_init(&lock->spin_lock);
+    spinlock_data_set(&lock->lk_owner, 0);
+    lock->lk_acqtime = 0;
+    lock->lk_waitprio = SCHED_NLEVELS;
+    lock->lk_lendnext = NULL;
+    lock->lk_lending = false;
+    return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+    struct lock *lock = obj;
+
+    wchan_destroy(lock->lk_wchan);
+    spinlock_cleanup(&lock->spin_lock);
+}
+
 struct lock *
 lock_create(const char *name)
 {
     struct lock* new_lock;
 
-    new_lock = kmalloc(sizeof(struct lock));
+    new_lock = kmem_cache_alloc(lock_cache);
     if (new_lock == NULL) {
         return NULL;
     }
 
     new_lock->lk_name = kstrdup(name);
     if (new_lock->lk_name == NULL) {
-        kfree(new_lock);
+        kmem_cache_free(lock_cache, new_lock);
         return NULL;
     }
+    wchan_setname(new_lock->lk_wchan, new_lock->lk_name);
 
-    new_lock->lk_wchan = wchan_create(new_lock->lk_name);
-    if (new_lock->lk_wchan == NULL) {
-        kfree(new_lock->lk_name);
-        kfree(new_lock);
-        return NULL;
-    }
-
-    spinlock_init(&new_lock->spin_lock);
-	spinlock_data_set(&new_lock->lk_busy, 0);
-    new_lock->lk_cpu = NULL;
-    new_lock->lk_thread = NULL;
     return new_lock;
 }
 
 void
 lock_destroy(struct lock *lock)
 {
+    KASSERT(lock != NULL);
+
+    /* put it back the way lock_ctor left it */
+    spinlock_acquire(&lock->spin_lock);
+    KASSERT(wchan_isempty(lock->lk_wchan, &lock->spin_lock));
+    spinlock_data_set(&lock->lk_owner, 0);
+    lock->lk_acqtime = 0;
+    lock->lk_waitprio = SCHED_NLEVELS;
+    lock->lk_lendnext = NULL;
+    lock->lk_lending = false;
+    spinlock_release(&lock->spin_lock);
+
+    wchan_setname(lock->lk_wchan, "lock");
     kfree(lock->lk_name);
-    wchan_destroy(lock->lk_wchan);
-    spinlock_cleanup(&lock->spin_lock);
-    kfree(lock);
+    lock->lk_name = NULL;
+    kmem_cache_free(lock_cache, lock);
 }
 
+/*
+ * Lend priority PRIORITY to the holder of LOCK, and on down the chain
+ * of locks the holders are waiting for. Called with lock_pilock.
+ */
+static
 void
-lock_acquire(struct lock *lock)
+lock_lend(struct lock *lock, unsigned priority)
+{
+    spinlock_data_t word;
+    struct thread *owner;
+    unsigned depth;
+
+    KASSERT(spinlock_do_i_hold(&lock_pilock));
+
+    for (depth = 0; lock != NULL && depth < LOCK_PI_MAXDEPTH; depth++) {
+        if (priority < lock->lk_waitprio) {
+            lock->lk_waitprio = priority;
+        }
+        priority = lock->lk_waitprio;
+
+        word = spinlock_data_get(&lock->lk_owner);
+        if ((word & LOCK_WAITERS) == 0) {
+            /* free, or being handed on; the next owner will borrow */
+            return;
+        }
+        owner = LOCK_OWNER(word);
+        if (!lock->lk_lending) {
+            lock->lk_lending = true;
+            lock->lk_lendnext = owner->t_lentlocks;
+            owner->t_lentlocks = lock;
+        }
+        if (thread_priority(owner) <= priority) {
+            /* already as good; so is anything further down */
+            return;
+        }
+        thread_inherit(owner, priority);
+        lock = owner->t_waitlock;
+    }
+}
+
+/*
+ * Recompute the priority lent to us from the locks on our list.
+ * Called with lock_pilock.
+ */
+static
+void
+lock_reinherit(void)
+{
+    struct lock *l;
+    unsigned best;
+
+    best = SCHED_NLEVELS;
+    for (l = curthread->t_lentlocks; l != NULL; l = l->lk_lendnext) {
+        if (l->lk_waitprio < best) {
+            best = l->lk_waitprio;
+        }
+    }
+    thread_inherit(curthread, best);
+}
+
+/*
+ * We just got LOCK after sleeping for it: borrow from whoever is still
+ * asleep on it.
+ */
+static
+void
+lock_borrow(struct lock *lock)
 {
-    if(!lock_do_i_hold(lock)) {
+    spinlock_acquire(&lock_pilock);
+    /* (a waiter may have gotten here first) */
+    if (!lock->lk_lending &&
+        lock->lk_waitprio < thread_priority(curthread)) {
+        lock->lk_lending = true;
+        lock->lk_lendnext = curthread->t_lentlocks;
+        curthread->t_lentlocks = lock;
+        lock_reinherit();
+    }
+    spinlock_release(&lock_pilock);
+}
+
+/*
+ * We're letting go of LOCK: give back what it lent us. Called with
+ * lock_pilock.
+ */
+static
+void
+lock_unlend(struct lock *lock)
+{
+    struct lock **lp;
+
+    if (!lock->lk_lending) {
+        return;
+    }
+    for (lp = &curthread->t_lentlocks; *lp != lock; lp = &(*lp)->lk_lendnext) {
+        KASSERT(*lp != NULL);
+    }
+    *lp = lock->lk_lendnext;
+    lock->lk_lendnext = NULL;
+    lock->lk_lending = false;
+    lock_reinherit();
+}
+
+/*
+ * lock_acquire when the lock was not free.
+ */
+static
+void
+lock_acquire_slow(struct lock *lock)
+{
+    spinlock_data_t old, mine;
+    struct thread *owner;
+    unsigned spins;
+    uint64_t start;
+    bool slept;
+
+    mine = LOCK_SELF();
+    spins = 0;
+    start = 0;
+    slept = false;
+    while (1) {
+        old = spinlock_data_get(&lock->lk_owner);
+        if (old == 0) {
+            if (spinlock_data_compareandswap(&lock->lk_owner, 0, mine)) {
+                break;
+            }
+            continue;
+        }
+        owner = LOCK_OWNER(old);
+        if (owner == curthread) {
+            /* we have it already */
+            return;
+        }
+        if (lockstat_on && start == 0) {
+            start = lockstat_now();
+        }
+        if (spins < LOCK_SPIN_MAX && thread_isrunning(owner)) {
+            /*
+             * The owner may exit right after letting go, but
+             * thread structures stay mapped, so looking at its
+             * state stays harmless.
+             */
+            spins++;
+            continue;
+        }
+
         spinlock_acquire(&lock->spin_lock);
-        while(spinlock_data_testandset(&lock->lk_busy) != 0) {
+        old = spinlock_data_get(&lock->lk_owner);
+        if (old != 0 && ((old & LOCK_WAITERS) != 0 ||
+            spinlock_data_compareandswap(&lock->lk_owner, old,
+                                         old | LOCK_WAITERS))) {
+            slept = true;
+            mine = LOCK_SELF() | LOCK_WAITERS;
+
+            spinlock_acquire(&lock_pilock);
+            curthread->t_waitlock = lock;
+            lock_lend(lock, thread_priority(curthread));
+            spinlock_release(&lock_pilock);
+
             wchan_sleep(lock->lk_wchan, &lock->spin_lock);
+
+            spinlock_acquire(&lock_pilock);
+            curthread->t_waitlock = NULL;
+            spinlock_release(&lock_pilock);
         }
-        lock->lk_cpu = curcpu;
-        lock->lk_thread = curthread;
         spinlock_release(&lock->spin_lock);
     }
+    membar_store_any();
+
+    if (slept) {
+        lock_borrow(lock);
+    }
+
+    if (lockstat_on) {
+        lockstat_acquired(lock, start, slept);
+    }
 }
 
 void
-lock_release(struct lock *lock)
+lock_acquire(struct lock *lock)
 {
-    if(lock_do_i_hold(lock)) {
-        spinlock_acquire(&lock->spin_lock);
-        spinlock_data_set(&lock->lk_busy,0);
-        lock->lk_cpu = NULL;
-        lock->lk_thread = NULL;
-        wchan_wakeone(lock->lk_wchan, &lock->spin_lock);
-        spinlock_release(&lock->spin_lock);
+    if (spinlock_data_compareandswap(&lock->lk_owner, 0, LOCK_SELF())) {
+        membar_store_any();
+        if (lockstat_on) {
+            lockstat_acquired(lock, 0, false);
+        }
+        return;
     }
+    lock_acquire_slow(lock);
 }
 
-bool
-lock_do_i_hold(struct lock *lock)
+void
+lock_release(struct lock *lock)
 {
-    bool rtn = false;
+    spinlock_data_t old;
+
+    old = spinlock_data_get(&lock->lk_owner);
+    if (LOCK_OWNER(old) != curthread) {
+        return;
+    }
+    if (lockstat_on) {
+        lockstat_released(lock);
+    }
+    membar_any_store();
+    if (old == LOCK_SELF() &&
+        spinlock_data_compareandswap(&lock->lk_owner, old, 0)) {
+        return;
+    }
+
+    /*
+     * There are (or we lost a race with) waiters. Nobody else
+     * changes the word while we hold it and spin_lock. Return any
+     * priority it lent us before letting go, so it can't lend us
+     * more afterwards.
+     */
     spinlock_acquire(&lock->spin_lock);
-    if(lock->lk_cpu == curcpu && lock->lk_thread == curthread) {
-        rtn = true;
+    spinlock_acquire(&lock_pilock);
+    lock_unlend(lock);
+    spinlock_data_set(&lock->lk_owner, 0);
+    wchan_wakeone(lock->lk_wchan, &lock->spin_lock);
+    if (wchan_isempty(lock->lk_wchan, &lock->spin_lock)) {
+        lock->lk_waitprio = SCHED_NLEVELS;
     }
+    spinlock_release(&lock_pilock);
     spinlock_release(&lock->spin_lock);
-    return rtn;
+}
+
+bool
+lock_tryacquire(struct lock *lock)
+{
+    if (!spinlock_data_compareandswap(&lock->lk_owner, 0, LOCK_SELF())) {
+        return false;
+    }
+    membar_store_any();
+    if (lockstat_on) {
+        lockstat_acquired(lock, 0, false);
+    }
+    return true;
+}
+
+bool
+lock_do_i_hold(struct lock *lock)
+{
+    /* only we can make ourselves the owner or stop being it */
+    return LOCK_OWNER(spinlock_data_get(&lock->lk_owner)) == curthread;
 }
 
 ////////////////////////////////////////////////////////////
@@ -221,30 +647,51 @@ lock_do_i_hold(struct lock *lock)
 // CV
 
 
+/*
+ * Likewise for CVs.
+ */
+static
+int
+cv_ctor(void *obj)
+{
+    struct cv *cv = obj;
+
+    cv->cv_name = NULL;
+    cv->cv_wchan = wchan_create("cv");
+    if (cv->cv_wchan == NULL) {
+        return ENOMEM;
+    }
+    spinlock_init(&cv->spin_lock);
+    return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+    struct cv *cv = obj;
+
+    wchan_destroy(cv->cv_wchan);
+    spinlock_cleanup(&cv->spin_lock);
+}
+
 struct cv *
 cv_create(const char *name)
 {
     struct cv* cv;
 
-    cv = kmalloc(sizeof(struct cv));
+    cv = kmem_cache_alloc(cv_cache);
     if (cv == NULL) {
         return NULL;
     }
 
     cv->cv_name = kstrdup(name);
     if (cv->cv_name==NULL) {
-        kfree(cv);
+        kmem_cache_free(cv_cache, cv);
         return NULL;
     }
+    wchan_setname(cv->cv_wchan, cv->cv_name);
 
-    cv->cv_wchan = wchan_create(cv->cv_name);
-    if (cv->cv_wchan == NULL) {
-        kfree(cv->cv_name);
-        kfree(cv);
-        return NULL;
-    }
-
-    spinlock_init(&cv->spin_lock);
     return cv;
 }
 
@@ -252,10 +699,15 @@ void
 cv_destroy(struct cv *cv)
 {
     KASSERT(cv != NULL);
+
+    spinlock_acquire(&cv->spin_lock);
+    KASSERT(wchan_isempty(cv->cv_wchan, &cv->spin_lock));
+    spinlock_release(&cv->spin_lock);
+
+    wchan_setname(cv->cv_wchan, "cv");
     kfree(cv->cv_name);
-    wchan_destroy(cv->cv_wchan);
-    spinlock_cleanup(&cv->spin_lock);
-    kfree(cv);
+    cv->cv_name = NULL;
+    kmem_cache_free(cv_cache, cv);
 }
 
 void
@@ -295,3 +747,19 @@ cv_broadcast(struct cv *cv, struct lock *lock)
         spinlock_release(&cv->spin_lock);
     }
 }
+
+////////////////////////////////////////////////////////////
+//
+// Setup.
+
+void
+synch_bootstrap(void)
+{
+    lock_cache = kmem_cache_create("lock", sizeof(struct lock),
+                                   lock_ctor, lock_dtor);
+    cv_cache = kmem_cache_create("cv", sizeof(struct cv),
+                                 cv_ctor, cv_dtor);
+    if (lock_cache == NULL || cv_cache == NULL) {
+        panic("synch_bootstrap: Out of memory\n");
+    }
+}
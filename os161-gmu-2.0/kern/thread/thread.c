@@ -49,7 +49,9 @@
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
+#include <platform/maxcpus.h>
 #include <vnode.h>
+#include <kmem_cache.h>
 
 #include "opt-synchprobs.h"
 
@@ -64,6 +66,9 @@ struct wchan {
 	unsigned wc_index;		/* index into allwchans[] */
 };
 
+/* Object cache for thread structures. */
+static struct kmem_cache *thread_cache;
+
 /* Master array of CPUs. */
 DECLARRAY(cpu, static __UNUSED inline);
 DEFARRAY(cpu, static __UNUSED inline);
@@ -118,45 +123,94 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Object cache constructor and destructor for struct thread. The list
+ * node is the same every time, and a thread is off all lists by the
+ * time it's destroyed, so it only needs setting up once.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_ctor(void *obj)
 {
-	struct thread *thread;
+	struct thread *thread = obj;
 
-	DEBUGASSERT(name != NULL);
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
-	}
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
 
+	threadlistnode_cleanup(&thread->t_listnode);
+}
+
+/*
+ * Set up the fields of a new thread, or of one being reused from the
+ * thread pool, apart from its stack. Returns ENOMEM if the name can't
+ * be copied.
+ */
+static
+int
+thread_setup(struct thread *thread, const char *name)
+{
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+		return ENOMEM;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
+	/* (t_listnode is set up by thread_ctor) */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_inherited = SCHED_NLEVELS;
+	thread->t_runlevel = SCHED_NLEVELS;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Public fields */
+	thread->t_reclaiming = false;
+	thread->t_waitlock = NULL;
+	thread->t_lentlocks = NULL;
+
 	/* If you add to struct thread, be sure to initialize here */
 
+	return 0;
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	DEBUGASSERT(name != NULL);
+
+	thread = kmem_cache_alloc(thread_cache);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->t_stack = NULL;
+	if (thread_setup(thread, name)) {
+		kmem_cache_free(thread_cache, thread);
+		return NULL;
+	}
+
 	return thread;
 }
 
@@ -173,6 +227,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -185,15 +240,26 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadpool);
+	spinlock_init(&c->c_threadpool_lock);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_steals = 0;
+	c->c_pushes = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
+	c->c_idleworker = NULL;
+	c->c_idleworker_parked = false;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdowns_received = 0;
+	c->c_shootdowns_sent = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -259,19 +325,140 @@ thread_destroy(struct thread *thread)
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
+	/* leave the list node for the next thread_create, but check it */
+	KASSERT(thread->t_listnode.tln_next == NULL);
+	KASSERT(thread->t_listnode.tln_prev == NULL);
 	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
+}
+
+/*
+ * Thread pool.
+ *
+ * Rather than destroying every dead thread, each cpu keeps up to
+ * THREAD_POOL_MAX of them, with their stacks, for thread_fork to
+ * reuse; this saves the allocator a multi-page stack allocation and
+ * free per thread, and the stack doesn't need its guard band written
+ * again. Pooled threads are otherwise torn down as far as
+ * thread_destroy would, and have no name.
+ *
+ * The pools are normally used only by their own cpu, but have a lock
+ * so thread_pool_shrink can empty them all when memory is short.
+ */
+#define THREAD_POOL_MAX 4
+
+/*
+ * Put a dead thread in the current cpu's pool, or destroy it if the
+ * pool is full or the thread has no stack of its own.
+ */
+static
+void
+thread_pool_put(struct thread *thread)
+{
+	struct cpu *c = curcpu->c_self;
+
+	KASSERT(thread != curthread);
+	KASSERT(thread->t_state == S_ZOMBIE);
+	KASSERT(thread->t_proc == NULL);
+
+	if (thread->t_stack == NULL) {
+		thread_destroy(thread);
+		return;
+	}
+	thread_checkstack(thread);
+
+	/* check and reset; thread_setup will initialize it again */
+	thread_machdep_cleanup(&thread->t_machdep);
+	thread_machdep_init(&thread->t_machdep);
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+	thread->t_wchan_name = "POOLED";
+
+	spinlock_acquire(&c->c_threadpool_lock);
+	if (c->c_threadpool.tl_count < THREAD_POOL_MAX) {
+		threadlist_addtail(&c->c_threadpool, thread);
+		thread = NULL;
+	}
+	spinlock_release(&c->c_threadpool_lock);
+
+	if (thread != NULL) {
+		thread_destroy(thread);
+	}
+}
+
+/*
+ * Get a thread with a stack from the current cpu's pool and set it
+ * up as thread_create would. Returns NULL if the pool is empty (or
+ * the name can't be copied).
+ */
+static
+struct thread *
+thread_pool_get(const char *name)
+{
+	struct cpu *c = curcpu->c_self;
+	struct thread *thread;
+
+	spinlock_acquire(&c->c_threadpool_lock);
+	thread = threadlist_remhead(&c->c_threadpool);
+	spinlock_release(&c->c_threadpool_lock);
+
+	if (thread == NULL) {
+		return NULL;
+	}
+	KASSERT(thread->t_stack != NULL);
+	thread_checkstack(thread);
+
+	if (thread_setup(thread, name)) {
+		thread_destroy(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+/*
+ * Destroy pooled threads on all cpus, giving their memory back, until
+ * NPAGES pages' worth of stacks are freed. Returns the pages freed.
+ */
+unsigned
+thread_pool_shrink(unsigned npages)
+{
+	struct threadlist victims;
+	struct thread *thread;
+	struct cpu *c;
+	unsigned i, n, stackpages;
+
+	stackpages = DIVROUNDUP(STACK_SIZE, PAGE_SIZE);
+
+	threadlist_init(&victims);
+	n = 0;
+	for (i=0; i < cpuarray_num(&allcpus) && n < npages; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_threadpool_lock);
+		while (n < npages &&
+		       (thread = threadlist_remhead(&c->c_threadpool))
+		       != NULL) {
+			threadlist_addtail(&victims, thread);
+			n += stackpages;
+		}
+		spinlock_release(&c->c_threadpool_lock);
+	}
+
+	while ((thread = threadlist_remhead(&victims)) != NULL) {
+		thread_destroy(thread);
+	}
+	threadlist_cleanup(&victims);
+	return n;
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Most go into the
+ * thread pool instead of being destroyed.
  *
  * The list of zombies is per-cpu.
  */
@@ -284,7 +471,7 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		thread_pool_put(z);
 	}
 }
 
@@ -296,6 +483,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *rq;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -310,9 +500,13 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		rq = &curcpu->c_runqueue[i];
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -358,6 +552,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -442,6 +642,80 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queues.
+ *
+ * Each cpu has a run queue for each of the SCHED_NLEVELS priority
+ * levels, 0 being the highest, and runs the first thread of the
+ * highest level that has any. The caller holds the cpu's run queue
+ * lock. A thread's level is its effective priority (thread_priority)
+ * as of when it was queued, and is kept in t_runlevel while it waits.
+ */
+
+/* Add T at the end of its level's queue on C. */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	t->t_runlevel = thread_priority(t);
+	KASSERT(t->t_runlevel < SCHED_NLEVELS);
+	threadlist_addtail(&c->c_runqueue[t->t_runlevel], t);
+	c->c_runcount++;
+}
+
+/* Take the thread that should run next on C, or NULL if none. */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			t->t_runlevel = SCHED_NLEVELS;
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* Take the thread that would run last on C, or NULL if none. */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			t->t_runlevel = SCHED_NLEVELS;
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* True if a thread of higher priority than PRIORITY is waiting on C. */
+static
+bool
+runqueue_hashigher(struct cpu *c, unsigned priority)
+{
+	unsigned i;
+
+	for (i=0; i<priority; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -464,9 +738,18 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
+	/*
+	 * A thread waking up from sleep moves up a level: it didn't
+	 * use the cpu while it waited, so it's probably interactive.
+	 */
+	if (target->t_state == S_SLEEP && target->t_priority > 0) {
+		target->t_priority--;
+		target->t_ticks = 0;
+	}
+
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 
 	if (targetcpu->c_isidle) {
 		/*
@@ -482,53 +765,41 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 }
 
 /*
- * Create a new thread based on an existing one.
- *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
- *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * Set up a new thread as thread_fork does, to run ENTRYPOINT on cpu
+ * C, but don't make it runnable yet. Returns an error code.
  */
+static
 int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+thread_build(const char *name, struct proc *proc, struct cpu *c,
+	     void (*entrypoint)(void *data1, unsigned long data2),
+	     void *data1, unsigned long data2, struct thread **ret)
 {
 	struct thread *newthread;
 	int result;
 
-
-    if (proc != NULL)
-    {
-	    DEBUG(DB_THREADS,"Forking thread: %s for new process %u\n",name,proc->p_pid);
-    }
-    else
-    {
-	    DEBUG(DB_THREADS,"Forking thread: %s\n",name);
-    }
-
-	newthread = thread_create(name);
+	/* Reuse a dead thread and its stack if we can */
+	newthread = thread_pool_get(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_cpu = c;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -551,12 +822,128 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
+	*ret = newthread;
+	return 0;
+}
+
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller. It will start on the same CPU
+ * as the caller, unless the scheduler intervenes first.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	struct thread *newthread;
+	int result;
+
+
+    if (proc != NULL)
+    {
+	    DEBUG(DB_THREADS,"Forking thread: %s for new process %u\n",name,proc->p_pid);
+    }
+    else
+    {
+	    DEBUG(DB_THREADS,"Forking thread: %s\n",name);
+    }
+
+	result = thread_build(name, proc, curthread->t_cpu,
+			      entrypoint, data1, data2, &newthread);
+	if (result) {
+		return result;
+	}
+
 	/* Lock the current cpu's run queue and make the new thread runnable */
 	thread_make_runnable(newthread, false);
 
 	return 0;
 }
 
+/*
+ * Idle workers.
+ *
+ * Each cpu can have one kernel thread that soaks up time the cpu
+ * would otherwise spend in cpu_idle(). It never sits on a run queue
+ * or wait channel while it waits for that; it is "parked", and
+ * thread_switch picks it directly when the run queue is empty and
+ * idleworker_wanted() says there is something to do. It then calls
+ * idleworker_work() until that says it's done or another thread
+ * becomes runnable on the cpu, and parks again. It doesn't migrate.
+ */
+static bool (*idleworker_wanted)(void);
+static bool (*idleworker_work)(void);
+
+/*
+ * Work stealing.
+ *
+ * Called by a cpu that has nothing to run, before it goes idle, with
+ * its own run queue unlocked (two cpus stealing from each other must
+ * not each hold their own lock while waiting for the other's). Takes
+ * the thread that would wait longest on the busiest other cpu and
+ * puts it on our run queue. Returns true if there was one.
+ *
+ * Cpus that are idle themselves are left alone; they are about to
+ * run whatever they have.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, most;
+
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		/* unlocked peeks; we check again under the lock */
+		if (c != curcpu->c_self && !c->c_isidle &&
+		    c->c_runcount > most) {
+			victim = c;
+			most = c->c_runcount;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_remtail(victim);
+	if (t != NULL &&
+	    (t == victim->c_curthread || t == victim->c_idleworker)) {
+		/* not movable; see thread_consider_migration */
+		runqueue_add(victim, t);
+		t = NULL;
+	}
+	if (t != NULL) {
+		/* only under the lock of the cpu it names; see thread_inherit */
+		t->t_cpu = curcpu->c_self;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	runqueue_add(curcpu->c_self, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
+	curcpu->c_steals++;
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return true;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -565,7 +952,7 @@ thread_fork(const char *name,
  *
  * If NEWSTATE is S_SLEEP, the thread is queued on the wait channel
  * WC, protected by the spinlock LK. Otherwise WC and Lk should be
- * NULL.
+ * NULL. (The idle worker parks itself with S_SLEEP and no WC.)
  */
 static
 void
@@ -598,7 +985,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -612,6 +999,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
+		if (wc == NULL) {
+			/* idle worker parking; see thread_idleworker_park */
+			cur->t_wchan_name = "idle";
+			curcpu->c_idleworker_parked = true;
+			break;
+		}
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -632,7 +1025,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from another cpu, and failing that call cpu_idle().
 	 * curcpu->c_isidle must be true when md_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -651,10 +1045,18 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
+		if (next == NULL && curcpu->c_idleworker_parked &&
+		    idleworker_wanted()) {
+			/* nothing else to run; give the idle worker a turn */
+			next = curcpu->c_idleworker;
+			curcpu->c_idleworker_parked = false;
+		}
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -737,6 +1139,71 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	splx(spl);
 }
 
+/*
+ * Park the current cpu's idle worker until the cpu is next idle.
+ */
+static
+void
+thread_idleworker_park(void)
+{
+	KASSERT(curthread == curcpu->c_idleworker);
+	thread_switch(S_SLEEP, NULL, NULL);
+}
+
+static
+void
+thread_idleworker(void *unused1, unsigned long unused2)
+{
+	bool more;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		/* unlocked peek at the run queue; being late is harmless */
+		do {
+			more = idleworker_work();
+		} while (more && curcpu->c_runcount == 0);
+
+		thread_idleworker_park();
+	}
+}
+
+/*
+ * Create a parked idle worker on every cpu. See thread.h.
+ */
+int
+thread_fork_idleworkers(const char *name, bool (*wanted)(void),
+			bool (*work)(void))
+{
+	struct thread *t;
+	struct cpu *c;
+	unsigned i;
+	int result;
+
+	KASSERT(idleworker_work == NULL);
+	idleworker_wanted = wanted;
+	idleworker_work = work;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		result = thread_build(name, NULL, c, thread_idleworker,
+				      NULL, 0, &t);
+		if (result) {
+			return result;
+		}
+		t->t_state = S_SLEEP;
+		t->t_wchan_name = "idle";
+
+		spinlock_acquire(&c->c_runqueue_lock);
+		KASSERT(c->c_idleworker == NULL);
+		c->c_idleworker = t;
+		c->c_idleworker_parked = true;
+		spinlock_release(&c->c_runqueue_lock);
+	}
+	return 0;
+}
+
 /*
  * This function is where new threads start running. The arguments
  * ENTRYPOINT, DATA1, and DATA2 are passed through from thread_fork.
@@ -821,6 +1288,16 @@ thread_exit(void)
 	panic("braaaaaaaiiiiiiiiiiinssssss\n");
 }
 
+/*
+ * Check whether T is on a cpu. See thread.h.
+ */
+bool
+thread_isrunning(struct thread *t)
+{
+	/* an unlocked read; t_state is S_RUN only while it runs */
+	return *(volatile threadstate_t *)&t->t_state == S_RUN;
+}
+
 /*
  * Yield the cpu to another process, but stay runnable.
  */
@@ -835,17 +1312,134 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Threads start at the top
+ * level (0). A thread that runs for its level's whole quantum, which
+ * doubles at each level down, is moved down one; one that wakes up
+ * from sleeping is moved up one. So threads that mostly wait for
+ * input stay near the top and get the cpu as soon as they want it,
+ * and ones that compute sink to the bottom, where they get longer
+ * slices. The running thread is preempted at the next hardclock if a
+ * thread of higher priority is waiting.
+ *
+ * That alone could starve the bottom levels, so schedule(), which
+ * hardclock() calls every SCHEDULE_HARDCLOCKS, moves every thread on
+ * the current CPU's run queues back to the top.
+ *
+ * Priorities are per thread and protected by the run queue lock of
+ * the thread's cpu. A thread holding a lock that better threads are
+ * waiting for runs at their level instead, until it lets go; that
+ * doesn't change its own level, which keeps moving as above.
  */
 
+/* Hardclocks a thread at level LEVEL runs before being moved down */
+#define SCHED_QUANTUM(level)	(2U << (level))
+
 void
 schedule(void)
 {
+	struct cpu *c = curcpu->c_self;
+	struct thread *t;
+	unsigned i;
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		while ((t = threadlist_remhead(&c->c_runqueue[i])) != NULL) {
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			t->t_runlevel = 0;
+			threadlist_addtail(&c->c_runqueue[0], t);
+		}
+	}
+	curthread->t_priority = 0;
+	curthread->t_ticks = 0;
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Effective priority. See thread.h.
+ */
+unsigned
+thread_priority(struct thread *t)
+{
+	return t->t_inherited < t->t_priority ? t->t_inherited : t->t_priority;
+}
+
+/*
+ * Lend T a priority. See thread.h.
+ */
+void
+thread_inherit(struct thread *t, unsigned priority)
+{
+	struct cpu *c;
+
+	KASSERT(priority <= SCHED_NLEVELS);
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * T's t_cpu only changes under the run queue lock of the cpu
+	 * it names (see thread_steal and thread_consider_migration), so
+	 * once we hold that lock and it still names that cpu, T is
+	 * either on that cpu's queue (t_runlevel says which) or off
+	 * every queue and stays put until we let go.
 	 */
+	while (1) {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			break;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+
+	if (t->t_runlevel < SCHED_NLEVELS) {
+		threadlist_remove(&c->c_runqueue[t->t_runlevel], t);
+		c->c_runcount--;
+		t->t_inherited = priority;
+		runqueue_add(c, t);
+	}
+	else {
+		/* running, asleep, or being moved: picked up when queued */
+		t->t_inherited = priority;
+	}
+
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Account for a hardclock. See thread.h.
+ */
+void
+thread_tick(void)
+{
+	struct thread *cur = curthread;
+	bool preempt;
+
+	if (curcpu->c_isidle) {
+		/* the idle loop; thread_switch would ignore us anyway */
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (cur == curcpu->c_idleworker) {
+		/* it isn't scheduled by priority; anyone else goes first */
+		preempt = curcpu->c_runcount > 0;
+	}
+	else if (++cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		/* used up its quantum: move down, and let others run */
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		preempt = true;
+	}
+	else {
+		preempt = runqueue_hashigher(curcpu->c_self,
+					     thread_priority(cur));
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
 }
 
 /*
@@ -861,115 +1455,140 @@ schedule(void)
  * and the performance loss due to underutilization of some CPUs is
  * something that needs to be tuned and probably is workload-specific.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Idle cpus steal work for themselves (see thread_steal), so pushing
+ * work is only needed to even out cpus that are all busy, and we
+ * only bother when the imbalance is at least MIGRATE_IMBALANCE
+ * threads. The counts are read without locking; being off by a
+ * little only changes how many threads we move.
  */
+#define MIGRATE_IMBALANCE	2
+
 void
 thread_consider_migration(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
+	unsigned my_count, total_count, least_count, one_share, to_send;
+	unsigned i, j, numcpus, n, room;
 	struct cpu *c;
-	struct threadlist victims;
+	struct threadlist victims, stay;
 	struct thread *t;
 
 	my_count = total_count = 0;
+	least_count = (unsigned)-1;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		n = c->c_runcount;
+		total_count += n;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = n;
+		}
+		else if (n < least_count) {
+			least_count = n;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	if (my_count < one_share || numcpus == 1 ||
+	    my_count - least_count < MIGRATE_IMBALANCE) {
 		return;
 	}
 
+	/*
+	 * Pick each victim's destination as we take it off our run
+	 * queue, filling the other cpus up to one share in turn, and
+	 * set its t_cpu while we still hold our own run queue lock;
+	 * t_cpu must only change under the lock of the cpu it names
+	 * (see thread_inherit). Ordinarily, curthread will not appear
+	 * on the run queue. However, it can under the following
+	 * circumstances:
+	 *   - it went to sleep;
+	 *   - the processor became idle, so it remained curthread;
+	 *   - it was reawakened, so it was put on the run queue;
+	 *   - and the processor hasn't fully unidled yet, so all
+	 *     these things are still true.
+	 *
+	 * If the timer interrupt happens at (almost) exactly the
+	 * proper moment, we can come here while things are in this
+	 * state and see curthread. However, *migrating* curthread can
+	 * cause bad things to happen (Exercise: Why? And what?) so it
+	 * stays, and so does the idle worker.
+	 */
 	to_send = my_count - one_share;
 	threadlist_init(&victims);
+	threadlist_init(&stay);
+	c = NULL;
+	room = 0;
+	j = 0;
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+		while (room == 0 && j < numcpus) {
+			c = cpuarray_get(&allcpus, j++);
+			n = c->c_runcount;
+			room = (c != curcpu->c_self && n < one_share) ?
+				one_share - n : 0;
+		}
+		if (room == 0) {
+			break;
+		}
+		/* the ones that would wait longest here */
+		t = runqueue_remtail(curcpu->c_self);
+		if (t == NULL) {
+			break;
+		}
+		if (t == curthread || t == curcpu->c_idleworker) {
+			threadlist_addhead(&stay, t);
+			continue;
+		}
+		t->t_cpu = c;
+		threadlist_addtail(&victims, t);
+		room--;
+	}
+	while ((t = threadlist_remhead(&stay)) != NULL) {
+		runqueue_add(curcpu->c_self, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
+	while ((t = threadlist_remhead(&victims)) != NULL) {
+		c = t->t_cpu;
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
+		runqueue_add(c, t);
+		if (c->c_isidle) {
 			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
+			 * Other processor is idle; send interrupt to
+			 * make sure it unidles.
 			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+			ipi_send(c, IPI_UNIDLE);
 		}
 		spinlock_release(&c->c_runqueue_lock);
-	}
-
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+		curcpu->c_pushes++;
+		DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u",
+		      t->t_name, curcpu->c_number, c->c_number);
 	}
 
 	KASSERT(threadlist_isempty(&victims));
+	threadlist_cleanup(&stay);
 	threadlist_cleanup(&victims);
 }
 
+void
+thread_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, j;
+
+	kprintf("cpu  hardclocks  waiting (by level)   stolen   pushed\n");
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		/* unlocked; this is only a snapshot anyway */
+		kprintf("%3u %11u %4u (", c->c_number, c->c_hardclocks,
+			c->c_runcount);
+		for (j=0; j<SCHED_NLEVELS; j++) {
+			kprintf("%s%u", j ? " " : "", c->c_runqueue[j].tl_count);
+		}
+		kprintf(") %10u %8u\n", c->c_steals, c->c_pushes);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -1038,6 +1657,15 @@ wchan_destroy(struct wchan *wc)
 	kfree(wc);
 }
 
+/*
+ * Rename a wait channel.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
+}
+
 /*
  * Yield the cpu to another process, and go to sleep, on the specified
  * wait channel WC, whose associated spinlock is LK. Calling wakeup on
@@ -1172,26 +1800,103 @@ ipi_broadcast(int code)
 	}
 }
 
-void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+unsigned
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mappings,
+		 int num)
 {
-	int n;
+	unsigned ticket;
+	int i, n;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n == TLBSHOOTDOWN_ALL) {
+		/* already flushing everything */
+	}
+	else if (num == TLBSHOOTDOWN_ALL || n + num > TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+		for (i=0; i<num; i++) {
+			target->c_shootdown[n+i] = mappings[i];
+		}
+		target->c_numshootdown = n + num;
 	}
+	ticket = target->c_shootdowns_received;
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+	if ((target->c_ipi_pending & ((uint32_t)1 << IPI_TLBSHOOTDOWN)) == 0) {
+		target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(target);
+		curcpu->c_shootdowns_sent++;
+	}
 
 	spinlock_release(&target->c_ipi_lock);
+
+	return ticket;
+}
+
+void
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mappings, int num,
+			   bool wait)
+{
+	unsigned tickets[MAXCPUS];
+	unsigned i, received;
+	struct cpu *self, *c;
+	int j, spl;
+
+	/* Spinning for acks with interrupts off could deadlock. */
+	KASSERT(!wait || curthread->t_curspl == 0);
+
+	spl = splhigh();
+
+	self = curcpu->c_self;
+	if (num == TLBSHOOTDOWN_ALL) {
+		vm_tlbshootdown_all();
+	}
+	else {
+		for (j=0; j<num; j++) {
+			vm_tlbshootdown(&mappings[j]);
+		}
+	}
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != self) {
+			tickets[i] = ipi_tlbshootdown(c, mappings, num);
+		}
+	}
+
+	splx(spl);
+
+	if (!wait) {
+		return;
+	}
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == self) {
+			continue;
+		}
+		do {
+			spinlock_acquire(&c->c_ipi_lock);
+			received = c->c_shootdowns_received;
+			spinlock_release(&c->c_ipi_lock);
+		} while (received == tickets[i]);
+	}
+}
+
+void
+ipi_printstats(void)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("cpu%u: %u TLB shootdown IPIs sent, %u received\n",
+			c->c_number, c->c_shootdowns_sent,
+			c->c_shootdowns_received);
+	}
 }
 
 void
@@ -1236,6 +1941,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdowns_received++;
 	}
 
 	curcpu->c_ipi_pending = 0;
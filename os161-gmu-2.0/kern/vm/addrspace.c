@@ -27,10 +27,19 @@
  * SUCH DAMAGE.
  */
 
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
+#include <proc.h>
+#include <vnode.h>
 #include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <vmstat.h>
 #include <vm.h>
 
 /*
@@ -49,17 +58,183 @@ as_create(void)
 		return NULL;
 	}
 
-	/*
-	 * Initialize as needed.
-	 */
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		kfree(as);
+		return NULL;
+	}
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		lock_destroy(as->as_lock);
+		kfree(as);
+		return NULL;
+	}
+
+	as->as_regions = NULL;
+	as->as_heap = NULL;
+	as->as_brk = 0;
+	bzero(&as->as_stats, sizeof(as->as_stats));
+	mmu_initas(as);
 
 	return as;
 }
 
+/*
+ * Add a region to AS. The caller holds the lock. Returns the new
+ * region, or NULL if out of memory.
+ */
+static
+struct vm_region *
+as_addregion(struct addrspace *as, vaddr_t base, size_t npages, int perm)
+{
+	struct vm_region *vr;
+
+	vr = kmalloc(sizeof(*vr));
+	if (vr == NULL) {
+		return NULL;
+	}
+	vr->vr_base = base;
+	vr->vr_npages = npages;
+	vr->vr_perm = perm;
+	vr->vr_flags = 0;
+	vr->vr_vnode = NULL;
+	vr->vr_fileoff = 0;
+	vr->vr_filebase = 0;
+	vr->vr_filesize = 0;
+	vr->vr_next = as->as_regions;
+	as->as_regions = vr;
+	return vr;
+}
+
+/*
+ * Take region VR off AS's list and free it. Its pages must already
+ * be gone. The caller holds the lock.
+ */
+static
+void
+as_removeregion(struct addrspace *as, struct vm_region *vr)
+{
+	struct vm_region **vrp;
+
+	for (vrp = &as->as_regions; *vrp != vr; vrp = &(*vrp)->vr_next) {
+		KASSERT(*vrp != NULL);
+	}
+	*vrp = vr->vr_next;
+
+	if (vr->vr_vnode != NULL) {
+		VOP_DECREF(vr->vr_vnode);
+	}
+	kfree(vr);
+}
+
+/*
+ * Split the region containing VADDR (if any) in two at VADDR, so that
+ * a region starts there. The caller holds the lock.
+ */
+static
+int
+as_splitregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct vm_region *vr, *nvr;
+	vaddr_t fileend;
+	size_t npages;
+
+	vr = as_findregion(as, vaddr);
+	if (vr == NULL || vr->vr_base == vaddr) {
+		return 0;
+	}
+	npages = (vaddr - vr->vr_base) / PAGE_SIZE;
+
+	nvr = as_addregion(as, vaddr, vr->vr_npages - npages, vr->vr_perm);
+	if (nvr == NULL) {
+		return ENOMEM;
+	}
+	nvr->vr_flags = vr->vr_flags;
+	vr->vr_npages = npages;
+
+	/* Hand the file-backed part past VADDR to the new region. */
+	if (vr->vr_vnode != NULL) {
+		fileend = vr->vr_filebase + vr->vr_filesize;
+		if (fileend > vaddr) {
+			VOP_INCREF(vr->vr_vnode);
+			nvr->vr_vnode = vr->vr_vnode;
+			nvr->vr_filebase = vr->vr_filebase > vaddr ?
+				vr->vr_filebase : vaddr;
+			nvr->vr_fileoff = vr->vr_fileoff +
+				(nvr->vr_filebase - vr->vr_filebase);
+			nvr->vr_filesize = fileend - nvr->vr_filebase;
+			vr->vr_filesize = vr->vr_filebase < vaddr ?
+				vaddr - vr->vr_filebase : 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Remove every translation for pages in [START, END) of AS from every
+ * TLB. The caller holds the lock.
+ */
+static
+void
+as_shootdown(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct tlbbatch tb;
+	vaddr_t va;
+	pte_t *pte;
+
+	mmu_batch_init(&tb);
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte != NULL && (*pte & PTE_VALID)) {
+			mmu_batch_add(&tb, as, va);
+		}
+	}
+	mmu_batch_send(&tb, true);
+}
+
+/*
+ * Release the frames and swap slots of the pages in [START, END) of
+ * AS, which must no longer be in any TLB. The caller holds the lock.
+ */
+static
+void
+as_freepages(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	vaddr_t va;
+	pte_t *pte;
+
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL) {
+			continue;
+		}
+		if (*pte & PTE_CACHED) {
+			pagecache_put(PTE_PADDR(*pte), as, va,
+				      (*pte & PTE_DIRTY) != 0);
+			vmstat_resident(as, -1);
+		}
+		else if (*pte & PTE_VALID) {
+			coremap_free(PTE_PADDR(*pte));
+			vmstat_resident(as, -1);
+		}
+		else if (*pte & PTE_SWAPPED) {
+			swap_free(PTE_SLOT(*pte));
+		}
+		*pte = 0;
+	}
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	struct vm_region *vr, *nvr;
+	pte_t *opte, *npte;
+	paddr_t pa;
+	vaddr_t va;
+	size_t i;
+	int result;
 
 	newas = as_create();
 	if (newas==NULL) {
@@ -67,22 +242,129 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	}
 
 	/*
-	 * Write this.
+	 * Lock the new one too: once its frames are unpinned or
+	 * mapped, the pageout code may try to take them. (It only ever
+	 * try-locks address spaces, so holding both can't deadlock.)
 	 */
+	lock_acquire(old->as_lock);
+	lock_acquire(newas->as_lock);
+
+	for (vr = old->as_regions; vr != NULL; vr = vr->vr_next) {
+		nvr = as_addregion(newas, vr->vr_base, vr->vr_npages,
+				   vr->vr_perm);
+		if (nvr == NULL) {
+			result = ENOMEM;
+			goto fail;
+		}
+		nvr->vr_flags = vr->vr_flags;
+		if (vr == old->as_heap) {
+			newas->as_heap = nvr;
+		}
+		if (vr->vr_vnode != NULL) {
+			VOP_INCREF(vr->vr_vnode);
+			nvr->vr_vnode = vr->vr_vnode;
+			nvr->vr_fileoff = vr->vr_fileoff;
+			nvr->vr_filebase = vr->vr_filebase;
+			nvr->vr_filesize = vr->vr_filesize;
+		}
+
+		for (i=0; i<vr->vr_npages; i++) {
+			va = vr->vr_base + i * PAGE_SIZE;
+			opte = pt_lookup(old->as_pt, va, false);
+			if (opte == NULL || *opte == 0) {
+				continue;
+			}
+			npte = pt_lookup(newas->as_pt, va, true);
+			if (npte == NULL) {
+				result = ENOMEM;
+				goto fail;
+			}
 
-	(void)old;
+			if (*opte & PTE_SWAPPED) {
+				/* Swap slots aren't shared; read a copy in. */
+				pa = vm_allocpage(newas, va, false);
+				if (pa == 0) {
+					result = ENOMEM;
+					goto fail;
+				}
+				result = swap_in(PTE_SLOT(*opte), pa);
+				if (result) {
+					coremap_free(pa);
+					goto fail;
+				}
+				*npte = pa | PTE_VALID | PTE_DIRTY;
+				VMSTAT_COUNT(newas, vs_swapin);
+				vmstat_resident(newas, 1);
+				coremap_unpin(pa);
+				continue;
+			}
+			if (*opte & PTE_CACHED) {
+				/*
+				 * Already shared, and private mappings are
+				 * already copy-on-write.
+				 */
+				result = pagecache_dup(PTE_PADDR(*opte), newas, va);
+				if (result) {
+					goto fail;
+				}
+				*npte = *opte;
+				vmstat_resident(newas, 1);
+				continue;
+			}
+			/*
+			 * Share the frame copy-on-write; whichever side
+			 * writes first gets its own copy in vm_fault.
+			 */
+			coremap_share(PTE_PADDR(*opte));
+			*opte |= PTE_COW;
+			*npte = *opte;
+			vmstat_resident(newas, 1);
+		}
+	}
+
+	newas->as_brk = old->as_brk;
+
+	lock_release(newas->as_lock);
+	lock_release(old->as_lock);
+
+	/*
+	 * The parent may still have writeable TLB entries for these,
+	 * here or on CPUs it ran on before.
+	 */
+	mmu_forget(old);
 
 	*ret = newas;
 	return 0;
+
+ fail:
+	lock_release(newas->as_lock);
+	lock_release(old->as_lock);
+	as_destroy(newas);
+	return result;
 }
 
 void
 as_destroy(struct addrspace *as)
 {
+	struct vm_region *vr;
+
 	/*
-	 * Clean up as needed.
+	 * Hold the lock so the pageout code leaves our frames alone
+	 * (and we wait for any eviction already in progress).
 	 */
+	lock_acquire(as->as_lock);
+
+	while (as->as_regions != NULL) {
+		vr = as->as_regions;
+		as_freepages(as, vr->vr_base,
+			     vr->vr_base + vr->vr_npages * PAGE_SIZE);
+		as_removeregion(as, vr);
+	}
 
+	lock_release(as->as_lock);
+
+	pt_destroy(as->as_pt);
+	lock_destroy(as->as_lock);
 	kfree(as);
 }
 
@@ -91,7 +373,7 @@ as_activate(void)
 {
 	struct addrspace *as;
 
-	as = curproc_getas();
+	as = proc_getas();
 	if (as == NULL) {
 		/*
 		 * Kernel thread without an address space; leave the
@@ -100,78 +382,232 @@ as_activate(void)
 		return;
 	}
 
-	/*
-	 * Write this.
-	 */
+	mmu_activate(as);
 }
 
 void
 as_deactivate(void)
 {
 	/*
-	 * Write this. For many designs it won't need to actually do
-	 * anything. See proc.c for an explanation of why it (might)
-	 * be needed.
+	 * Nothing to do: translations are tagged with the address
+	 * space's ASID, so they can't be used by whatever runs next,
+	 * and a destroyed address space's ASIDs are never reused
+	 * without flushing.
 	 */
 }
 
+/*
+ * Find the region containing VADDR.
+ */
+struct vm_region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct vm_region *vr;
+
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vaddr >= vr->vr_base &&
+		    vaddr - vr->vr_base < vr->vr_npages * PAGE_SIZE) {
+			return vr;
+		}
+	}
+	return NULL;
+}
+
 /*
  * Set up a segment at virtual address VADDR of size MEMSIZE. The
  * segment in memory extends from VADDR up to (but not including)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. Writes
+ * to a region without WRITEABLE fault, and a region with none of the
+ * flags cannot be touched at all.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
+	struct vm_region *vr;
+	size_t npages;
+	int perm, result;
 
-	(void)as;
-	(void)vaddr;
-	(void)sz;
-	(void)readable;
-	(void)writeable;
-	(void)executable;
-	return EUNIMP;
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	npages = sz / PAGE_SIZE;
+
+	if (npages == 0 || vaddr >= USERSPACETOP ||
+	    npages > (USERSPACETOP - vaddr) / PAGE_SIZE) {
+		return EFAULT;
+	}
+
+	perm = (readable ? VR_READ : 0) | (writeable ? VR_WRITE : 0) |
+		(executable ? VR_EXEC : 0);
+
+	lock_acquire(as->as_lock);
+
+	/* Regions may not overlap. */
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vaddr < vr->vr_base + vr->vr_npages * PAGE_SIZE &&
+		    vr->vr_base < vaddr + sz) {
+			lock_release(as->as_lock);
+			return EINVAL;
+		}
+	}
+
+	result = as_addregion(as, vaddr, npages, perm) ? 0 : ENOMEM;
+
+	lock_release(as->as_lock);
+	return result;
+}
+
+/*
+ * Back part of an existing region with a file. See addrspace.h.
+ */
+int
+as_define_backing(struct addrspace *as, vaddr_t vaddr,
+		  struct vnode *v, off_t offset, size_t filesize)
+{
+	struct vm_region *vr;
+
+	if (filesize == 0) {
+		/* all BSS; nothing to read */
+		return 0;
+	}
+
+	lock_acquire(as->as_lock);
+
+	vr = as_findregion(as, vaddr);
+	if (vr == NULL || vr->vr_vnode != NULL ||
+	    filesize > vr->vr_npages * PAGE_SIZE - (vaddr - vr->vr_base)) {
+		lock_release(as->as_lock);
+		return EINVAL;
+	}
+
+	VOP_INCREF(v);
+	vr->vr_vnode = v;
+	vr->vr_fileoff = offset;
+	vr->vr_filebase = vaddr;
+	vr->vr_filesize = filesize;
+
+	lock_release(as->as_lock);
+	return 0;
 }
 
 int
 as_prepare_load(struct addrspace *as)
 {
 	/*
-	 * Write this.
+	 * Nothing to do: load_elf only records where each segment
+	 * comes from, and pages are read in by vm_fault.
 	 */
-
 	(void)as;
 	return 0;
 }
 
+/*
+ * Once the executable's segments are defined, put the (empty) heap
+ * right after the highest of them.
+ */
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
+	struct vm_region *vr;
+	vaddr_t base, end;
 
-	(void)as;
+	lock_acquire(as->as_lock);
+
+	KASSERT(as->as_heap == NULL);
+
+	base = 0;
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		end = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		if (end > base) {
+			base = end;
+		}
+	}
+
+	as->as_heap = as_addregion(as, base, 0, VR_READ | VR_WRITE);
+	if (as->as_heap == NULL) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+	as->as_brk = base;
+
+	lock_release(as->as_lock);
+	return 0;
+}
+
+/*
+ * Move the break by CHANGE bytes and hand back the old one. The heap
+ * region always covers exactly the pages up to the break. New pages
+ * are zero-filled when first touched like any others; pages given
+ * back are freed right away.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t change, vaddr_t *oldbrk)
+{
+	struct vm_region *heap, *vr;
+	vaddr_t newbrk, top, newtop;
+
+	lock_acquire(as->as_lock);
+
+	heap = as->as_heap;
+	KASSERT(heap != NULL);
+
+	if (change < 0 && (vaddr_t)-change > as->as_brk - heap->vr_base) {
+		lock_release(as->as_lock);
+		return EINVAL;
+	}
+	if (change > 0 && (vaddr_t)change > USERSPACETOP - as->as_brk) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+
+	newbrk = as->as_brk + change;
+	top = heap->vr_base + heap->vr_npages * PAGE_SIZE;
+	newtop = ROUNDUP(newbrk, PAGE_SIZE);
+
+	if (newtop > top) {
+		/* Don't run into the stack (or anything else). */
+		for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+			if (vr != heap && vr->vr_base >= top &&
+			    vr->vr_base < newtop) {
+				lock_release(as->as_lock);
+				return ENOMEM;
+			}
+		}
+		heap->vr_npages = (newtop - heap->vr_base) / PAGE_SIZE;
+	}
+	else if (newtop < top) {
+		heap->vr_npages = (newtop - heap->vr_base) / PAGE_SIZE;
+
+		/* Get the pages out of every TLB before freeing them. */
+		as_shootdown(as, newtop, top);
+		as_freepages(as, newtop, top);
+	}
+
+	*oldbrk = as->as_brk;
+	as->as_brk = newbrk;
+
+	lock_release(as->as_lock);
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
+	int result;
 
-	(void)as;
+	result = as_define_region(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+				  VM_STACKPAGES * PAGE_SIZE, 1, 1, 0);
+	if (result) {
+		return result;
+	}
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
@@ -179,3 +615,203 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+
+/*
+ * Map LEN bytes of file V from OFFSET (page aligned) with permissions
+ * PERM. FLAGS are the VR_SHARED and VR_MAYWRITE region flags. The
+ * mapping goes at ADDR (page aligned) if that's not 0, and otherwise
+ * in the highest free space below the stack. Pages are faulted in
+ * through the page cache (see vm_fillpage).
+ */
+int
+as_mmap(struct addrspace *as, vaddr_t addr, size_t len, int perm, int flags,
+	struct vnode *v, off_t offset, vaddr_t *ret)
+{
+	struct vm_region *vr;
+	vaddr_t top, heaptop;
+	size_t npages;
+
+	KASSERT((addr & ~(vaddr_t)PAGE_FRAME) == 0);
+
+	npages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+	if (npages == 0 || npages > USERSPACETOP / PAGE_SIZE) {
+		return EINVAL;
+	}
+	len = npages * PAGE_SIZE;
+
+	lock_acquire(as->as_lock);
+
+	if (addr != 0) {
+		if (addr >= USERSPACETOP || len > USERSPACETOP - addr) {
+			lock_release(as->as_lock);
+			return EINVAL;
+		}
+		for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+			if (addr < vr->vr_base + vr->vr_npages * PAGE_SIZE &&
+			    vr->vr_base < addr + len) {
+				lock_release(as->as_lock);
+				return EINVAL;
+			}
+		}
+	}
+	else {
+		/* Leave the heap room to grow: stay above the break. */
+		KASSERT(as->as_heap != NULL);
+		heaptop = ROUNDUP(as->as_brk, PAGE_SIZE);
+
+		/* Move down past whatever is in the way until it fits. */
+		top = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+		vr = as->as_regions;
+		while (vr != NULL) {
+			if (top < heaptop || len > top - heaptop) {
+				lock_release(as->as_lock);
+				return ENOMEM;
+			}
+			if (vr != as->as_heap &&
+			    top - len < vr->vr_base + vr->vr_npages * PAGE_SIZE &&
+			    vr->vr_base < top) {
+				top = vr->vr_base;
+				vr = as->as_regions;
+				continue;
+			}
+			vr = vr->vr_next;
+		}
+		if (top < heaptop || len > top - heaptop) {
+			lock_release(as->as_lock);
+			return ENOMEM;
+		}
+		addr = top - len;
+	}
+
+	vr = as_addregion(as, addr, npages, perm);
+	if (vr == NULL) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+	VOP_INCREF(v);
+	vr->vr_flags = VR_MMAP | flags;
+	vr->vr_vnode = v;
+	vr->vr_fileoff = offset;
+	vr->vr_filebase = addr;
+	vr->vr_filesize = len;
+
+	lock_release(as->as_lock);
+	*ret = addr;
+	return 0;
+}
+
+/*
+ * Check that [ADDR, ADDR+LEN) is all mapped by mmap regions; if
+ * NEEDWRITE, also that they may be made writeable. The caller holds
+ * the lock.
+ */
+static
+int
+as_checkmmap(struct addrspace *as, vaddr_t addr, size_t len, bool needwrite)
+{
+	struct vm_region *vr;
+	vaddr_t va;
+
+	for (va = addr; va < addr + len;
+	     va = vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+		vr = as_findregion(as, va);
+		if (vr == NULL || (vr->vr_flags & VR_MMAP) == 0) {
+			return ENOMEM;
+		}
+		if (needwrite && (vr->vr_flags & VR_MAYWRITE) == 0) {
+			return EACCES;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Remove the mmap mappings in [ADDR, ADDR+LEN), both page aligned.
+ * Dirty shared pages are written back once nobody maps them anymore.
+ * Parts of the range with nothing mapped are skipped, but the range
+ * may not include any other kind of region.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct vm_region *vr, *next;
+	vaddr_t end;
+	int result;
+
+	if (addr >= USERSPACETOP || len > USERSPACETOP - addr) {
+		return EINVAL;
+	}
+	end = addr + len;
+
+	lock_acquire(as->as_lock);
+
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (addr < vr->vr_base + vr->vr_npages * PAGE_SIZE &&
+		    vr->vr_base < end && (vr->vr_flags & VR_MMAP) == 0) {
+			lock_release(as->as_lock);
+			return EINVAL;
+		}
+	}
+
+	result = as_splitregion(as, addr);
+	if (result == 0) {
+		result = as_splitregion(as, end);
+	}
+	if (result) {
+		lock_release(as->as_lock);
+		return result;
+	}
+
+	as_shootdown(as, addr, end);
+	for (vr = as->as_regions; vr != NULL; vr = next) {
+		next = vr->vr_next;
+		if (vr->vr_base >= addr && vr->vr_base < end) {
+			as_freepages(as, vr->vr_base,
+				     vr->vr_base + vr->vr_npages * PAGE_SIZE);
+			as_removeregion(as, vr);
+		}
+	}
+
+	lock_release(as->as_lock);
+	return 0;
+}
+
+/*
+ * Change the permissions of the mmap mappings in [ADDR, ADDR+LEN),
+ * both page aligned, to PERM.
+ */
+int
+as_mprotect(struct addrspace *as, vaddr_t addr, size_t len, int perm)
+{
+	struct vm_region *vr;
+	int result;
+
+	if (addr >= USERSPACETOP || len > USERSPACETOP - addr) {
+		return ENOMEM;
+	}
+
+	lock_acquire(as->as_lock);
+
+	result = as_checkmmap(as, addr, len, (perm & VR_WRITE) != 0);
+	if (result == 0) {
+		result = as_splitregion(as, addr);
+	}
+	if (result == 0) {
+		result = as_splitregion(as, addr + len);
+	}
+	if (result) {
+		lock_release(as->as_lock);
+		return result;
+	}
+
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vr->vr_base >= addr && vr->vr_base < addr + len) {
+			vr->vr_perm = perm;
+		}
+	}
+	/* Loaded translations may allow what is no longer allowed. */
+	as_shootdown(as, addr, addr + len);
+
+	lock_release(as->as_lock);
+	return 0;
+}
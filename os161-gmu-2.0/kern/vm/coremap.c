@@ -0,0 +1,1038 @@
+/*
+ * Coremap: physical page frame allocator.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <vm.h>
+#include <swap.h>
+#include <coremap.h>
+#include <reclaim.h>
+#include "opt-dumbvm.h"
+
+/*
+ * One entry per physical page frame we manage.
+ *
+ * Free frames are managed with a binary buddy system: they are kept
+ * in blocks of 2^k frames, aligned to 2^k in the array, on one
+ * doubly-linked list per order k, threaded through the entries by
+ * index. Only the first frame of a free block is on a list; it
+ * records the order. An allocation of n frames takes a block of the
+ * smallest order that fits, splitting larger ones as needed, and
+ * gives back the unused tail; freeing a run merges each piece with
+ * its buddy for as long as the buddy is also free. This keeps free
+ * memory in large contiguous pieces, so multi-page kernel allocations
+ * (stacks, buffers) keep succeeding even after a lot of single-page
+ * churn, and a single-page allocation or free is still O(1) in the
+ * usual case.
+ *
+ * The first frame of every allocated run records the length of the
+ * run in cme_npages so coremap_free only needs the base address and
+ * always releases the whole run.
+ *
+ * User frames are reference counted so that copy-on-write can share
+ * one frame between several address spaces. While a frame is shared
+ * its owner fields are meaningless; when it drops back to a single
+ * reference the owner is cleared until the remaining mapping claims
+ * it, and unowned frames are never chosen for eviction.
+ *
+ * A clean user frame may also have a copy in swap; the slot is kept
+ * here (not in the PTE, which holds the frame) and released along
+ * with the frame.
+ *
+ * Some free frames are kept out of the buddy lists in the zero pool,
+ * a stack of frames already known to be all zeros, threaded through
+ * cme_next. Each cpu's idle worker (see coremap_zero_one) refills it
+ * from the buddy lists when it has nothing better to do, so that
+ * zero-fill page faults don't have to clear a page. Pool frames still
+ * count as free: they are handed out for other uses, and the whole
+ * pool is given back to the buddy lists, when nothing else is left.
+ */
+struct coremap_entry {
+	struct addrspace *cme_as;	/* owning address space (user only) */
+	vaddr_t cme_vaddr;		/* user virtual address mapped here */
+	unsigned cme_state:2;		/* CME_FREE, CME_KERNEL, or CME_USER */
+	unsigned cme_pinned:1;		/* VM system must leave it alone */
+	unsigned cme_busy:1;		/* being evicted */
+	unsigned cme_referenced:1;	/* used since the clock hand passed */
+	unsigned cme_freehead:1;	/* first frame of a free block */
+	unsigned cme_order:5;		/* log2 of free block size, if so */
+	unsigned cme_zeroed:1;		/* free and in the zero pool */
+	unsigned cme_npages;		/* run length; first frame of run only */
+	unsigned cme_refcount;		/* mappings of a user frame */
+	unsigned cme_swapslot;		/* clean copy in swap, or SWAP_NOSLOT */
+	unsigned cme_next;		/* free list links (indexes) */
+	unsigned cme_prev;
+};
+
+#define CME_FREE	0
+#define CME_KERNEL	1
+#define CME_USER	2
+
+#define CM_NONE		((unsigned)-1)	/* end of free list */
+
+/* Largest free block is 2^CM_MAXORDER frames (4M). */
+#define CM_MAXORDER	10
+#define CM_NORDERS	(CM_MAXORDER + 1)
+
+/*
+ * User allocations fail once only CM_KRESERVE frames are left, so
+ * the kernel (which never evicts to satisfy kmalloc) can still get
+ * page table pages and the like; the VM system then evicts and
+ * retries. The pageout thread is woken when fewer than
+ * coremap_lowater frames are free and works until coremap_hiwater
+ * are. Kernel allocations that fail wait (see reclaim.c) on
+ * coremap_freewchan, until free frames are back above coremap_lowater
+ * or the pageout thread has finished another pass.
+ */
+#define CM_KRESERVE	4
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+static struct coremap_entry *coremap;
+static struct wchan *coremap_busywchan;		/* waiting for !cme_busy */
+static struct wchan *coremap_pageoutwchan;	/* pageout thread sleeps */
+static struct wchan *coremap_freewchan;		/* waiting for free frames */
+static unsigned coremap_nwaiting;		/* ...how many */
+
+static paddr_t coremap_base;	/* physical address of frame 0 */
+static unsigned coremap_npages;	/* total frames managed */
+static unsigned coremap_nfree;	/* frames currently free */
+static unsigned coremap_nuser;	/* frames currently owned by user as */
+static unsigned coremap_peakuser; /* most user frames at once */
+static unsigned coremap_nshared;	/* user frames with refcount > 1 */
+
+static unsigned coremap_lowater;
+static unsigned coremap_hiwater;
+
+static unsigned freelists[CM_NORDERS];	/* free block lists by order */
+
+static unsigned zeropool;		/* zero pool stack (index) */
+static unsigned zeropool_count;		/* frames in the zero pool */
+static unsigned zeropool_target;	/* how many to keep there */
+static unsigned zeropool_hits;		/* zeroed allocs from the pool */
+static unsigned zeropool_misses;	/* zeroed allocs we had to clear */
+static unsigned zeropool_filled;	/* frames cleared while idle */
+static unsigned clock_hand;
+
+////////////////////////////////////////////////////////////
+
+static
+inline
+paddr_t
+cm_paddr(unsigned ix)
+{
+	return coremap_base + (paddr_t)ix * PAGE_SIZE;
+}
+
+static
+inline
+unsigned
+cm_index(paddr_t paddr)
+{
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(paddr >= coremap_base);
+	KASSERT((paddr - coremap_base) / PAGE_SIZE < coremap_npages);
+	return (paddr - coremap_base) / PAGE_SIZE;
+}
+
+/*
+ * Take the free block starting at IX off its list.
+ */
+static
+void
+freeblock_remove(unsigned ix)
+{
+	struct coremap_entry *e = &coremap[ix];
+	unsigned order = e->cme_order;
+
+	KASSERT(e->cme_state == CME_FREE);
+	KASSERT(e->cme_freehead);
+
+	if (e->cme_prev == CM_NONE) {
+		KASSERT(freelists[order] == ix);
+		freelists[order] = e->cme_next;
+	}
+	else {
+		coremap[e->cme_prev].cme_next = e->cme_next;
+	}
+	if (e->cme_next != CM_NONE) {
+		coremap[e->cme_next].cme_prev = e->cme_prev;
+	}
+	e->cme_next = e->cme_prev = CM_NONE;
+	e->cme_freehead = 0;
+	coremap_nfree -= 1U << order;
+}
+
+/*
+ * Put the 2^ORDER free frames starting at IX on the free list for
+ * that order. The frames must already have been reset.
+ */
+static
+void
+freeblock_add(unsigned ix, unsigned order)
+{
+	struct coremap_entry *e = &coremap[ix];
+
+	KASSERT(order <= CM_MAXORDER);
+	KASSERT(ix % (1U << order) == 0);
+	KASSERT(ix + (1U << order) <= coremap_npages);
+	KASSERT(e->cme_state == CME_FREE);
+
+	e->cme_freehead = 1;
+	e->cme_order = order;
+	e->cme_prev = CM_NONE;
+	e->cme_next = freelists[order];
+	if (freelists[order] != CM_NONE) {
+		coremap[freelists[order]].cme_prev = ix;
+	}
+	freelists[order] = ix;
+	coremap_nfree += 1U << order;
+}
+
+/*
+ * Clear out a frame that is about to be freed.
+ */
+static
+void
+frame_reset(unsigned ix)
+{
+	struct coremap_entry *e = &coremap[ix];
+
+	e->cme_state = CME_FREE;
+	e->cme_pinned = 0;
+	e->cme_busy = 0;
+	e->cme_referenced = 0;
+	e->cme_freehead = 0;
+	e->cme_order = 0;
+	e->cme_zeroed = 0;
+	e->cme_swapslot = SWAP_NOSLOT;
+	e->cme_as = NULL;
+	e->cme_vaddr = 0;
+	e->cme_npages = 0;
+	e->cme_refcount = 0;
+	e->cme_next = e->cme_prev = CM_NONE;
+}
+
+/*
+ * Free the (reset) block of 2^ORDER frames at IX, merging it with its
+ * buddy, and the result with its buddy, and so on, as far as possible.
+ */
+static
+void
+buddy_free(unsigned ix, unsigned order)
+{
+	unsigned buddy;
+
+	while (order < CM_MAXORDER) {
+		buddy = ix ^ (1U << order);
+		if (buddy + (1U << order) > coremap_npages) {
+			break;
+		}
+		if (coremap[buddy].cme_state != CME_FREE ||
+		    !coremap[buddy].cme_freehead ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		freeblock_remove(buddy);
+		if (buddy < ix) {
+			ix = buddy;
+		}
+		order++;
+	}
+	freeblock_add(ix, order);
+}
+
+/*
+ * Free NPAGES frames starting at BASE, which need not be a buddy
+ * block: split the range into the largest aligned blocks that fit and
+ * free each of those.
+ */
+static
+void
+free_range(unsigned base, unsigned npages)
+{
+	unsigned ix, end, order;
+
+	end = base + npages;
+	for (ix=base; ix<end; ix++) {
+		frame_reset(ix);
+	}
+
+	ix = base;
+	while (ix < end) {
+		order = 0;
+		while (order < CM_MAXORDER &&
+		       ix % (2U << order) == 0 &&
+		       ix + (2U << order) <= end) {
+			order++;
+		}
+		buddy_free(ix, order);
+		ix += 1U << order;
+	}
+
+	if (coremap_nwaiting > 0 && coremap_nfree >= coremap_lowater) {
+		wchan_wakeall(coremap_freewchan, &coremap_lock);
+	}
+}
+
+/*
+ * Find and take NPAGES contiguous free frames. Returns the index of
+ * the first one, or CM_NONE.
+ */
+static
+unsigned
+alloc_run(unsigned npages)
+{
+	unsigned order, k, ix;
+
+	for (order = 0; (1U << order) < npages; order++) {
+		if (order == CM_MAXORDER) {
+			return CM_NONE;
+		}
+	}
+
+	for (k = order; k <= CM_MAXORDER; k++) {
+		if (freelists[k] != CM_NONE) {
+			break;
+		}
+	}
+	if (k > CM_MAXORDER) {
+		return CM_NONE;
+	}
+
+	ix = freelists[k];
+	freeblock_remove(ix);
+
+	/* split, giving back the upper halves */
+	while (k > order) {
+		k--;
+		freeblock_add(ix + (1U << k), k);
+	}
+
+	/* give back the part of the block we don't need */
+	if (npages < (1U << order)) {
+		free_range(ix + npages, (1U << order) - npages);
+	}
+
+	return ix;
+}
+
+/*
+ * Put the (reset) frame IX, whose contents are all zero, in the zero
+ * pool.
+ */
+static
+void
+zeropool_add(unsigned ix)
+{
+	struct coremap_entry *e = &coremap[ix];
+
+	KASSERT(e->cme_state == CME_FREE);
+	KASSERT(!e->cme_freehead);
+
+	e->cme_zeroed = 1;
+	e->cme_next = zeropool;
+	zeropool = ix;
+	zeropool_count++;
+	coremap_nfree++;
+}
+
+/*
+ * Take a frame from the zero pool. Returns its index, or CM_NONE if
+ * the pool is empty.
+ */
+static
+unsigned
+zeropool_take(void)
+{
+	unsigned ix;
+
+	ix = zeropool;
+	if (ix == CM_NONE) {
+		return CM_NONE;
+	}
+	KASSERT(coremap[ix].cme_zeroed);
+	zeropool = coremap[ix].cme_next;
+	coremap[ix].cme_next = CM_NONE;
+	coremap[ix].cme_zeroed = 0;
+	zeropool_count--;
+	coremap_nfree--;
+	return ix;
+}
+
+/*
+ * Give the whole zero pool back to the buddy lists, so its frames can
+ * be merged into larger blocks.
+ */
+static
+void
+zeropool_drain(void)
+{
+	unsigned ix;
+
+	while ((ix = zeropool_take()) != CM_NONE) {
+		free_range(ix, 1);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Take over all physical memory not used by the kernel image. The
+ * coremap array itself is carved out of the bottom of that memory.
+ */
+void
+coremap_bootstrap(void)
+{
+	paddr_t first, last;
+	size_t total, cmsize;
+	unsigned i;
+
+	/* ram_getfirstfree clears ram's idea of the size, so ask first */
+	last = ram_getsize();
+	first = ram_getfirstfree();
+
+	KASSERT((first & PAGE_FRAME) == first);
+	KASSERT(last > first);
+
+	/*
+	 * Size the array for all the pages after the kernel; this
+	 * overestimates slightly since the array's own pages aren't
+	 * managed, which is harmless.
+	 */
+	total = (last - first) / PAGE_SIZE;
+	cmsize = ROUNDUP(total * sizeof(struct coremap_entry), PAGE_SIZE);
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(first);
+	coremap_base = first + cmsize;
+	coremap_npages = (last - coremap_base) / PAGE_SIZE;
+	coremap_nfree = 0;
+	coremap_nuser = 0;
+	coremap_peakuser = 0;
+	coremap_nshared = 0;
+
+	for (i=0; i<CM_NORDERS; i++) {
+		freelists[i] = CM_NONE;
+	}
+	free_range(0, coremap_npages);
+
+	zeropool = CM_NONE;
+	zeropool_count = 0;
+	zeropool_target = coremap_npages / 32;
+
+	coremap_lowater = coremap_npages / 64;
+	if (coremap_lowater < 2 * CM_KRESERVE) {
+		coremap_lowater = 2 * CM_KRESERVE;
+	}
+	coremap_hiwater = 2 * coremap_lowater;
+
+	/* kmalloc works now, so we can make the wait channels. */
+	coremap_busywchan = wchan_create("coremap busy");
+	coremap_pageoutwchan = wchan_create("pageout");
+	coremap_freewchan = wchan_create("coremap free");
+	if (coremap_busywchan == NULL || coremap_pageoutwchan == NULL ||
+	    coremap_freewchan == NULL) {
+		panic("coremap: out of memory for wait channels\n");
+	}
+
+	kprintf("coremap: %u pages (%uk) managed, %uk used for coremap\n",
+		coremap_npages, coremap_npages * PAGE_SIZE / 1024,
+		cmsize / 1024);
+}
+
+/*
+ * Take NPAGES contiguous frames for AS at VADDR, as coremap_alloc
+ * does; the caller holds the coremap lock. If WANTZERO is set, a
+ * single frame comes from the zero pool if possible. *ZEROED is set
+ * to whether the frames are known to be zero. Returns the index of
+ * the first frame, or CM_NONE.
+ */
+static
+unsigned
+coremap_take(unsigned npages, struct addrspace *as, vaddr_t vaddr,
+	     bool wantzero, bool *zeroed)
+{
+	unsigned base, i;
+
+	KASSERT(npages > 0);
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	*zeroed = false;
+	if (as != NULL && coremap_nfree < npages + CM_KRESERVE) {
+		/* leave the reserve to the kernel; caller should evict */
+		base = CM_NONE;
+	}
+	else if (wantzero && npages == 1 && zeropool != CM_NONE) {
+		base = zeropool_take();
+		*zeroed = true;
+	}
+	else {
+		base = alloc_run(npages);
+		if (base == CM_NONE && npages == 1) {
+			/* the zero pool is the last of free memory */
+			base = zeropool_take();
+			*zeroed = base != CM_NONE;
+		}
+		else if (base == CM_NONE && zeropool != CM_NONE) {
+			zeropool_drain();
+			base = alloc_run(npages);
+		}
+	}
+	if (base == CM_NONE) {
+		wchan_wakeone(coremap_pageoutwchan, &coremap_lock);
+		return CM_NONE;
+	}
+
+	for (i=base; i<base+npages; i++) {
+		KASSERT(coremap[i].cme_state == CME_FREE);
+		if (as == NULL) {
+			coremap[i].cme_state = CME_KERNEL;
+		}
+		else {
+			coremap[i].cme_state = CME_USER;
+			coremap[i].cme_as = as;
+			coremap[i].cme_vaddr = vaddr + (i - base) * PAGE_SIZE;
+			coremap[i].cme_pinned = 1;
+			coremap[i].cme_refcount = 1;
+			coremap_nuser++;
+		}
+	}
+	coremap[base].cme_npages = npages;
+	if (coremap_nuser > coremap_peakuser) {
+		coremap_peakuser = coremap_nuser;
+	}
+
+	if (coremap_nfree < coremap_lowater) {
+		wchan_wakeone(coremap_pageoutwchan, &coremap_lock);
+	}
+	return base;
+}
+
+/*
+ * Allocate NPAGES contiguous frames. See coremap.h.
+ */
+paddr_t
+coremap_alloc(unsigned npages, struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned base;
+	bool zeroed;
+
+	spinlock_acquire(&coremap_lock);
+	base = coremap_take(npages, as, vaddr, false, &zeroed);
+	spinlock_release(&coremap_lock);
+
+	return base == CM_NONE ? 0 : cm_paddr(base);
+}
+
+/*
+ * Allocate a single zero-filled frame, preferably from the zero pool.
+ * See coremap.h.
+ */
+paddr_t
+coremap_alloc_zeroed(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned base;
+	bool zeroed;
+	paddr_t pa;
+
+	spinlock_acquire(&coremap_lock);
+	base = coremap_take(1, as, vaddr, true, &zeroed);
+	if (base != CM_NONE) {
+		if (zeroed) {
+			zeropool_hits++;
+		}
+		else {
+			zeropool_misses++;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	if (base == CM_NONE) {
+		return 0;
+	}
+	pa = cm_paddr(base);
+	if (!zeroed) {
+		bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	}
+	return pa;
+}
+
+/*
+ * Free a run allocated by coremap_alloc. For a shared user frame this
+ * only drops one reference. Waits if the frame is being evicted; the
+ * caller must hold the owning address space's lock so that the
+ * eviction can't actually complete underneath it.
+ */
+void
+coremap_free(paddr_t paddr)
+{
+	unsigned base, npages, i;
+
+	spinlock_acquire(&coremap_lock);
+
+	base = cm_index(paddr);
+	while (coremap[base].cme_busy) {
+		wchan_sleep(coremap_busywchan, &coremap_lock);
+	}
+	npages = coremap[base].cme_npages;
+	KASSERT(coremap[base].cme_state != CME_FREE);
+
+	if (coremap[base].cme_state == CME_USER &&
+	    coremap[base].cme_refcount > 1) {
+		KASSERT(npages == 1);
+		coremap[base].cme_refcount--;
+		if (coremap[base].cme_refcount == 1) {
+			coremap_nshared--;
+			coremap[base].cme_as = NULL;
+		}
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	KASSERT(npages > 0 && base + npages <= coremap_npages);
+
+	for (i=base; i<base+npages; i++) {
+		KASSERT(coremap[i].cme_state == coremap[base].cme_state);
+		if (coremap[i].cme_state == CME_USER) {
+			coremap_nuser--;
+		}
+		if (coremap[i].cme_swapslot != SWAP_NOSLOT) {
+			swap_free(coremap[i].cme_swapslot);
+		}
+	}
+	free_range(base, npages);
+
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Add a reference to a single user frame.
+ */
+void
+coremap_share(paddr_t paddr)
+{
+	unsigned ix;
+
+	spinlock_acquire(&coremap_lock);
+	ix = cm_index(paddr);
+	KASSERT(coremap[ix].cme_state == CME_USER);
+	KASSERT(coremap[ix].cme_npages == 1);
+	if (coremap[ix].cme_refcount == 1) {
+		coremap_nshared++;
+	}
+	coremap[ix].cme_refcount++;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * If the user frame at PADDR has exactly one reference, record AS and
+ * VADDR as its owner and return true. Otherwise it is still shared;
+ * return false.
+ */
+bool
+coremap_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned ix;
+	bool ret;
+
+	spinlock_acquire(&coremap_lock);
+	ix = cm_index(paddr);
+	KASSERT(coremap[ix].cme_state == CME_USER);
+	ret = coremap[ix].cme_refcount == 1;
+	if (ret) {
+		coremap[ix].cme_as = as;
+		coremap[ix].cme_vaddr = vaddr;
+	}
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+void
+coremap_pin(paddr_t paddr)
+{
+	unsigned ix;
+
+	spinlock_acquire(&coremap_lock);
+	ix = cm_index(paddr);
+	KASSERT(coremap[ix].cme_state == CME_USER);
+	coremap[ix].cme_pinned = 1;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_unpin(paddr_t paddr)
+{
+	unsigned ix;
+
+	spinlock_acquire(&coremap_lock);
+	ix = cm_index(paddr);
+	KASSERT(coremap[ix].cme_state == CME_USER);
+	KASSERT(coremap[ix].cme_pinned);
+	coremap[ix].cme_pinned = 0;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Note that the page in user frame PADDR has been used (its
+ * translation was just loaded), for the clock algorithm.
+ */
+void
+coremap_reference(paddr_t paddr)
+{
+	unsigned ix;
+
+	spinlock_acquire(&coremap_lock);
+	ix = cm_index(paddr);
+	KASSERT(coremap[ix].cme_state == CME_USER);
+	coremap[ix].cme_referenced = 1;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Clock step for frames kept outside the ordinary clock (the page
+ * cache's): return whether user frame PADDR was used since the last
+ * call, and clear the mark.
+ */
+bool
+coremap_age(paddr_t paddr)
+{
+	unsigned ix;
+	bool ret;
+
+	spinlock_acquire(&coremap_lock);
+	ix = cm_index(paddr);
+	KASSERT(coremap[ix].cme_state == CME_USER);
+	ret = coremap[ix].cme_referenced;
+	coremap[ix].cme_referenced = 0;
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+/*
+ * Record that SLOT holds a copy of the (clean) user frame PADDR.
+ */
+void
+coremap_setslot(paddr_t paddr, unsigned slot)
+{
+	unsigned ix;
+
+	spinlock_acquire(&coremap_lock);
+	ix = cm_index(paddr);
+	KASSERT(coremap[ix].cme_state == CME_USER);
+	KASSERT(coremap[ix].cme_swapslot == SWAP_NOSLOT);
+	coremap[ix].cme_swapslot = slot;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Forget the swap copy of user frame PADDR and hand back its slot
+ * (or SWAP_NOSLOT). The caller frees or reuses the slot.
+ */
+unsigned
+coremap_takeslot(paddr_t paddr)
+{
+	unsigned ix, slot;
+
+	spinlock_acquire(&coremap_lock);
+	ix = cm_index(paddr);
+	KASSERT(coremap[ix].cme_state == CME_USER);
+	slot = coremap[ix].cme_swapslot;
+	coremap[ix].cme_swapslot = SWAP_NOSLOT;
+	spinlock_release(&coremap_lock);
+	return slot;
+}
+
+/*
+ * Run the clock: pick an evictable user frame, giving a second chance
+ * to any that were referenced since the hand last passed. Frames that
+ * are pinned, busy, shared, or unowned are skipped. The chosen frame
+ * is marked busy and its physical address, owner and user address
+ * are handed back. Returns false if nothing can be evicted.
+ *
+ * Referenced bits are set when a translation is loaded into the TLB,
+ * so a page that stays in the TLB can look idle; since TLB entries
+ * don't survive long, this is a good enough approximation.
+ */
+bool
+coremap_pickvictim(paddr_t *paddr, struct addrspace **as, vaddr_t *vaddr,
+		   struct tlbbatch *aged)
+{
+	struct coremap_entry *e;
+	unsigned n;
+
+	spinlock_acquire(&coremap_lock);
+
+	for (n=0; n < 2 * coremap_npages; n++) {
+		e = &coremap[clock_hand];
+		clock_hand = (clock_hand + 1) % coremap_npages;
+
+		if (e->cme_state != CME_USER || e->cme_pinned ||
+		    e->cme_busy || e->cme_refcount != 1 || e->cme_as == NULL) {
+			continue;
+		}
+		if (e->cme_referenced) {
+			e->cme_referenced = 0;
+			/*
+			 * The bit is only set again when the page is
+			 * loaded into a TLB, so make its next use fault.
+			 * Don't let the batch overflow into a flush. (If
+			 * the address space goes away before the batch is
+			 * sent, the worst that happens is some unrelated
+			 * entry gets invalidated.)
+			 */
+#if OPT_DUMBVM
+			(void)aged;	/* dumbvm never evicts anything */
+#else
+			if (aged != NULL && aged->tb_num < TLBSHOOTDOWN_MAX) {
+				mmu_batch_add(aged, e->cme_as, e->cme_vaddr);
+			}
+#endif
+			continue;
+		}
+
+		e->cme_busy = 1;
+		*paddr = cm_paddr(e - coremap);
+		*as = e->cme_as;
+		*vaddr = e->cme_vaddr;
+		spinlock_release(&coremap_lock);
+		return true;
+	}
+
+	spinlock_release(&coremap_lock);
+	return false;
+}
+
+/*
+ * Finish with a frame returned by coremap_pickvictim. If EVICTED, its
+ * contents are safely elsewhere and it is freed; otherwise it just
+ * stops being busy. Any swap slot should already have been taken.
+ */
+void
+coremap_unbusy(paddr_t paddr, bool evicted)
+{
+	unsigned ix;
+
+	spinlock_acquire(&coremap_lock);
+	ix = cm_index(paddr);
+	KASSERT(coremap[ix].cme_busy);
+	KASSERT(coremap[ix].cme_refcount == 1);
+	if (evicted) {
+		KASSERT(coremap[ix].cme_swapslot == SWAP_NOSLOT);
+		coremap_nuser--;
+		free_range(ix, 1);
+	}
+	else {
+		coremap[ix].cme_busy = 0;
+	}
+	wchan_wakeall(coremap_busywchan, &coremap_lock);
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * For the pageout thread: sleep until free frames fall below the low
+ * water mark, and check whether they are still below the high one.
+ * Coming back here means a pass is over, so first let anyone waiting
+ * in coremap_wait look at the clock.
+ */
+void
+coremap_pageout_wait(void)
+{
+	spinlock_acquire(&coremap_lock);
+	if (coremap_nwaiting > 0) {
+		wchan_wakeall(coremap_freewchan, &coremap_lock);
+	}
+	while (coremap_nfree >= coremap_lowater) {
+		wchan_sleep(coremap_pageoutwchan, &coremap_lock);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+bool
+coremap_pageout_wanted(void)
+{
+	/* unlocked read; an approximate answer is fine */
+	return coremap_nfree < coremap_hiwater;
+}
+
+bool
+coremap_low(void)
+{
+	/* likewise */
+	return coremap_nfree < coremap_lowater;
+}
+
+/*
+ * For allocators: if free memory is low, wake the pageout thread and
+ * sleep until it isn't, or until the pageout thread finishes a pass.
+ * Returns false, without sleeping, if memory wasn't low.
+ */
+bool
+coremap_wait(void)
+{
+	spinlock_acquire(&coremap_lock);
+	if (coremap_nfree >= coremap_lowater) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	wchan_wakeone(coremap_pageoutwchan, &coremap_lock);
+	coremap_nwaiting++;
+	wchan_sleep(coremap_freewchan, &coremap_lock);
+	coremap_nwaiting--;
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+/*
+ * For the idle workers: true if the zero pool is below its target and
+ * there is plenty of other free memory to fill it from. Called from
+ * the scheduler, so it only peeks; an approximate answer is fine.
+ */
+bool
+coremap_zero_wanted(void)
+{
+	return zeropool_count < zeropool_target &&
+		coremap_nfree - zeropool_count > coremap_hiwater;
+}
+
+/*
+ * Clear one free frame and add it to the zero pool. The frame is
+ * taken as a kernel frame while it is being cleared so nobody else
+ * can get at it. Returns true if the pool wants more.
+ */
+bool
+coremap_zero_one(void)
+{
+	unsigned ix;
+	bool more;
+
+	spinlock_acquire(&coremap_lock);
+	if (!coremap_zero_wanted()) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	ix = alloc_run(1);
+	if (ix != CM_NONE) {
+		coremap[ix].cme_state = CME_KERNEL;
+		coremap[ix].cme_npages = 1;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (ix == CM_NONE) {
+		return false;
+	}
+
+	bzero((void *)PADDR_TO_KVADDR(cm_paddr(ix)), PAGE_SIZE);
+
+	spinlock_acquire(&coremap_lock);
+	frame_reset(ix);
+	zeropool_add(ix);
+	zeropool_filled++;
+	more = coremap_zero_wanted();
+	spinlock_release(&coremap_lock);
+
+	return more;
+}
+
+/*
+ * Report how many frames there are, how many are free, how many are
+ * in use by user address spaces, and the most that ever have been.
+ */
+void
+coremap_usage(unsigned *total, unsigned *nfree, unsigned *nuser,
+	      unsigned *peakuser)
+{
+	spinlock_acquire(&coremap_lock);
+	*total = coremap_npages;
+	*nfree = coremap_nfree;
+	*nuser = coremap_nuser;
+	*peakuser = coremap_peakuser;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_printstats(void)
+{
+	char line[65];
+	unsigned nfree, nuser, nshared, i, j;
+	unsigned nzero, hits, misses, filled;
+	unsigned nblocks[CM_NORDERS];
+	struct coremap_entry *e;
+
+	spinlock_acquire(&coremap_lock);
+	nfree = coremap_nfree;
+	nuser = coremap_nuser;
+	nshared = coremap_nshared;
+	nzero = zeropool_count;
+	hits = zeropool_hits;
+	misses = zeropool_misses;
+	filled = zeropool_filled;
+	for (i=0; i<CM_NORDERS; i++) {
+		nblocks[i] = 0;
+		for (j = freelists[i]; j != CM_NONE; j = coremap[j].cme_next) {
+			nblocks[i]++;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %u pages: %u free, %u kernel, %u user "
+		"(%u shared)\n", coremap_npages, nfree,
+		coremap_npages - nfree - nuser, nuser, nshared);
+	kprintf("coremap: pageout below %u free, until %u free\n",
+		coremap_lowater, coremap_hiwater);
+	kprintf("coremap: free blocks by size (pages):");
+	for (i=0; i<CM_NORDERS; i++) {
+		kprintf(" %u:%u", 1U << i, nblocks[i]);
+	}
+	kprintf("\n");
+	kprintf("coremap: zero pool %u/%u pages; %u hits, %u misses, "
+		"%u cleared while idle\n", nzero, zeropool_target, hits,
+		misses, filled);
+
+	for (i=0; i<coremap_npages; i+=64) {
+		spinlock_acquire(&coremap_lock);
+		for (j=0; j<64 && i+j<coremap_npages; j++) {
+			e = &coremap[i+j];
+			switch (e->cme_state) {
+			    case CME_FREE:
+				line[j] = e->cme_zeroed ? 'z' : '.';
+				break;
+			    case CME_KERNEL: line[j] = 'K'; break;
+			    default:
+				line[j] = e->cme_pinned || e->cme_busy ? 'P' :
+					e->cme_refcount > 1 ? 'S' : 'U';
+				break;
+			}
+		}
+		spinlock_release(&coremap_lock);
+		line[j] = 0;
+		kprintf("0x%08x %s\n", cm_paddr(i), line);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// kernel page allocation
+
+/*
+ * If there's no memory, reclaim some or wait for the pageout thread
+ * to, for a while, before failing.
+ */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t pa;
+	time_t deadline = 0;
+
+	while ((pa = coremap_alloc(npages, NULL, 0)) == 0) {
+		if (!reclaim_wait(npages, &deadline)) {
+			return 0;
+		}
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
@@ -29,7 +29,10 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
 
 /*
@@ -78,6 +81,10 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    So that kfree doesn't have to search that list, there is also a
+//    table indexed by physical frame number that points each heap page
+//    at its entry.
+//
 
 ////////////////////////////////////////
 
@@ -145,7 +152,9 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
+	struct pageref *prev_samesize;
 	struct pageref *next_all;
+	struct pageref *prev_all;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -172,61 +181,34 @@ static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
 /*
  * We can only allocate whole pages of pageref structure at a time.
- * This is a struct type for such a page.
- *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * Each such page is carved up into pagerefs, which are kept on a free
+ * list (threaded through next_all) when not in use. Pageref pages are
+ * never given back, but there is no fixed limit on how many we get:
+ * the heap can grow as large as physical memory allows.
  */
 
 #define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
 
-struct pagerefpage {
-	struct pageref refs[NPAGEREFS_PER_PAGE];
-};
-
-/*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
- */
-
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
-
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
-	unsigned numinuse;
-};
+static struct pageref *freepagerefs;
+static unsigned numpagerefs;	/* pagerefs in use */
 
 /*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
- */
-
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
-
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
-
-/*
- * Allocate a page to hold pagerefs.
+ * Get another page of pagerefs and put them on the free list.
  */
 static
 void
-allocpagerefpage(struct kheap_root *root)
+allocpagerefpage(void)
 {
+	struct pageref *refs;
 	vaddr_t va;
-
-	KASSERT(root->page == NULL);
+	unsigned i;
 
 	/*
 	 * We release the spinlock while calling alloc_kpages. This
 	 * avoids deadlock if alloc_kpages needs to come back here.
 	 * Note that this means things can change behind our back...
+	 * but since we only ever add to the free list, if somebody
+	 * else got a page at the same time we just end up with spares.
 	 */
 	spinlock_release(&kmalloc_spinlock);
 	va = alloc_kpages(1);
@@ -237,17 +219,11 @@ allocpagerefpage(struct kheap_root *root)
 	}
 	KASSERT(va % PAGE_SIZE == 0);
 
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(va);
-		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
-		return;
+	refs = (struct pageref *)va;
+	for (i=0; i<NPAGEREFS_PER_PAGE; i++) {
+		refs[i].next_all = freepagerefs;
+		freepagerefs = &refs[i];
 	}
-
-	root->page = (struct pagerefpage *)va;
 }
 
 /*
@@ -257,44 +233,19 @@ static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
-			continue;
-		}
+	struct pageref *pr;
 
-		/*
-		 * This should probably not be a linear search.
-		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
-				continue;
-			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
-				}
-			}
-			KASSERT(0);
+	if (freepagerefs == NULL) {
+		allocpagerefpage();
+		if (freepagerefs == NULL) {
+			/* ran out */
+			return NULL;
 		}
 	}
-
-	/* ran out */
-	return NULL;
+	pr = freepagerefs;
+	freepagerefs = pr->next_all;
+	numpagerefs++;
+	return pr;
 }
 
 /*
@@ -304,46 +255,126 @@ static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-	struct pagerefpage *page;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
+	KASSERT(numpagerefs > 0);
+	numpagerefs--;
+	p->pageaddr_and_blocktype = 0;
+	p->next_all = freepagerefs;
+	freepagerefs = p;
+}
 
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
-		}
+////////////////////////////////////////
+
+/*
+ * To find the pageref for a block being freed without searching, we
+ * keep a pointer to it for each physical frame, in a two-level table
+ * shaped like a page table: the top ten bits of the physical address
+ * pick a page of pointers and the next ten pick the entry. Pages of
+ * the second level are allocated as kernel heap pages first appear
+ * in that part of memory, and are never freed.
+ *
+ * A NULL entry means the frame is not a subpage heap page (it may be
+ * free, a multipage kmalloc block, or something else entirely).
+ */
+
+#define FT_L1SHIFT	22
+#define FT_L2SHIFT	12
+#define FT_L2SIZE	(PAGE_SIZE / sizeof(struct pageref *))
+#define FT_L1SIZE	1024
+
+#define FT_L1INDEX(pa)	((pa) >> FT_L1SHIFT)
+#define FT_L2INDEX(pa)	(((pa) >> FT_L2SHIFT) & (FT_L2SIZE - 1))
+
+static struct pageref **frametable[FT_L1SIZE];
+
+/*
+ * Return the pageref for the heap page at kernel address PAGEADDR,
+ * or NULL if there isn't one. The caller must hold kmalloc_spinlock
+ * or own a block on the page.
+ */
+static
+struct pageref *
+frametable_get(vaddr_t pageaddr)
+{
+	paddr_t pa;
+	struct pageref **l2;
+
+	pa = KVADDR_TO_PADDR(pageaddr);
+	l2 = frametable[FT_L1INDEX(pa)];
+	if (l2 == NULL) {
+		return NULL;
+	}
+	return l2[FT_L2INDEX(pa)];
+}
+
+/*
+ * Make sure there is a frame table slot for the heap page at kernel
+ * address PAGEADDR. Drops the spinlock if a second-level page has to
+ * be allocated. Returns false if out of memory.
+ */
+static
+bool
+frametable_prepare(vaddr_t pageaddr)
+{
+	paddr_t pa;
+	vaddr_t va;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	pa = KVADDR_TO_PADDR(pageaddr);
+	if (frametable[FT_L1INDEX(pa)] != NULL) {
+		return true;
+	}
+
+	/* As in allocpagerefpage, don't hold the spinlock for this. */
+	spinlock_release(&kmalloc_spinlock);
+	va = alloc_kpages(1);
+	spinlock_acquire(&kmalloc_spinlock);
+	if (va == 0) {
+		return false;
+	}
+	if (frametable[FT_L1INDEX(pa)] != NULL) {
+		/* Somebody else got there first. */
+		spinlock_release(&kmalloc_spinlock);
+		free_kpages(va);
+		spinlock_acquire(&kmalloc_spinlock);
+		return true;
+	}
+	frametable[FT_L1INDEX(pa)] = (struct pageref **)va;
+	for (i=0; i<FT_L2SIZE; i++) {
+		frametable[FT_L1INDEX(pa)][i] = NULL;
 	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
+	return true;
+}
+
+/*
+ * Set the frame table entry for PAGEADDR, which must have been
+ * prepared, to PR (which may be NULL).
+ */
+static
+void
+frametable_set(vaddr_t pageaddr, struct pageref *pr)
+{
+	paddr_t pa;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	pa = KVADDR_TO_PADDR(pageaddr);
+	KASSERT(frametable[FT_L1INDEX(pa)] != NULL);
+	frametable[FT_L1INDEX(pa)][FT_L2INDEX(pa)] = pr;
 }
 
 ////////////////////////////////////////
 
 /*
- * Each pageref is on two linked lists: one list of pages of blocks of
- * that same size, and one of all blocks.
+ * Each pageref is on the list of all pages, and while it has free
+ * blocks, also on the list of pages of blocks of that same size, so
+ * that allocation never has to step over full pages. Both lists are
+ * doubly linked so a page can be taken off in constant time.
  */
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
+static unsigned subpage_pagesfreed;	/* pages given back, for reclaim */
 
 ////////////////////////////////////////
 
@@ -588,18 +619,23 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < TOTAL_PAGEREFS);
+			KASSERT(pr->nfree > 0);
+			KASSERT(frametable_get(PR_PAGEADDR(pr)) == pr);
+			KASSERT(sc < numpagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
+		KASSERT(frametable_get(PR_PAGEADDR(pr)) == pr);
+		KASSERT(ac < numpagerefs);
 		ac++;
 	}
 
-	KASSERT(sc==ac);
+	/* full pages are only on the all list */
+	KASSERT(sc<=ac);
+	KASSERT(ac==numpagerefs);
 }
 #else
 #define checksubpages()
@@ -681,13 +717,10 @@ void
 dump_subpages(unsigned generation)
 {
 	struct pageref *pr;
-	int i;
 
 	kprintf("Remaining allocations from generation %u:\n", generation);
-	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			dump_subpage(pr, generation);
-		}
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		dump_subpage(pr, generation);
 	}
 }
 
@@ -817,31 +850,62 @@ kheap_printstats(void)
 ////////////////////////////////////////
 
 /*
- * Remove a pageref from both lists that it's on.
+ * Add a pageref to the list of pages of its size with free blocks.
  */
 static
 void
-remove_lists(struct pageref *pr, int blktype)
+samesize_insert(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
+	KASSERT(blktype>=0 && blktype<NSIZES);
 
+	pr->prev_samesize = NULL;
+	pr->next_samesize = sizebases[blktype];
+	if (sizebases[blktype] != NULL) {
+		sizebases[blktype]->prev_samesize = pr;
+	}
+	sizebases[blktype] = pr;
+}
+
+/*
+ * Take a pageref off the list of pages of its size with free blocks.
+ */
+static
+void
+samesize_remove(struct pageref *pr, int blktype)
+{
 	KASSERT(blktype>=0 && blktype<NSIZES);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	if (pr->prev_samesize != NULL) {
+		pr->prev_samesize->next_samesize = pr->next_samesize;
+	}
+	else {
+		KASSERT(sizebases[blktype] == pr);
+		sizebases[blktype] = pr->next_samesize;
 	}
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+	pr->next_samesize = pr->prev_samesize = NULL;
+}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+/*
+ * Take a pageref off the list of all pages.
+ */
+static
+void
+all_remove(struct pageref *pr)
+{
+	if (pr->prev_all != NULL) {
+		pr->prev_all->next_all = pr->next_all;
+	}
+	else {
+		KASSERT(allbase == pr);
+		allbase = pr->next_all;
+	}
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = pr->prev_all;
 	}
+	pr->next_all = pr->prev_all = NULL;
 }
 
 /*
@@ -909,47 +973,49 @@ subpage_kmalloc(size_t sz
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	/* Every page on the same-size list has at least one free block. */
+	pr = sizebases[blktype];
+	if (pr != NULL) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
+		KASSERT(pr->nfree > 0);
 
-		if (pr->nfree > 0) {
+	doalloc: /* comes here after getting a whole fresh page */
 
-		doalloc: /* comes here after getting a whole fresh page */
-
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+		KASSERT(pr->freelist_offset < PAGE_SIZE);
+		prpage = PR_PAGEADDR(pr);
+		fla = prpage + pr->freelist_offset;
+		fl = (struct freelist *)fla;
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+		retptr = fl;
+		fl = fl->next;
+		pr->nfree--;
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+		if (fl != NULL) {
+			KASSERT(pr->nfree > 0);
+			fla = (vaddr_t)fl;
+			KASSERT(fla - prpage < PAGE_SIZE);
+			pr->freelist_offset = fla - prpage;
+		}
+		else {
+			KASSERT(pr->nfree == 0);
+			pr->freelist_offset = INVALID_OFFSET;
+			/* page is now full */
+			samesize_remove(pr, blktype);
+		}
 #ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
+		retptr = establishguardband(retptr, clientsz, sz);
 #endif
 #ifdef LABELS
-			retptr = establishlabel(retptr, label);
+		retptr = establishlabel(retptr, label);
 #endif
 
-			checksubpages();
+		checksubpages();
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
+		spinlock_release(&kmalloc_spinlock);
+		return retptr;
 	}
 
 	/*
@@ -975,7 +1041,10 @@ subpage_kmalloc(size_t sz
 #endif
 	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
+	pr = NULL;
+	if (frametable_prepare(prpage)) {
+		pr = allocpageref();
+	}
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
@@ -983,6 +1052,8 @@ subpage_kmalloc(size_t sz
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
 		return NULL;
 	}
+	KASSERT(frametable_get(prpage) == NULL);
+	frametable_set(prpage, pr);
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
@@ -1005,10 +1076,13 @@ subpage_kmalloc(size_t sz
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+	samesize_insert(pr, blktype);
 
+	pr->prev_all = NULL;
 	pr->next_all = allbase;
+	if (allbase != NULL) {
+		allbase->prev_all = pr;
+	}
 	allbase = pr;
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
@@ -1063,26 +1137,21 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = frametable_get(ptraddr & PAGE_FRAME);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(prpage == (ptraddr & PAGE_FRAME));
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1130,12 +1199,19 @@ subpage_kfree(void *ptr)
 	}
 	pr->freelist_offset = offset;
 	pr->nfree++;
+	if (pr->nfree == 1) {
+		/* was full; can allocate from it again */
+		samesize_insert(pr, blktype);
+	}
 
 	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
-		remove_lists(pr, blktype);
+		samesize_remove(pr, blktype);
+		all_remove(pr);
+		frametable_set(prpage, NULL);
 		freepageref(pr);
+		subpage_pagesfreed++;
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1153,6 +1229,410 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Per-CPU magazines.
+//
+// In front of the subpage allocator each CPU keeps, for each block
+// size, two magazines: small stacks of free blocks ("rounds"). kmalloc
+// pops a round off the loaded magazine and kfree pushes one on, with
+// interrupts off but no lock, so the common case never touches
+// kmalloc_spinlock. When the loaded magazine runs dry (or fills) it is
+// swapped with the previous one; when both are, a full or empty
+// magazine is exchanged with the depot, which is shared and has a
+// spinlock per size. Only if the depot can't help either do we go to
+// the subpage allocator.
+//
+// Blocks sitting in magazines count as allocated as far as the
+// subpage allocator is concerned, so they keep their pages from being
+// freed. To bound this, a magazine holds no more than a page worth of
+// blocks and the depot keeps no more than KMAG_DEPOTMAX magazines of
+// each kind per size.
+//
+// The guard band and label debugging modes record things about each
+// allocation, which recycling blocks through magazines would defeat,
+// so magazines are turned off with those.
+//
+
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
+#ifdef MAGAZINES
+
+#define KMAG_ROUNDS	14
+#define KMAG_DEPOTMAX	4
+
+/* 8 bytes of header plus 14 rounds makes 64 bytes on a 32-bit machine */
+struct kmag {
+	struct kmag *km_next;		/* on depot list */
+	unsigned km_rounds;		/* number of blocks held */
+	void *km_round[KMAG_ROUNDS];
+};
+
+/* Magazine capacity for a block type: at most a page of blocks. */
+#define KMAG_CAPACITY(blktype) \
+	(PAGE_SIZE / sizes[blktype] < KMAG_ROUNDS ? \
+	 PAGE_SIZE / sizes[blktype] : KMAG_ROUNDS)
+
+struct kmag_cpu {
+	struct kmag *kc_loaded;
+	struct kmag *kc_previous;
+	unsigned kc_allocs;		/* kmalloc calls */
+	unsigned kc_allochits;		/* ...served from this CPU's magazines */
+	unsigned kc_frees;		/* kfree calls */
+	unsigned kc_freehits;		/* ...absorbed by this CPU's magazines */
+};
+
+struct kmag_depot {
+	struct spinlock kd_lock;
+	struct kmag *kd_full;
+	struct kmag *kd_empty;
+	unsigned kd_nfull;
+	unsigned kd_nempty;
+	unsigned kd_exchanges;		/* magazines handed out */
+};
+
+static struct kmag_cpu kmag_cpus[MAXCPUS][NSIZES];
+static struct kmag_depot kmag_depots[NSIZES];
+static bool kmag_inited;
+
+/*
+ * Set up the depot locks. Called from kmalloc the first time it runs
+ * on a CPU; that's single-threaded, because curcpu doesn't exist
+ * until thread_bootstrap and the other CPUs start well after that.
+ */
+static
+void
+kmag_init(void)
+{
+	unsigned i;
+
+	for (i=0; i<NSIZES; i++) {
+		spinlock_init(&kmag_depots[i].kd_lock);
+	}
+	kmag_inited = true;
+}
+
+/*
+ * Take a block of type BLKTYPE from the current CPU's magazines, or
+ * failing that a full magazine from the depot. Returns NULL on a miss.
+ */
+static
+void *
+kmag_alloc(int blktype)
+{
+	struct kmag_cpu *kc;
+	struct kmag_depot *kd;
+	struct kmag *m;
+	void *ptr;
+	int s;
+
+	s = splhigh();
+	kc = &kmag_cpus[curcpu->c_number][blktype];
+	kc->kc_allocs++;
+
+	if (kc->kc_loaded != NULL && kc->kc_loaded->km_rounds > 0) {
+		kc->kc_allochits++;
+		goto pop;
+	}
+	if (kc->kc_previous != NULL && kc->kc_previous->km_rounds > 0) {
+		m = kc->kc_loaded;
+		kc->kc_loaded = kc->kc_previous;
+		kc->kc_previous = m;
+		kc->kc_allochits++;
+		goto pop;
+	}
+
+	kd = &kmag_depots[blktype];
+	spinlock_acquire(&kd->kd_lock);
+	m = kd->kd_full;
+	if (m == NULL) {
+		spinlock_release(&kd->kd_lock);
+		splx(s);
+		return NULL;
+	}
+	kd->kd_full = m->km_next;
+	kd->kd_nfull--;
+	kd->kd_exchanges++;
+	if (kc->kc_previous != NULL) {
+		/* Both of ours are empty; give one back. */
+		kc->kc_previous->km_next = kd->kd_empty;
+		kd->kd_empty = kc->kc_previous;
+		kd->kd_nempty++;
+	}
+	spinlock_release(&kd->kd_lock);
+	kc->kc_previous = kc->kc_loaded;
+	kc->kc_loaded = m;
+
+ pop:
+	KASSERT(kc->kc_loaded->km_rounds > 0);
+	ptr = kc->kc_loaded->km_round[--kc->kc_loaded->km_rounds];
+	splx(s);
+	return ptr;
+}
+
+/*
+ * Return a magazine's blocks to the subpage allocator and then put it
+ * on the depot's empty list, or free it if that list is long enough.
+ */
+static
+void
+kmag_flush(struct kmag *m, int blktype)
+{
+	struct kmag_depot *kd = &kmag_depots[blktype];
+
+	while (m->km_rounds > 0) {
+		subpage_kfree(m->km_round[--m->km_rounds]);
+	}
+
+	spinlock_acquire(&kd->kd_lock);
+	if (kd->kd_nempty < KMAG_DEPOTMAX) {
+		m->km_next = kd->kd_empty;
+		kd->kd_empty = m;
+		kd->kd_nempty++;
+		m = NULL;
+	}
+	spinlock_release(&kd->kd_lock);
+
+	if (m != NULL) {
+		subpage_kfree(m);
+	}
+}
+
+/*
+ * Put PTR, a block of type BLKTYPE, in the current CPU's magazines,
+ * or failing that swap a full magazine for an empty one from the
+ * depot. Returns false on a miss.
+ */
+static
+bool
+kmag_free(void *ptr, int blktype)
+{
+	struct kmag_cpu *kc;
+	struct kmag_depot *kd;
+	struct kmag *m, *flush;
+	unsigned capacity;
+	int s;
+
+	capacity = KMAG_CAPACITY(blktype);
+	flush = NULL;
+
+	s = splhigh();
+	kc = &kmag_cpus[curcpu->c_number][blktype];
+	kc->kc_frees++;
+
+	if (kc->kc_loaded != NULL && kc->kc_loaded->km_rounds < capacity) {
+		kc->kc_freehits++;
+		goto push;
+	}
+	if (kc->kc_previous != NULL &&
+	    kc->kc_previous->km_rounds < capacity) {
+		m = kc->kc_loaded;
+		kc->kc_loaded = kc->kc_previous;
+		kc->kc_previous = m;
+		kc->kc_freehits++;
+		goto push;
+	}
+
+	kd = &kmag_depots[blktype];
+	spinlock_acquire(&kd->kd_lock);
+	m = kd->kd_empty;
+	if (m == NULL) {
+		spinlock_release(&kd->kd_lock);
+		splx(s);
+		return false;
+	}
+	kd->kd_empty = m->km_next;
+	kd->kd_nempty--;
+	kd->kd_exchanges++;
+	if (kc->kc_previous != NULL) {
+		/* Both of ours are full; give one back. */
+		if (kd->kd_nfull < KMAG_DEPOTMAX) {
+			kc->kc_previous->km_next = kd->kd_full;
+			kd->kd_full = kc->kc_previous;
+			kd->kd_nfull++;
+		}
+		else {
+			flush = kc->kc_previous;
+		}
+	}
+	spinlock_release(&kd->kd_lock);
+	kc->kc_previous = kc->kc_loaded;
+	kc->kc_loaded = m;
+
+ push:
+	KASSERT(kc->kc_loaded->km_rounds < capacity);
+	kc->kc_loaded->km_round[kc->kc_loaded->km_rounds++] = ptr;
+	splx(s);
+
+	if (flush != NULL) {
+		/* Not with interrupts off: this may call free_kpages. */
+		kmag_flush(flush, blktype);
+	}
+	return true;
+}
+
+/*
+ * After a kfree miss, give the depot another empty magazine (unless
+ * it already has enough) so the next one can be absorbed.
+ */
+static
+void
+kmag_grow(int blktype)
+{
+	struct kmag_depot *kd = &kmag_depots[blktype];
+	struct kmag *m;
+
+	/* Unlocked peek; it doesn't matter if we're off by one. */
+	if (kd->kd_nempty >= KMAG_DEPOTMAX) {
+		return;
+	}
+
+	/* Straight from the subpage allocator, not through magazines. */
+	m = subpage_kmalloc(sizeof(*m));
+	if (m == NULL) {
+		return;
+	}
+	m->km_rounds = 0;
+
+	spinlock_acquire(&kd->kd_lock);
+	if (kd->kd_nempty < KMAG_DEPOTMAX) {
+		m->km_next = kd->kd_empty;
+		kd->kd_empty = m;
+		kd->kd_nempty++;
+		m = NULL;
+	}
+	spinlock_release(&kd->kd_lock);
+
+	if (m != NULL) {
+		subpage_kfree(m);
+	}
+}
+
+#endif /* MAGAZINES */
+
+/*
+ * Shrinker for memory reclaim: hand the blocks in the depot's full
+ * magazines and in this CPU's own back to the subpage allocator, and
+ * free the depot's empty magazines, so that pages held only by
+ * magazines are freed. Other CPUs' loaded magazines can only be
+ * touched by those CPUs and are left alone; that is at most two per
+ * size per CPU. NPAGES is ignored, as all of this is cheap to rebuild.
+ * Returns the number of pages freed.
+ */
+unsigned
+kheap_shrink(unsigned npages)
+{
+#ifdef MAGAZINES
+	struct kmag_cpu *kc;
+	struct kmag_depot *kd;
+	struct kmag *full, *empty, *mine[2], *m;
+	unsigned before, freed, i, j;
+	int s;
+
+	(void)npages;
+
+	if (!CURCPU_EXISTS() || !kmag_inited) {
+		return 0;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	before = subpage_pagesfreed;
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<NSIZES; i++) {
+		kd = &kmag_depots[i];
+
+		spinlock_acquire(&kd->kd_lock);
+		full = kd->kd_full;
+		kd->kd_full = NULL;
+		kd->kd_nfull = 0;
+		spinlock_release(&kd->kd_lock);
+
+		s = splhigh();
+		kc = &kmag_cpus[curcpu->c_number][i];
+		mine[0] = kc->kc_loaded;
+		mine[1] = kc->kc_previous;
+		kc->kc_loaded = kc->kc_previous = NULL;
+		splx(s);
+
+		while (full != NULL) {
+			m = full;
+			full = m->km_next;
+			kmag_flush(m, i);
+		}
+		for (j=0; j<2; j++) {
+			if (mine[j] != NULL) {
+				kmag_flush(mine[j], i);
+			}
+		}
+
+		spinlock_acquire(&kd->kd_lock);
+		empty = kd->kd_empty;
+		kd->kd_empty = NULL;
+		kd->kd_nempty = 0;
+		spinlock_release(&kd->kd_lock);
+
+		while (empty != NULL) {
+			m = empty;
+			empty = m->km_next;
+			subpage_kfree(m);
+		}
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	freed = subpage_pagesfreed - before;
+	spinlock_release(&kmalloc_spinlock);
+	return freed;
+#else
+	(void)npages;
+	return 0;
+#endif
+}
+
+/*
+ * Print per-CPU magazine hit rates.
+ */
+void
+kheap_magstats(void)
+{
+#ifdef MAGAZINES
+	struct kmag_cpu *kc;
+	struct kmag_depot *kd;
+	unsigned allocs, allochits, frees, freehits;
+	unsigned i, j;
+
+	kprintf("Kernel heap magazines:\n");
+	kprintf("cpu   kmallocs   hit%%     kfrees   hit%%\n");
+	for (i=0; i<MAXCPUS; i++) {
+		allocs = allochits = frees = freehits = 0;
+		for (j=0; j<NSIZES; j++) {
+			kc = &kmag_cpus[i][j];
+			allocs += kc->kc_allocs;
+			allochits += kc->kc_allochits;
+			frees += kc->kc_frees;
+			freehits += kc->kc_freehits;
+		}
+		if (allocs == 0 && frees == 0) {
+			continue;
+		}
+		kprintf("%3u %10u %5u%% %10u %5u%%\n", i,
+			allocs, allocs ? (unsigned)(allochits * 100ULL / allocs) : 0,
+			frees, frees ? (unsigned)(freehits * 100ULL / frees) : 0);
+	}
+
+	kprintf("size   full  empty  exchanges\n");
+	for (j=0; j<NSIZES; j++) {
+		kd = &kmag_depots[j];
+		kprintf("%4zu %6u %6u %10u\n", sizes[j],
+			kd->kd_nfull, kd->kd_nempty, kd->kd_exchanges);
+	}
+#else
+	kprintf("Magazines are disabled with GUARDS or LABELS in kmalloc.c.\n");
+#endif
+}
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1181,7 +1661,11 @@ kmalloc(size_t sz)
 		unsigned long npages;
 		vaddr_t address;
 
-		/* Round up to a whole number of pages. */
+		/*
+		 * Round up to a whole number of pages. The coremap
+		 * remembers how long the run is, so kfree can hand
+		 * the whole thing back with free_kpages.
+		 */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
 		if (address==0) {
@@ -1192,6 +1676,20 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#ifdef MAGAZINES
+	if (CURCPU_EXISTS()) {
+		void *ptr;
+
+		if (!kmag_inited) {
+			kmag_init();
+		}
+		ptr = kmag_alloc(blocktype(sz));
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+#endif
+
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
@@ -1210,7 +1708,33 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef MAGAZINES
+	if (CURCPU_EXISTS() && kmag_inited) {
+		struct pageref *pr;
+		int blktype;
+
+		/*
+		 * No lock needed to look up the pageref: since we own
+		 * a block on the page, it can't go away.
+		 */
+		pr = frametable_get((vaddr_t)ptr & PAGE_FRAME);
+		if (pr != NULL) {
+			blktype = PR_BLOCKTYPE(pr);
+			if (!kmag_free(ptr, blktype)) {
+				subpage_kfree(ptr);
+				kmag_grow(blktype);
+			}
+			return;
+		}
+
+		/* Not a subpage block, so it's a run of whole pages. */
+		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+		free_kpages((vaddr_t)ptr);
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
@@ -0,0 +1,217 @@
+/*
+ * Object caches.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem_cache.h>
+
+/*
+ * Maximum number of constructed objects a cache keeps around.
+ */
+#define KMEM_CACHE_MAX	32
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;
+	void *kc_objs[KMEM_CACHE_MAX];	/* constructed, free objects */
+	unsigned kc_nobjs;
+
+	/* statistics */
+	unsigned kc_allocs;		/* calls to kmem_cache_alloc */
+	unsigned kc_constructs;		/* ...that built a new object */
+	unsigned kc_destructs;		/* objects destroyed */
+
+	struct kmem_cache *kc_next;	/* on kmem_caches list */
+};
+
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Release the memory for an object, destructing it first.
+ */
+static
+void
+kmem_cache_release(struct kmem_cache *kc, void *obj)
+{
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_nobjs = 0;
+	kc->kc_allocs = 0;
+	kc->kc_constructs = 0;
+	kc->kc_destructs = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (p = &kmem_caches; *p != kc; p = &(*p)->kc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = kc->kc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	/* Nobody else can be using it now; no need to lock. */
+	while (kc->kc_nobjs > 0) {
+		kmem_cache_release(kc, kc->kc_objs[--kc->kc_nobjs]);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+	int result;
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_allocs++;
+	if (kc->kc_nobjs > 0) {
+		obj = kc->kc_objs[--kc->kc_nobjs];
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	/* Constructors may sleep, so do this without the spinlock. */
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL) {
+		result = kc->kc_ctor(obj);
+		if (result) {
+			kfree(obj);
+			return NULL;
+		}
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_constructs++;
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	KASSERT(obj != NULL);
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_nobjs < KMEM_CACHE_MAX) {
+		kc->kc_objs[kc->kc_nobjs++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	kc->kc_destructs++;
+	spinlock_release(&kc->kc_lock);
+
+	kmem_cache_release(kc, obj);
+}
+
+/*
+ * Destroy the free objects of every cache, until NPAGES pages' worth
+ * of them are gone. The memory goes back to kmalloc, which gives it
+ * back to the coremap once whole pages are free; so this returns
+ * what the objects add up to, rounded down, not what was freed.
+ *
+ * Caches are visited one at a time, by position, so that no lock is
+ * held while running destructors.
+ */
+unsigned
+kmem_cache_reap(unsigned npages)
+{
+	struct kmem_cache *kc;
+	void *objs[KMEM_CACHE_MAX];
+	void (*dtor)(void *obj);
+	unsigned i, n, pos;
+	size_t bytes;
+
+	bytes = 0;
+	for (pos = 0; bytes < npages * PAGE_SIZE; pos++) {
+		spinlock_acquire(&kmem_caches_lock);
+		kc = kmem_caches;
+		for (i=0; i<pos && kc != NULL; i++) {
+			kc = kc->kc_next;
+		}
+		if (kc == NULL) {
+			spinlock_release(&kmem_caches_lock);
+			break;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		n = kc->kc_nobjs;
+		for (i=0; i<n; i++) {
+			objs[i] = kc->kc_objs[i];
+		}
+		kc->kc_nobjs = 0;
+		kc->kc_destructs += n;
+		spinlock_release(&kc->kc_lock);
+		dtor = kc->kc_dtor;
+		bytes += n * kc->kc_size;
+		spinlock_release(&kmem_caches_lock);
+
+		for (i=0; i<n; i++) {
+			if (dtor != NULL) {
+				dtor(objs[i]);
+			}
+			kfree(objs[i]);
+		}
+	}
+	return bytes / PAGE_SIZE;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	kprintf("cache            size     allocs constructs  destructs  free\n");
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		kprintf("%-14s %6zu %10u %10u %10u %5u\n", kc->kc_name,
+			kc->kc_size, kc->kc_allocs, kc->kc_constructs,
+			kc->kc_destructs, kc->kc_nobjs);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
@@ -0,0 +1,700 @@
+/*
+ * Cache of shared file pages (see pagecache.h).
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <pagecache.h>
+#include <vmstat.h>
+#include <vm.h>
+
+/*
+ * One mapping of a cached page: the page table entry for VA in AS
+ * points at the page's frame.
+ */
+struct pc_mapping {
+	struct addrspace *pm_as;
+	vaddr_t pm_va;
+	bool pm_locked;			/* locked by us (while evicting) */
+	struct pc_mapping *pm_next;
+};
+
+/*
+ * Each cached page is on two hash chains: one by file position, to
+ * look it up when a page is faulted in, and one by frame, for when a
+ * mapping goes away and for eviction. A page is busy while it is
+ * being read in (before it goes on the frame chain) and while it is
+ * being written back on its way out; anyone else who wants it
+ * meanwhile waits on pc_cv.
+ */
+struct cachedpage {
+	struct vnode *cp_vnode;		/* file */
+	off_t cp_offset;		/* file offset of first byte read */
+	unsigned cp_pgoff;		/* where it goes in the page */
+	unsigned cp_len;		/* bytes read from the file */
+	paddr_t cp_paddr;		/* frame, once read in */
+	struct pc_mapping *cp_mappings;	/* who has it mapped */
+	bool cp_busy;			/* being read in or written back */
+	bool cp_dirty;			/* needs writing back */
+	struct cachedpage *cp_next;	/* file position chain */
+	struct cachedpage *cp_pnext;	/* frame chain */
+};
+
+#define PC_NBUCKETS	64
+
+/*
+ * pc_lock is taken with address space locks held, so while holding
+ * it we only ever try-lock those. No I/O is done with it held: the
+ * file system may fault on user pages while in the middle of a read
+ * or write, and end up waiting for it.
+ */
+static struct lock *pc_lock;
+static struct cv *pc_cv;
+static struct cachedpage *pc_bykey[PC_NBUCKETS];
+static struct cachedpage *pc_byframe[PC_NBUCKETS];
+static unsigned pc_hand;	/* next frame chain to shrink */
+
+static unsigned pc_npages;	/* pages with a frame */
+static unsigned pc_nmappings;	/* mappings of those frames */
+static unsigned pc_hits;	/* faults that found the page */
+static unsigned pc_misses;	/* faults that read it in */
+static unsigned pc_evicted;	/* pages taken by pagecache_shrink */
+static unsigned pc_written;	/* dirty pages written back */
+
+static
+inline
+unsigned
+pc_keyhash(struct vnode *v, off_t offset)
+{
+	return ((uintptr_t)v / sizeof(void *) +
+		(unsigned)(offset / PAGE_SIZE)) % PC_NBUCKETS;
+}
+
+static
+inline
+unsigned
+pc_framehash(paddr_t pa)
+{
+	return (pa / PAGE_SIZE) % PC_NBUCKETS;
+}
+
+static
+inline
+bool
+pc_wholepage(struct cachedpage *cp)
+{
+	return cp->cp_pgoff == 0 && cp->cp_len == PAGE_SIZE;
+}
+
+void
+pagecache_bootstrap(void)
+{
+	pc_lock = lock_create("pagecache");
+	pc_cv = cv_create("pagecache");
+	if (pc_lock == NULL || pc_cv == NULL) {
+		panic("pagecache: out of memory\n");
+	}
+}
+
+/*
+ * Find the page for a file position. The caller holds pc_lock.
+ */
+static
+struct cachedpage *
+pc_find(struct vnode *v, off_t offset, unsigned pgoff, unsigned len)
+{
+	struct cachedpage *cp;
+
+	for (cp = pc_bykey[pc_keyhash(v, offset)]; cp != NULL;
+	     cp = cp->cp_next) {
+		if (cp->cp_vnode == v && cp->cp_offset == offset &&
+		    cp->cp_pgoff == pgoff && cp->cp_len == len) {
+			return cp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find the page in frame PA. The caller holds pc_lock.
+ */
+static
+struct cachedpage *
+pc_findframe(paddr_t pa)
+{
+	struct cachedpage *cp;
+
+	for (cp = pc_byframe[pc_framehash(pa)]; cp != NULL;
+	     cp = cp->cp_pnext) {
+		if (cp->cp_paddr == pa) {
+			return cp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take CP off its chains. The caller holds pc_lock.
+ */
+static
+void
+pc_unlink(struct cachedpage *cp)
+{
+	struct cachedpage **cpp;
+
+	cpp = &pc_bykey[pc_keyhash(cp->cp_vnode, cp->cp_offset)];
+	while (*cpp != cp) {
+		KASSERT(*cpp != NULL);
+		cpp = &(*cpp)->cp_next;
+	}
+	*cpp = cp->cp_next;
+
+	if (cp->cp_paddr == 0) {
+		return;
+	}
+	cpp = &pc_byframe[pc_framehash(cp->cp_paddr)];
+	while (*cpp != cp) {
+		KASSERT(*cpp != NULL);
+		cpp = &(*cpp)->cp_pnext;
+	}
+	*cpp = cp->cp_pnext;
+}
+
+/*
+ * Write dirty (whole) page CP back to its file, but not past the end
+ * of the file. The page is busy.
+ */
+static
+int
+pc_writeback(struct cachedpage *cp)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	size_t len;
+	int result;
+
+	KASSERT(pc_wholepage(cp));
+
+	result = VOP_STAT(cp->cp_vnode, &st);
+	if (result) {
+		return result;
+	}
+	if (cp->cp_offset < st.st_size) {
+		len = PAGE_SIZE;
+		if (st.st_size - cp->cp_offset < PAGE_SIZE) {
+			len = st.st_size - cp->cp_offset;
+		}
+		uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(cp->cp_paddr),
+			  len, cp->cp_offset, UIO_WRITE);
+		result = VOP_WRITE(cp->cp_vnode, &ku);
+		if (result) {
+			return result;
+		}
+	}
+	cp->cp_dirty = false;
+	pc_written++;
+	return 0;
+}
+
+/*
+ * Drop page CP, which nobody has mapped anymore, writing it back
+ * first if need be. The caller holds pc_lock, which is released
+ * during the write; the page is busy meanwhile so that nobody reads
+ * the old contents back from the file.
+ */
+static
+void
+pc_drop(struct cachedpage *cp)
+{
+	int result;
+
+	KASSERT(cp->cp_mappings == NULL);
+	KASSERT(!cp->cp_busy);
+
+	if (cp->cp_dirty) {
+		cp->cp_busy = true;
+		lock_release(pc_lock);
+		result = pc_writeback(cp);
+		lock_acquire(pc_lock);
+		cp->cp_busy = false;
+		cv_broadcast(pc_cv, pc_lock);
+		if (result) {
+			kprintf("pagecache: write-back at offset %llu "
+				"failed: %s\n",
+				(unsigned long long)cp->cp_offset,
+				strerror(result));
+		}
+	}
+
+	pc_unlink(cp);
+	cp->cp_vnode->vn_npages--;
+	pc_npages--;
+	/* the cache's own reference */
+	coremap_free(cp->cp_paddr);
+	kfree(cp);
+}
+
+/*
+ * Read the page for (busy) CP into a new frame for page VA of AS.
+ * Hands back the frame, unpinned, with two references: one for the
+ * caller's mapping and one for the cache. A whole page may be cut
+ * short by the end of the file; the rest is zeroed.
+ */
+static
+int
+pc_read(struct cachedpage *cp, struct addrspace *as, vaddr_t va,
+	paddr_t *ret)
+{
+	struct iovec iov;
+	struct uio ku;
+	paddr_t pa;
+	int result;
+
+	pa = vm_allocpage(as, va, cp->cp_len < PAGE_SIZE);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(pa) + cp->cp_pgoff),
+		  cp->cp_len, cp->cp_offset, UIO_READ);
+	result = VOP_READ(cp->cp_vnode, &ku);
+	if (result == 0 && ku.uio_resid != 0) {
+		if (pc_wholepage(cp)) {
+			bzero((void *)(PADDR_TO_KVADDR(pa) + PAGE_SIZE -
+				       ku.uio_resid), ku.uio_resid);
+		}
+		else {
+			kprintf("pagecache: short read paging in 0x%x - "
+				"file truncated?\n", va);
+			result = EIO;
+		}
+	}
+	if (result) {
+		coremap_free(pa);
+		return result;
+	}
+
+	coremap_share(pa);
+	coremap_unpin(pa);
+	*ret = pa;
+	return 0;
+}
+
+/*
+ * Get the cached page for a file position, reading it in if needed.
+ * See pagecache.h.
+ */
+int
+pagecache_get(struct vnode *v, off_t offset, unsigned pgoff, unsigned len,
+	      struct addrspace *as, vaddr_t va, paddr_t *ret)
+{
+	struct cachedpage *cp, *newcp;
+	struct pc_mapping *pm;
+	unsigned h;
+	paddr_t pa;
+	int result;
+
+	KASSERT(pgoff + len <= PAGE_SIZE);
+	KASSERT(len > 0);
+
+	/*
+	 * Allocate before taking pc_lock: an allocation that has to
+	 * reclaim memory may call pagecache_shrink.
+	 */
+	pm = kmalloc(sizeof(*pm));
+	if (pm == NULL) {
+		return ENOMEM;
+	}
+	pm->pm_as = as;
+	pm->pm_va = va;
+	pm->pm_locked = false;
+	cp = kmalloc(sizeof(*cp));
+	if (cp == NULL) {
+		kfree(pm);
+		return ENOMEM;
+	}
+	newcp = cp;
+
+	lock_acquire(pc_lock);
+	while ((cp = pc_find(v, offset, pgoff, len)) != NULL &&
+	       cp->cp_busy) {
+		cv_wait(pc_cv, pc_lock);
+	}
+
+	if (cp != NULL) {
+		coremap_share(cp->cp_paddr);
+		pm->pm_next = cp->cp_mappings;
+		cp->cp_mappings = pm;
+		pc_nmappings++;
+		pc_hits++;
+		*ret = cp->cp_paddr;
+		lock_release(pc_lock);
+		kfree(newcp);
+		VMSTAT_COUNT(as, vs_cachehit);
+		return 0;
+	}
+
+	cp = newcp;
+	cp->cp_vnode = v;
+	cp->cp_offset = offset;
+	cp->cp_pgoff = pgoff;
+	cp->cp_len = len;
+	cp->cp_paddr = 0;
+	cp->cp_mappings = NULL;
+	cp->cp_busy = true;
+	cp->cp_dirty = false;
+	h = pc_keyhash(v, offset);
+	cp->cp_next = pc_bykey[h];
+	pc_bykey[h] = cp;
+	pc_misses++;
+	lock_release(pc_lock);
+
+	/* Don't hold up lookups of other pages while we do the I/O. */
+	result = pc_read(cp, as, va, &pa);
+
+	lock_acquire(pc_lock);
+	cp->cp_busy = false;
+	if (result) {
+		pc_unlink(cp);
+		kfree(cp);
+		kfree(pm);
+	}
+	else {
+		cp->cp_paddr = pa;
+		h = pc_framehash(pa);
+		cp->cp_pnext = pc_byframe[h];
+		pc_byframe[h] = cp;
+		pm->pm_next = NULL;
+		cp->cp_mappings = pm;
+		v->vn_npages++;
+		pc_npages++;
+		pc_nmappings++;
+		*ret = pa;
+	}
+	cv_broadcast(pc_cv, pc_lock);
+	lock_release(pc_lock);
+
+	if (result == 0) {
+		VMSTAT_COUNT(as, vs_pagein);
+	}
+	return result;
+}
+
+/*
+ * Add a mapping of cached frame PA.
+ */
+int
+pagecache_dup(paddr_t pa, struct addrspace *as, vaddr_t va)
+{
+	struct cachedpage *cp;
+	struct pc_mapping *pm;
+
+	pm = kmalloc(sizeof(*pm));
+	if (pm == NULL) {
+		return ENOMEM;
+	}
+	pm->pm_as = as;
+	pm->pm_va = va;
+	pm->pm_locked = false;
+
+	lock_acquire(pc_lock);
+	cp = pc_findframe(pa);
+	KASSERT(cp != NULL);
+	KASSERT(cp->cp_mappings != NULL);
+	coremap_share(pa);
+	pm->pm_next = cp->cp_mappings;
+	cp->cp_mappings = pm;
+	pc_nmappings++;
+	lock_release(pc_lock);
+
+	return 0;
+}
+
+/*
+ * Drop a mapping of cached frame PA; drop the page after the last.
+ */
+void
+pagecache_put(paddr_t pa, struct addrspace *as, vaddr_t va, bool dirty)
+{
+	struct cachedpage *cp;
+	struct pc_mapping **pmp, *pm;
+
+	lock_acquire(pc_lock);
+	cp = pc_findframe(pa);
+	KASSERT(cp != NULL);
+
+	for (pmp = &cp->cp_mappings; *pmp != NULL; pmp = &(*pmp)->pm_next) {
+		if ((*pmp)->pm_as == as && (*pmp)->pm_va == va) {
+			break;
+		}
+	}
+	pm = *pmp;
+	KASSERT(pm != NULL);
+	*pmp = pm->pm_next;
+	kfree(pm);
+
+	if (dirty) {
+		KASSERT(pc_wholepage(cp));
+		cp->cp_dirty = true;
+	}
+	coremap_free(pa);
+	pc_nmappings--;
+
+	if (cp->cp_mappings == NULL) {
+		pc_drop(cp);
+	}
+	lock_release(pc_lock);
+}
+
+/*
+ * Take page CP away from everyone who has it mapped and drop it.
+ * Gives up and returns false if any of their address spaces is busy.
+ * The caller holds pc_lock, which may be released and reacquired.
+ */
+static
+bool
+pc_evict(struct cachedpage *cp)
+{
+	struct pc_mapping *pm, *next;
+	struct tlbbatch tb;
+	pte_t *pte;
+
+	for (pm = cp->cp_mappings; pm != NULL; pm = pm->pm_next) {
+		if (lock_do_i_hold(pm->pm_as->as_lock)) {
+			/* mapped twice in the same address space */
+			continue;
+		}
+		if (!lock_tryacquire(pm->pm_as->as_lock)) {
+			break;
+		}
+		pm->pm_locked = true;
+	}
+	if (pm != NULL) {
+		for (pm = cp->cp_mappings; pm != NULL; pm = pm->pm_next) {
+			if (pm->pm_locked) {
+				lock_release(pm->pm_as->as_lock);
+				pm->pm_locked = false;
+			}
+		}
+		return false;
+	}
+
+	mmu_batch_init(&tb);
+	for (pm = cp->cp_mappings; pm != NULL; pm = pm->pm_next) {
+		pte = pt_lookup(pm->pm_as->as_pt, pm->pm_va, false);
+		KASSERT(pte != NULL);
+		KASSERT((*pte & PTE_CACHED) && PTE_PADDR(*pte) == cp->cp_paddr);
+		if (*pte & PTE_DIRTY) {
+			cp->cp_dirty = true;
+		}
+		/* the next fault brings it back in */
+		*pte = 0;
+		mmu_batch_add(&tb, pm->pm_as, pm->pm_va);
+		VMSTAT_COUNT(pm->pm_as, vs_evicted);
+		vmstat_resident(pm->pm_as, -1);
+	}
+	mmu_batch_send(&tb, true);
+
+	for (pm = cp->cp_mappings; pm != NULL; pm = next) {
+		next = pm->pm_next;
+		if (pm->pm_locked) {
+			lock_release(pm->pm_as->as_lock);
+		}
+		coremap_free(cp->cp_paddr);
+		pc_nmappings--;
+		kfree(pm);
+	}
+	cp->cp_mappings = NULL;
+
+	pc_drop(cp);
+	pc_evicted++;
+	return true;
+}
+
+/*
+ * Evict up to NPAGES pages, running a clock over the frame chains:
+ * pages whose frames were used since the hand last came by are
+ * skipped (and aged). At most one page is taken per chain per visit,
+ * since the chain may change while a page is written back. Returns
+ * the number of pages evicted.
+ */
+unsigned
+pagecache_shrink(unsigned npages)
+{
+	struct cachedpage *cp;
+	unsigned scanned, freed;
+
+	if (lock_do_i_hold(pc_lock)) {
+		/*
+		 * Reclaiming from an allocation made under pc_lock;
+		 * taking it again would do nothing, and releasing it
+		 * would drop the caller's hold.
+		 */
+		return 0;
+	}
+
+	freed = 0;
+	lock_acquire(pc_lock);
+	for (scanned = 0; scanned < 2 * PC_NBUCKETS && freed < npages;
+	     scanned++) {
+		cp = pc_byframe[pc_hand];
+		pc_hand = (pc_hand + 1) % PC_NBUCKETS;
+		for (; cp != NULL; cp = cp->cp_pnext) {
+			if (cp->cp_busy || coremap_age(cp->cp_paddr)) {
+				continue;
+			}
+			if (pc_evict(cp)) {
+				freed++;
+				break;
+			}
+		}
+	}
+	lock_release(pc_lock);
+	return freed;
+}
+
+/*
+ * If whole page OFFSET of V is cached, return its frame with an extra
+ * reference so it can't go away while we use it; else return 0.
+ */
+static
+paddr_t
+pc_hold(struct vnode *v, off_t offset)
+{
+	struct cachedpage *cp;
+	paddr_t pa;
+
+	lock_acquire(pc_lock);
+	while ((cp = pc_find(v, offset, 0, PAGE_SIZE)) != NULL &&
+	       cp->cp_busy) {
+		cv_wait(pc_cv, pc_lock);
+	}
+	pa = 0;
+	if (cp != NULL) {
+		pa = cp->cp_paddr;
+		coremap_share(pa);
+	}
+	lock_release(pc_lock);
+	return pa;
+}
+
+/*
+ * Do the next LEN bytes of UIO on V directly.
+ */
+static
+int
+pc_vop(struct vnode *v, struct uio *uio, size_t len)
+{
+	size_t rest;
+	int result;
+
+	rest = uio->uio_resid - len;
+	uio->uio_resid = len;
+	result = (uio->uio_rw == UIO_READ) ? VOP_READ(v, uio) :
+		VOP_WRITE(v, uio);
+	uio->uio_resid += rest;
+	return result;
+}
+
+/*
+ * Read or write V through the cache, a page at a time. Pages that
+ * aren't cached go straight to the file. Writes to cached pages go to
+ * both the page and the file, so nothing is lost if the page is
+ * dropped meanwhile.
+ */
+int
+pagecache_rw(struct vnode *v, struct uio *uio)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	off_t pos, size;
+	size_t skip, len;
+	vaddr_t kva;
+	paddr_t pa;
+	int result;
+
+	/* unlocked peek: if nothing of V is cached, just do it */
+	if (v->vn_npages == 0) {
+		return (uio->uio_rw == UIO_READ) ? VOP_READ(v, uio) :
+			VOP_WRITE(v, uio);
+	}
+
+	size = 0;
+	if (uio->uio_rw == UIO_READ) {
+		result = VOP_STAT(v, &st);
+		if (result) {
+			return result;
+		}
+		size = st.st_size;
+	}
+
+	while (uio->uio_resid > 0) {
+		pos = uio->uio_offset;
+		skip = pos % PAGE_SIZE;
+		len = PAGE_SIZE - skip;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		if (uio->uio_rw == UIO_READ) {
+			if (pos >= size) {
+				break;
+			}
+			if (len > size - pos) {
+				len = size - pos;
+			}
+		}
+
+		pa = pc_hold(v, pos - skip);
+		if (pa == 0) {
+			result = pc_vop(v, uio, len);
+		}
+		else {
+			kva = PADDR_TO_KVADDR(pa) + skip;
+			result = uiomove((void *)kva, len, uio);
+			if (result == 0 && uio->uio_rw == UIO_WRITE) {
+				uio_kinit(&iov, &ku, (void *)kva, len, pos,
+					  UIO_WRITE);
+				result = VOP_WRITE(v, &ku);
+			}
+			coremap_free(pa);
+		}
+		if (result) {
+			return result;
+		}
+		if (uio->uio_offset != pos + (off_t)len) {
+			/* short read; must have hit the end of the file */
+			break;
+		}
+	}
+	return 0;
+}
+
+void
+pagecache_printstats(void)
+{
+	unsigned npages, nmappings, hits, misses, evicted, written;
+
+	lock_acquire(pc_lock);
+	npages = pc_npages;
+	nmappings = pc_nmappings;
+	hits = pc_hits;
+	misses = pc_misses;
+	evicted = pc_evicted;
+	written = pc_written;
+	lock_release(pc_lock);
+
+	kprintf("pagecache: %u pages shared by %u mappings (%u frames "
+		"saved)\n", npages, nmappings, nmappings - npages);
+	kprintf("pagecache: %u hits, %u misses, %u evicted, %u written "
+		"back\n", hits, misses, evicted, written);
+}
@@ -0,0 +1,58 @@
+/*
+ * Two-level user page tables.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <pagetable.h>
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_L1SIZE; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i=0; i<PT_L1SIZE; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			kfree(pt->pt_dir[i]);
+		}
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t va, bool create)
+{
+	pte_t *l2;
+
+	KASSERT(va < USERSPACETOP);
+
+	l2 = pt->pt_dir[PT_L1INDEX(va)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2 = kmalloc(PT_L2SIZE * sizeof(pte_t));
+		if (l2 == NULL) {
+			return NULL;
+		}
+		bzero(l2, PT_L2SIZE * sizeof(pte_t));
+		pt->pt_dir[PT_L1INDEX(va)] = l2;
+	}
+	return &l2[PT_L2INDEX(va)];
+}
@@ -0,0 +1,196 @@
+/*
+ * Memory reclaim (see reclaim.h).
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <kmem_cache.h>
+#include <coremap.h>
+#include <reclaim.h>
+#include "opt-dumbvm.h"
+
+#define RECLAIM_MAXSHRINKERS	8
+
+struct shrinker {
+	const char *sh_name;
+	unsigned (*sh_shrink)(unsigned npages);
+	unsigned sh_calls;		/* times run */
+	unsigned sh_freed;		/* pages it gave back */
+};
+
+/*
+ * Shrinkers are only ever added, and each is filled in before the
+ * count covers it, so reclaim_run reads the table without locking.
+ * reclaim_lock protects the counters.
+ */
+static struct shrinker reclaim_shrinkers[RECLAIM_MAXSHRINKERS];
+static unsigned reclaim_nshrinkers;
+static struct spinlock reclaim_lock = SPINLOCK_INITIALIZER;
+static bool reclaim_ready;
+
+static unsigned reclaim_direct;		/* allocations that reclaimed */
+static unsigned reclaim_waits;		/* ...waited for memory */
+static unsigned reclaim_timeouts;	/* ...gave up waiting */
+static unsigned reclaim_throttled;	/* forks held back */
+
+void
+reclaim_bootstrap(void)
+{
+	/* cheapest first; kmalloc last, to pick up what the others free */
+	reclaim_register("threadpool", thread_pool_shrink);
+	reclaim_register("kmem_cache", kmem_cache_reap);
+	reclaim_register("kheap", kheap_shrink);
+	reclaim_ready = true;
+}
+
+void
+reclaim_register(const char *name, unsigned (*shrink)(unsigned npages))
+{
+	struct shrinker *sh;
+
+	spinlock_acquire(&reclaim_lock);
+	KASSERT(reclaim_nshrinkers < RECLAIM_MAXSHRINKERS);
+	sh = &reclaim_shrinkers[reclaim_nshrinkers];
+	sh->sh_name = name;
+	sh->sh_shrink = shrink;
+	sh->sh_calls = 0;
+	sh->sh_freed = 0;
+	membar_store_store();
+	reclaim_nshrinkers++;
+	spinlock_release(&reclaim_lock);
+}
+
+/*
+ * Run the shrinkers in order until NPAGES pages are freed. The
+ * current thread is marked as reclaiming meanwhile, so that anything
+ * the shrinkers allocate fails instead of waiting on us.
+ */
+unsigned
+reclaim_run(unsigned npages)
+{
+	struct shrinker *sh;
+	unsigned i, n, freed;
+	bool was;
+
+	was = curthread->t_reclaiming;
+	curthread->t_reclaiming = true;
+
+	freed = 0;
+	for (i=0; i<reclaim_nshrinkers && freed < npages; i++) {
+		sh = &reclaim_shrinkers[i];
+		n = sh->sh_shrink(npages - freed);
+
+		spinlock_acquire(&reclaim_lock);
+		sh->sh_calls++;
+		sh->sh_freed += n;
+		spinlock_release(&reclaim_lock);
+
+		freed += n;
+	}
+
+	curthread->t_reclaiming = was;
+	return freed;
+}
+
+/*
+ * Called after an allocation of NPAGES pages fails. The first time,
+ * try reclaiming directly; after that, wait for memory to be freed.
+ * Returns false if the caller should give up: because it can't
+ * sleep, because it's out of time, or because memory isn't actually
+ * low (so the allocation failed for want of a large enough contiguous
+ * run, which waiting won't fix).
+ */
+bool
+reclaim_wait(unsigned npages, time_t *deadline)
+{
+	struct timespec now;
+
+	if (!reclaim_ready || curthread->t_in_interrupt ||
+	    curthread->t_iplhigh_count > 0 || curthread->t_reclaiming) {
+		/* (holding a spinlock also raises the ipl) */
+		return false;
+	}
+
+	gettime(&now);
+	if (*deadline == 0) {
+		*deadline = now.tv_sec + RECLAIM_TIMEOUT;
+
+		spinlock_acquire(&reclaim_lock);
+		reclaim_direct++;
+		spinlock_release(&reclaim_lock);
+
+		if (reclaim_run(npages) > 0) {
+			return true;
+		}
+	}
+	else if (now.tv_sec >= *deadline) {
+		spinlock_acquire(&reclaim_lock);
+		reclaim_timeouts++;
+		spinlock_release(&reclaim_lock);
+		return false;
+	}
+
+	spinlock_acquire(&reclaim_lock);
+	reclaim_waits++;
+	spinlock_release(&reclaim_lock);
+
+#if OPT_DUMBVM
+	/* There's no pageout thread; give the rest of the system time. */
+	if (!coremap_low()) {
+		return false;
+	}
+	clocksleep(1);
+	return true;
+#else
+	return coremap_wait();
+#endif
+}
+
+void
+reclaim_throttle(void)
+{
+	time_t deadline = 0;
+
+	if (!coremap_low()) {
+		return;
+	}
+
+	spinlock_acquire(&reclaim_lock);
+	reclaim_throttled++;
+	spinlock_release(&reclaim_lock);
+
+	while (coremap_low() && reclaim_wait(1, &deadline)) {
+		/* nothing */
+	}
+}
+
+void
+reclaim_printstats(void)
+{
+	struct shrinker *sh;
+	unsigned i, direct, waits, timeouts, throttled;
+
+	/* the counters are only read here, so this is good enough */
+	kprintf("shrinker        calls      pages\n");
+	for (i=0; i<reclaim_nshrinkers; i++) {
+		sh = &reclaim_shrinkers[i];
+		kprintf("%-12s %8u %10u\n", sh->sh_name, sh->sh_calls,
+			sh->sh_freed);
+	}
+
+	spinlock_acquire(&reclaim_lock);
+	direct = reclaim_direct;
+	waits = reclaim_waits;
+	timeouts = reclaim_timeouts;
+	throttled = reclaim_throttled;
+	spinlock_release(&reclaim_lock);
+
+	kprintf("reclaim: %u allocations reclaimed directly, %u waits, "
+		"%u timed out; %u forks throttled\n", direct, waits,
+		timeouts, throttled);
+}
@@ -0,0 +1,129 @@
+/*
+ * Swap space management.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+
+static struct vnode *swap_vnode;
+static struct bitmap *swap_map;		/* one bit per slot; set = in use */
+static unsigned swap_nslots;
+static unsigned swap_nfree;
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct stat st;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: stat %s: %s\n", SWAP_DEVICE, strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	if (swap_map == NULL) {
+		panic("swap: out of memory for bitmap\n");
+	}
+	swap_nfree = swap_nslots;
+
+	kprintf("swap: %s: %u slots (%uk)\n", SWAP_DEVICE, swap_nslots,
+		swap_nslots * PAGE_SIZE / 1024);
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swap_map == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	if (result == 0) {
+		swap_nfree--;
+	}
+	spinlock_release(&swap_lock);
+
+	return result ? ENOSPC : 0;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(swap_map != NULL);
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	swap_nfree++;
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between memory and the swap device.
+ */
+static
+int
+swap_io(unsigned slot, paddr_t pa, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result == 0 && ku.uio_resid != 0) {
+		result = EIO;
+	}
+	if (result) {
+		kprintf("swap: %s slot %u: %s\n",
+			rw == UIO_READ ? "read" : "write", slot,
+			strerror(result));
+	}
+	return result;
+}
+
+int
+swap_in(unsigned slot, paddr_t pa)
+{
+	return swap_io(slot, pa, UIO_READ);
+}
+
+int
+swap_out(unsigned slot, paddr_t pa)
+{
+	return swap_io(slot, pa, UIO_WRITE);
+}
@@ -0,0 +1,646 @@
+/*
+ * Machine-independent VM system: page fault handling and paging.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <proc.h>
+#include <current.h>
+#include <uio.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <vmstat.h>
+#include <reclaim.h>
+#include <vm.h>
+
+/* How many victims to try before giving up on an eviction. */
+#define VM_EVICTTRIES	8
+
+/* How many pages the pageout thread evicts per round of shootdowns. */
+#define VM_EVICTBATCH	TLBSHOOTDOWN_MAX
+
+/* Size in pages of the aligned block vm_faultaround maps (power of 2). */
+#define VM_FAULTAROUND	8
+
+static void vm_pageoutthread(void *, unsigned long);
+
+void
+vm_bootstrap(void)
+{
+	int result;
+
+	swap_bootstrap();
+	pagecache_bootstrap();
+
+	/* After the kernel's own caches: file pages cost I/O to get back. */
+	reclaim_register("pagecache", pagecache_shrink);
+
+	result = thread_fork("pageout", NULL, vm_pageoutthread, NULL, 0);
+	if (result) {
+		panic("vm: thread_fork pageout: %s\n", strerror(result));
+	}
+
+	/* Clear free frames ahead of time whenever a cpu is idle. */
+	result = thread_fork_idleworkers("zeropage", coremap_zero_wanted,
+					 coremap_zero_one);
+	if (result) {
+		panic("vm: thread_fork_idleworkers: %s\n", strerror(result));
+	}
+}
+
+////////////////////////////////////////////////////////////
+// paging out
+
+/*
+ * Evict the busy frame PA, which holds page VA of AS. The caller
+ * holds the address space lock and has already shot the page down
+ * from every TLB. Clean pages are only ever mapped read-only, so
+ * after that the dirty bit can't change behind our back.
+ *
+ * Dirty pages are written to a fresh swap slot. Clean pages are
+ * simply dropped: either the frame still has its swap copy, or the
+ * page can be read back from its file or zero-filled again.
+ */
+static
+int
+vm_pageout(struct addrspace *as, vaddr_t va, paddr_t pa)
+{
+	pte_t *pte;
+	unsigned slot;
+	int result;
+
+	pte = pt_lookup(as->as_pt, va, false);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & PTE_VALID) && PTE_PADDR(*pte) == pa);
+
+	if (*pte & PTE_DIRTY) {
+		result = swap_alloc(&slot);
+		if (result) {
+			coremap_unbusy(pa, false);
+			return result;
+		}
+		result = swap_out(slot, pa);
+		if (result) {
+			swap_free(slot);
+			coremap_unbusy(pa, false);
+			return result;
+		}
+		VMSTAT_COUNT(as, vs_swapout);
+	}
+	else {
+		slot = coremap_takeslot(pa);
+	}
+
+	*pte = (slot == SWAP_NOSLOT) ? 0 : PTE_MKSWAP(slot);
+	coremap_unbusy(pa, true);
+	VMSTAT_COUNT(as, vs_evicted);
+	vmstat_resident(as, -1);
+	return 0;
+}
+
+/*
+ * Pick a victim and lock its address space. The address space is
+ * only try-locked, so this can be called with another address space
+ * lock held without deadlocking; if the victim belongs to an address
+ * space whose lock we already hold, that's fine too, and *LOCKED is
+ * set to false. Pages the clock passes over are added to AGED.
+ */
+static
+bool
+vm_pickvictim(paddr_t *pa, struct addrspace **as, vaddr_t *va, bool *locked,
+	      struct tlbbatch *aged)
+{
+	int tries;
+
+	for (tries=0; tries<VM_EVICTTRIES; tries++) {
+		if (!coremap_pickvictim(pa, as, va, aged)) {
+			return false;
+		}
+
+		/* AS can't be destroyed while one of its frames is busy. */
+		if (lock_do_i_hold((*as)->as_lock)) {
+			*locked = false;
+			return true;
+		}
+		if (lock_tryacquire((*as)->as_lock)) {
+			*locked = true;
+			return true;
+		}
+		coremap_unbusy(*pa, false);
+	}
+	return false;
+}
+
+/*
+ * Free up one frame.
+ */
+static
+int
+vm_evict(void)
+{
+	struct tlbbatch aged;
+	struct addrspace *as;
+	paddr_t pa;
+	vaddr_t va;
+	bool locked;
+	int result;
+
+	mmu_batch_init(&aged);
+
+	if (!vm_pickvictim(&pa, &as, &va, &locked, &aged)) {
+		mmu_batch_send(&aged, false);
+		return ENOMEM;
+	}
+
+	mmu_shootdown(as, va);
+	result = vm_pageout(as, va, pa);
+
+	if (locked) {
+		lock_release(as->as_lock);
+	}
+	mmu_batch_send(&aged, false);
+	return result;
+}
+
+/*
+ * Get a (pinned) frame for page VA of AS, evicting something if
+ * memory is short. If ZERO, the frame comes back zero-filled.
+ * Returns 0 if nothing could be freed.
+ */
+paddr_t
+vm_allocpage(struct addrspace *as, vaddr_t va, bool zero)
+{
+	paddr_t pa;
+	int tries;
+
+	for (tries=0; tries<VM_EVICTTRIES; tries++) {
+		pa = zero ? coremap_alloc_zeroed(as, va) :
+			coremap_alloc(1, as, va);
+		if (pa != 0) {
+			return pa;
+		}
+		vm_evict();
+	}
+	return 0;
+}
+
+/*
+ * Free up to VM_EVICTBATCH frames at once, for the pageout thread.
+ * All the victims are picked first so they can be shot down from
+ * every TLB with one round of IPIs instead of one round each.
+ * Returns the number of frames freed.
+ */
+static
+unsigned
+vm_evictbatch(void)
+{
+	struct {
+		struct addrspace *as;
+		vaddr_t va;
+		paddr_t pa;
+		bool locked;
+	} v[VM_EVICTBATCH];
+	struct tlbbatch victims, aged;
+	unsigned i, n, freed;
+
+	mmu_batch_init(&victims);
+	mmu_batch_init(&aged);
+
+	for (n=0; n<VM_EVICTBATCH; n++) {
+		if (!vm_pickvictim(&v[n].pa, &v[n].as, &v[n].va,
+				   &v[n].locked, &aged)) {
+			break;
+		}
+		mmu_batch_add(&victims, v[n].as, v[n].va);
+	}
+
+	mmu_batch_send(&victims, true);
+
+	freed = 0;
+	for (i=0; i<n; i++) {
+		if (vm_pageout(v[i].as, v[i].va, v[i].pa) == 0) {
+			freed++;
+		}
+	}
+	for (i=0; i<n; i++) {
+		if (v[i].locked) {
+			lock_release(v[i].as->as_lock);
+		}
+	}
+
+	mmu_batch_send(&aged, false);
+	return freed;
+}
+
+/*
+ * Background pageout: keep enough frames free that faults don't have
+ * to wait for swap writes.
+ */
+static
+void
+vm_pageoutthread(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	/* Allocations of ours mustn't wait for us to free memory. */
+	curthread->t_reclaiming = true;
+
+	while (1) {
+		coremap_pageout_wait();
+
+		/* Caches are the cheapest thing to give up. */
+		reclaim_run(VM_EVICTBATCH);
+
+		while (coremap_pageout_wanted()) {
+			/* file pages can be read back; take some of those too */
+			if (vm_evictbatch() +
+			    pagecache_shrink(VM_EVICTBATCH / 2) == 0) {
+				/* nothing evictable for now; don't spin */
+				clocksleep(1);
+				break;
+			}
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// paging in
+
+/*
+ * Work out which part [*START, *END) of page VA of region VR comes
+ * from the region's file; the rest of the page is zeros. Returns
+ * false if none of it does.
+ */
+static
+bool
+vm_filepart(struct vm_region *vr, vaddr_t va, vaddr_t *start, vaddr_t *end)
+{
+	if (vr->vr_vnode == NULL) {
+		return false;
+	}
+
+	*start = va > vr->vr_filebase ? va : vr->vr_filebase;
+	*end = va + PAGE_SIZE;
+	if (*end > vr->vr_filebase + vr->vr_filesize) {
+		*end = vr->vr_filebase + vr->vr_filesize;
+	}
+	/* if not, it's BSS, or the zero tail of the segment */
+	return *start < *end;
+}
+
+/*
+ * Fill the new frame PA for page VA of region VR: read whatever part
+ * of the page is file-backed. Unless all of it is, the frame must
+ * already be zero-filled.
+ */
+static
+int
+vm_pagein(struct vm_region *vr, vaddr_t va, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	if (!vm_filepart(vr, va, &start, &end)) {
+		return 0;
+	}
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(pa) + (start - va)),
+		  end - start, vr->vr_fileoff + (start - vr->vr_filebase),
+		  UIO_READ);
+	result = VOP_READ(vr->vr_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("vm: short read paging in 0x%x - file truncated?\n",
+			va);
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Give AS a private copy of the copy-on-write page at VA, whose PTE
+ * is PTE. If nobody else references the frame anymore it can simply
+ * be taken over, unless it belongs to the page cache (a MAP_PRIVATE
+ * file page), which must always be copied. The caller holds the
+ * address space lock.
+ */
+static
+int
+vm_unshare(struct addrspace *as, vaddr_t va, pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+
+	oldpa = PTE_PADDR(*pte);
+	if ((*pte & PTE_CACHED) == 0 && coremap_claim(oldpa, as, va)) {
+		*pte &= ~PTE_COW;
+		VMSTAT_COUNT(as, vs_cowclaim);
+		return 0;
+	}
+
+	newpa = vm_allocpage(as, va, false);
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+
+	/* Drop our reference to the shared frame. */
+	if (*pte & PTE_CACHED) {
+		pagecache_put(oldpa, as, va, false);
+	}
+	else {
+		coremap_free(oldpa);
+	}
+
+	*pte = newpa | PTE_VALID | PTE_DIRTY;
+	coremap_unpin(newpa);
+	VMSTAT_COUNT(as, vs_cowcopy);
+	return 0;
+}
+
+/*
+ * Bring page VA of region VR into memory; *PTE is not valid. The
+ * page comes from swap if it was paged out, otherwise from the
+ * region's backing. File pages of read-only regions and of mmap
+ * regions are shared with everyone else mapping them, through the
+ * page cache; MAP_PRIVATE ones are mapped copy-on-write. The caller
+ * holds the address space lock.
+ */
+static
+int
+vm_fillpage(struct addrspace *as, struct vm_region *vr, vaddr_t va,
+	    pte_t *pte)
+{
+	paddr_t pa;
+	vaddr_t start, end;
+	unsigned slot;
+	bool zero;
+	int result;
+
+	/*
+	 * Ask for a zeroed frame (which is usually ready in the zero
+	 * pool) unless the page will be overwritten entirely.
+	 */
+	if (*pte & PTE_SWAPPED) {
+		zero = false;
+	}
+	else if (vr->vr_flags & VR_MMAP) {
+		/* whole pages of the file, even past its end */
+		result = pagecache_get(vr->vr_vnode,
+			vr->vr_fileoff + (va - vr->vr_base), 0, PAGE_SIZE,
+			as, va, &pa);
+		if (result) {
+			return result;
+		}
+		*pte = pa | PTE_VALID | PTE_CACHED;
+		if ((vr->vr_flags & VR_SHARED) == 0) {
+			*pte |= PTE_COW;
+		}
+		vmstat_resident(as, 1);
+		return 0;
+	}
+	else if (vm_filepart(vr, va, &start, &end)) {
+		if ((vr->vr_perm & VR_WRITE) == 0) {
+			result = pagecache_get(vr->vr_vnode,
+				vr->vr_fileoff + (start - vr->vr_filebase),
+				start - va, end - start, as, va, &pa);
+			if (result) {
+				return result;
+			}
+			*pte = pa | PTE_VALID | PTE_CACHED;
+			vmstat_resident(as, 1);
+			return 0;
+		}
+		zero = start != va || end != va + PAGE_SIZE;
+	}
+	else {
+		zero = true;
+	}
+
+	pa = vm_allocpage(as, va, zero);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+
+	/* The frame stays pinned while we (maybe) sleep on I/O. */
+	if (*pte & PTE_SWAPPED) {
+		slot = PTE_SLOT(*pte);
+		result = swap_in(slot, pa);
+		if (result) {
+			coremap_free(pa);
+			return result;
+		}
+		/* keep the swap copy until the page is written */
+		coremap_setslot(pa, slot);
+		VMSTAT_COUNT(as, vs_swapin);
+	}
+	else {
+		result = vm_pagein(vr, va, pa);
+		if (result) {
+			coremap_free(pa);
+			return result;
+		}
+		if (vm_filepart(vr, va, &start, &end)) {
+			VMSTAT_COUNT(as, vs_pagein);
+		}
+		else {
+			VMSTAT_COUNT(as, vs_zerofill);
+		}
+	}
+
+	*pte = pa | PTE_VALID;
+	coremap_unpin(pa);
+	vmstat_resident(as, 1);
+	return 0;
+}
+
+/*
+ * Fault-around: after a TLB miss at VA, also load translations for
+ * the other resident pages in the same VM_FAULTAROUND-page aligned
+ * block of region VR, so a sequential scan takes one miss per block
+ * rather than one per page. Only free TLB slots are used; nothing is
+ * displaced to make room. The pages are mapped writeable or not by
+ * the same rule as in vm_fault. The caller holds the lock.
+ */
+static
+void
+vm_faultaround(struct addrspace *as, struct vm_region *vr, vaddr_t va)
+{
+	vaddr_t start, end, nva;
+	pte_t *pte;
+	bool writeable;
+
+	start = va & ~(vaddr_t)(VM_FAULTAROUND * PAGE_SIZE - 1);
+	end = start + VM_FAULTAROUND * PAGE_SIZE;
+	if (start < vr->vr_base) {
+		start = vr->vr_base;
+	}
+	if (end > vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+		end = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+	}
+	writeable = (vr->vr_perm & VR_WRITE) != 0;
+
+	for (nva = start; nva < end; nva += PAGE_SIZE) {
+		if (nva == va) {
+			continue;
+		}
+		pte = pt_lookup(as->as_pt, nva, false);
+		if (pte == NULL || (*pte & PTE_VALID) == 0) {
+			continue;
+		}
+		if (!mmu_preload(nva, PTE_PADDR(*pte), writeable &&
+			(*pte & (PTE_COW | PTE_DIRTY)) == PTE_DIRTY)) {
+			break;
+		}
+	}
+}
+
+/*
+ * Handle a TLB miss or write to a read-only TLB entry at FAULTADDRESS.
+ *
+ * The region containing the address decides whether the access is
+ * legal. A page that isn't resident is read back from swap, or from
+ * the region's backing file, or zero-filled. Writes to a
+ * copy-on-write page copy it first, and the first write to a clean
+ * page marks it dirty (and drops its now stale swap copy).
+ *
+ * Then the translation is loaded into the TLB, along with those of
+ * resident neighbours on a miss. Only dirty, private pages are loaded
+ * writeable, so both of the above come back here.
+ * Since the MIPS can't tell an instruction fetch from a data read,
+ * read faults are allowed on anything readable or executable.
+ */
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct vm_region *vr;
+	pte_t *pte;
+	unsigned slot;
+	bool writeable;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x (type %d)\n", faultaddress, faulttype);
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	lock_acquire(as->as_lock);
+
+	VMSTAT_COUNT(as, vs_faults);
+	if (faulttype != VM_FAULT_READONLY) {
+		VMSTAT_COUNT(as, vs_tlbmisses);
+	}
+
+	vr = as_findregion(as, faultaddress);
+	if (vr == NULL) {
+		result = EFAULT;
+		goto out;
+	}
+	writeable = (vr->vr_perm & VR_WRITE) != 0;
+
+	switch (faulttype) {
+	    case VM_FAULT_READ:
+		if ((vr->vr_perm & (VR_READ | VR_WRITE | VR_EXEC)) == 0) {
+			result = EFAULT;
+			goto out;
+		}
+		break;
+	    case VM_FAULT_WRITE:
+	    case VM_FAULT_READONLY:
+		if (!writeable) {
+			result = EFAULT;
+			goto out;
+		}
+		break;
+	    default:
+		result = EINVAL;
+		goto out;
+	}
+
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	if ((*pte & PTE_VALID) == 0) {
+		result = vm_fillpage(as, vr, faultaddress, pte);
+		if (result) {
+			goto out;
+		}
+	}
+
+	if (*pte & PTE_COW) {
+		if (faulttype == VM_FAULT_READ) {
+			/* if the other sharers are gone, take it over */
+			if ((*pte & PTE_CACHED) == 0 &&
+			    coremap_claim(PTE_PADDR(*pte), as, faultaddress)) {
+				*pte &= ~PTE_COW;
+				VMSTAT_COUNT(as, vs_cowclaim);
+			}
+		}
+		else {
+			result = vm_unshare(as, faultaddress, pte);
+			if (result) {
+				goto out;
+			}
+		}
+	}
+
+	if (faulttype != VM_FAULT_READ && (*pte & PTE_DIRTY) == 0) {
+		slot = coremap_takeslot(PTE_PADDR(*pte));
+		if (slot != SWAP_NOSLOT) {
+			swap_free(slot);
+		}
+		*pte |= PTE_DIRTY;
+	}
+
+	coremap_reference(PTE_PADDR(*pte));
+
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, PTE_PADDR(*pte));
+	mmu_map(faultaddress, PTE_PADDR(*pte),
+		writeable && (*pte & (PTE_COW | PTE_DIRTY)) == PTE_DIRTY);
+	if (faulttype != VM_FAULT_READONLY) {
+		vm_faultaround(as, vr, faultaddress);
+	}
+	result = 0;
+
+ out:
+	lock_release(as->as_lock);
+	return result;
+}
@@ -0,0 +1,112 @@
+/*
+ * VM event counters (see vmstat.h).
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <current.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <coremap.h>
+#include <vmstat.h>
+
+struct vmstat vmstat_cpus[MAXCPUS];
+
+/* Totals as of the last vmstat_printstats, for the change since. */
+static struct vmstat vmstat_last;
+
+void
+vmstat_resident(struct addrspace *as, int delta)
+{
+	KASSERT(lock_do_i_hold(as->as_lock));
+	KASSERT(delta >= 0 || as->as_stats.vs_resident >= (unsigned)-delta);
+
+	as->as_stats.vs_resident += delta;
+	if (as->as_stats.vs_resident > as->as_stats.vs_maxresident) {
+		as->as_stats.vs_maxresident = as->as_stats.vs_resident;
+	}
+}
+
+/*
+ * Add up the event counters of every CPU. They may be changing as we
+ * go, but each is read in one piece, which is good enough here.
+ */
+static
+void
+vmstat_sum(struct vmstat *vs)
+{
+	struct vmstat *c;
+	unsigned i;
+
+	bzero(vs, sizeof(*vs));
+	for (i=0; i<MAXCPUS; i++) {
+		c = &vmstat_cpus[i];
+		vs->vs_faults += c->vs_faults;
+		vs->vs_tlbmisses += c->vs_tlbmisses;
+		vs->vs_zerofill += c->vs_zerofill;
+		vs->vs_pagein += c->vs_pagein;
+		vs->vs_cachehit += c->vs_cachehit;
+		vs->vs_swapin += c->vs_swapin;
+		vs->vs_swapout += c->vs_swapout;
+		vs->vs_evicted += c->vs_evicted;
+		vs->vs_cowcopy += c->vs_cowcopy;
+		vs->vs_cowclaim += c->vs_cowclaim;
+	}
+}
+
+void
+vmstat_get(struct addrspace *as, struct vmstat *vs)
+{
+	unsigned peak;
+
+	if (as != NULL) {
+		*vs = as->as_stats;
+		coremap_usage(&vs->vs_totalpages, &vs->vs_freepages,
+			      &vs->vs_userpages, &peak);
+	}
+	else {
+		vmstat_sum(vs);
+		coremap_usage(&vs->vs_totalpages, &vs->vs_freepages,
+			      &vs->vs_userpages, &vs->vs_maxresident);
+		vs->vs_resident = vs->vs_userpages;
+	}
+}
+
+void
+vmstat_printstats(void)
+{
+	struct vmstat vs, *c;
+	unsigned i;
+
+	vmstat_get(NULL, &vs);
+
+	kprintf("vm: %u of %u pages free, %u user (peak %u)\n",
+		vs.vs_freepages, vs.vs_totalpages, vs.vs_userpages,
+		vs.vs_maxresident);
+	for (i=0; i<MAXCPUS; i++) {
+		c = &vmstat_cpus[i];
+		if (c->vs_faults == 0 && c->vs_evicted == 0) {
+			continue;
+		}
+		kprintf("cpu%u: %u faults (%u TLB misses), %u evicted\n",
+			i, c->vs_faults, c->vs_tlbmisses, c->vs_evicted);
+	}
+	kprintf("vm: %u faults (%u TLB misses)\n",
+		vs.vs_faults, vs.vs_tlbmisses);
+	kprintf("vm: pages in: %u zero-filled, %u from files, %u cache "
+		"hits, %u from swap\n", vs.vs_zerofill, vs.vs_pagein,
+		vs.vs_cachehit, vs.vs_swapin);
+	kprintf("vm: %u evicted, %u swapped out; copy-on-write: %u copied, "
+		"%u claimed\n", vs.vs_evicted, vs.vs_swapout, vs.vs_cowcopy,
+		vs.vs_cowclaim);
+	kprintf("vm: since last time: %u faults, %u pages in, %u swapped "
+		"in, %u swapped out\n",
+		vs.vs_faults - vmstat_last.vs_faults,
+		(vs.vs_zerofill + vs.vs_pagein + vs.vs_swapin) -
+		(vmstat_last.vs_zerofill + vmstat_last.vs_pagein +
+		 vmstat_last.vs_swapin),
+		vs.vs_swapin - vmstat_last.vs_swapin,
+		vs.vs_swapout - vmstat_last.vs_swapout);
+	vmstat_last = vs;
+}
@@ -0,0 +1,41 @@
+/*
+ * vmstat - report virtual memory statistics.
+ * Usage: vmstat
+ *
+ * Prints the system-wide page fault and paging counts since boot,
+ * and how much physical memory is in use. Run it before and after a
+ * job to see how much that job paged; a job that keeps swapping
+ * pages in and out needs more memory (see ramsize in sys161.conf).
+ */
+
+#include <sys/types.h>
+#include <sys/vmstat.h>
+#include <stdio.h>
+#include <err.h>
+
+/* Pages are 4K. */
+#define KB(npages)	((npages) * 4)
+
+int
+main(void)
+{
+	struct vmstat vs;
+
+	if (__vmstat(VMSTAT_SYSTEM, &vs) < 0) {
+		err(1, "__vmstat");
+	}
+
+	printf("memory: %uK total, %uK free, %uK user (peak %uK)\n",
+	       KB(vs.vs_totalpages), KB(vs.vs_freepages),
+	       KB(vs.vs_userpages), KB(vs.vs_maxresident));
+	printf("faults: %u (%u TLB misses)\n", vs.vs_faults,
+	       vs.vs_tlbmisses);
+	printf("paged in: %u zero-filled, %u from files, %u cache hits, "
+	       "%u from swap\n", vs.vs_zerofill, vs.vs_pagein,
+	       vs.vs_cachehit, vs.vs_swapin);
+	printf("paged out: %u evicted, %u written to swap\n",
+	       vs.vs_evicted, vs.vs_swapout);
+	printf("copy-on-write: %u copied, %u taken over\n",
+	       vs.vs_cowcopy, vs.vs_cowclaim);
+	return 0;
+}
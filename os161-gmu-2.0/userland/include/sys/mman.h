@@ -0,0 +1,28 @@
+/*
+ * Memory-mapped files.
+ */
+
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+
+/*
+ * Get the PROT_ and MAP_ flags from the kernel.
+ */
+#include <kern/mman.h>
+
+/* What mmap returns on error. */
+#define MAP_FAILED	((void *)-1)
+
+/*
+ * Only whole pages of regular files can be mapped, at page-aligned
+ * offsets. Changes made through MAP_SHARED mappings reach the file
+ * when the page is unmapped (or the process exits), or sooner if the
+ * system runs short of memory; read() and write() see them at once.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+int mprotect(void *addr, size_t len, int prot);
+
+#endif /* _SYS_MMAN_H_ */
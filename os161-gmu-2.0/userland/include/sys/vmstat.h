@@ -0,0 +1,22 @@
+/*
+ * Virtual memory statistics.
+ */
+
+#ifndef _SYS_VMSTAT_H_
+#define _SYS_VMSTAT_H_
+
+#include <sys/types.h>
+
+/*
+ * Get struct vmstat and the VMSTAT_ codes from the kernel.
+ */
+#include <kern/vmstat.h>
+
+/*
+ * Fill in BUF with the counters for the calling process (VMSTAT_SELF)
+ * or for the whole system since boot (VMSTAT_SYSTEM). A program can
+ * call this before exiting to report how much it paged.
+ */
+int __vmstat(int which, struct vmstat *buf);
+
+#endif /* _SYS_VMSTAT_H_ */
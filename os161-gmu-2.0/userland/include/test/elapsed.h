@@ -0,0 +1,16 @@
+/*
+ * Timing helper for the benchmarks in testbin.
+ */
+
+#ifndef _TEST_ELAPSED_H_
+#define _TEST_ELAPSED_H_
+
+#include <time.h>
+
+/*
+ * Return the time elapsed since START_S/START_NS (as filled in by
+ * __time) in microseconds.
+ */
+unsigned long elapsed_usec(time_t start_s, unsigned long start_ns);
+
+#endif /* _TEST_ELAPSED_H_ */
@@ -30,10 +30,26 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * This is a segregated-fit allocator. The heap is a sequence of
+ * blocks, each with a header giving the offsets to its neighbours
+ * (so a block can always find the one below it as well as the one
+ * above, and adjacent free blocks are merged in constant time). Free
+ * blocks are also kept on doubly-linked lists, one per size class,
+ * threaded through their data areas:
+ *
+ *    - small sizes (up to 64 blocks' worth) have one list per exact
+ *      size, so a request is satisfied off the front of its list;
+ *    - larger sizes have one list per power of two, searched first
+ *      fit;
+ *    - everything of MLARGE bytes or more shares the last list. Large
+ *      requests go straight there and then to sbrk, and a large free
+ *      block at the top of the heap is handed back with sbrk.
+ *
+ * A bitmap of nonempty lists finds the next larger class without
+ * walking the empty ones. If nothing fits, the heap is extended.
+ *
+ * Defining MALLOCDEBUG turns on heap dumps and checks on every call,
+ * and wiping freed memory.
  */
 
 #include <stdlib.h>
@@ -107,6 +123,16 @@ struct mheader {
 #endif
 };
 
+/*
+ * Free list links, kept in the data area of a free block. Every
+ * block has at least MBLOCKSIZE bytes of data, which is exactly
+ * enough for these.
+ */
+struct mlinks {
+	struct mheader *ml_next;
+	struct mheader *ml_prev;
+};
+
 /*
  * Operator macros on struct mheader.
  *
@@ -115,6 +141,7 @@ struct mheader {
  *
  * M_DATA:		return data pointer of a header
  * M_SIZE:		return data size of a header
+ * M_LINKS:		return free list links of a (free) header
  *
  * M_OK:		true if the magic values are correct
  *
@@ -129,11 +156,36 @@ struct mheader {
 
 #define M_DATA(mh)	((void *)((mh)+1))
 #define M_SIZE(mh)	(M_NEXTOFF(mh)-MBLOCKSIZE)
+#define M_LINKS(mh)	((struct mlinks *)M_DATA(mh))
 
 #define M_OK(mh)	((mh)->mh_magic1==MMAGIC && (mh)->mh_magic2==MMAGIC)
 
 #define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
 
+/*
+ * Size classes.
+ *
+ * MNSMALL:		number of exact-size classes, for data sizes
+ *			MBLOCKSIZE, 2*MBLOCKSIZE, ... MNSMALL*MBLOCKSIZE
+ * MSMALLSHIFT:		log2 of the first size past those
+ * MLARGESHIFT:		log2 of MLARGE, the smallest "large" size
+ * MNBINS:		total number of classes; the power-of-two ones
+ *			come after the small ones, and the last one
+ *			holds everything of MLARGE bytes and up
+ * MTRIM:		size of free space at the top of the heap worth
+ *			giving back to the system
+ */
+#define MNSMALL		64
+#define MSMALLSHIFT	(MBLOCKSHIFT + 6)
+#define MLARGESHIFT	16
+#define MLARGE		((size_t)1 << MLARGESHIFT)
+#define MNBINS		(MNSMALL + MLARGESHIFT - MSMALLSHIFT + 1)
+#define MLARGEBIN	(MNBINS - 1)
+#define MTRIM		(2 * MLARGE)
+
+#define MBITS		(sizeof(unsigned) * 8)
+#define MMAPWORDS	((MNBINS + MBITS - 1) / MBITS)
+
 /*
  * System page size. In POSIX you're supposed to call
  * sysconf(_SC_PAGESIZE). If _SC_PAGESIZE isn't defined, as on OS/161,
@@ -150,9 +202,14 @@ static size_t __malloc_pagesize;
 ////////////////////////////////////////////////////////////
 
 /*
- * Static variables - the bottom and top addresses of the heap.
+ * Static variables - the bottom and top addresses of the heap, the
+ * highest block in it (NULL if empty), the free lists, and the
+ * bitmap of which free lists are nonempty.
  */
 static uintptr_t __heapbase, __heaptop;
+static struct mheader *__heaplast;
+static struct mheader *__malloc_bins[MNBINS];
+static unsigned __malloc_binmap[MMAPWORDS];
 
 /*
  * Setup function.
@@ -175,6 +232,9 @@ __malloc_init(void)
 	if (1<<MBLOCKSHIFT != MBLOCKSIZE) {
 		errx(1, "malloc: Internal error - MBLOCKSHIFT wrong");
 	}
+	if (sizeof(struct mlinks) > MBLOCKSIZE) {
+		errx(1, "malloc: Internal error - free list links too big");
+	}
 
 	/* init should only be called once. */
 	if (__heapbase!=0 || __heaptop!=0) {
@@ -223,10 +283,130 @@ __malloc_init(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Size class of a block with SIZE bytes of data.
+ */
+static
+unsigned
+__malloc_binof(size_t size)
+{
+	unsigned shift;
+
+	if (size <= MNSMALL * MBLOCKSIZE) {
+		return (size >> MBLOCKSHIFT) - 1;
+	}
+	if (size >= MLARGE) {
+		return MLARGEBIN;
+	}
+	for (shift = MSMALLSHIFT; (size >> (shift + 1)) != 0; shift++) {
+		/* nothing */
+	}
+	return MNSMALL + shift - MSMALLSHIFT;
+}
+
+/*
+ * Put a free block on the list for its size.
+ */
+static
+void
+__malloc_link(struct mheader *mh)
+{
+	unsigned bin;
+
+	bin = __malloc_binof(M_SIZE(mh));
+	M_LINKS(mh)->ml_prev = NULL;
+	M_LINKS(mh)->ml_next = __malloc_bins[bin];
+	if (__malloc_bins[bin] != NULL) {
+		M_LINKS(__malloc_bins[bin])->ml_prev = mh;
+	}
+	__malloc_bins[bin] = mh;
+	__malloc_binmap[bin / MBITS] |= 1U << (bin % MBITS);
+}
+
+/*
+ * Take a free block off its list. This must be done before its size
+ * changes.
+ */
+static
+void
+__malloc_unlink(struct mheader *mh)
+{
+	struct mlinks *ml;
+	unsigned bin;
+
+	bin = __malloc_binof(M_SIZE(mh));
+	ml = M_LINKS(mh);
+	if (ml->ml_prev != NULL) {
+		M_LINKS(ml->ml_prev)->ml_next = ml->ml_next;
+	}
+	else {
+		if (__malloc_bins[bin] != mh) {
+			errx(1, "malloc: Heap corrupt; free block at %p "
+			     "not on its list", mh);
+		}
+		__malloc_bins[bin] = ml->ml_next;
+		if (ml->ml_next == NULL) {
+			__malloc_binmap[bin / MBITS] &= ~(1U << (bin % MBITS));
+		}
+	}
+	if (ml->ml_next != NULL) {
+		M_LINKS(ml->ml_next)->ml_prev = ml->ml_prev;
+	}
+}
+
+/*
+ * Return the first nonempty size class at or above BIN, or MNBINS if
+ * there isn't one.
+ */
+static
+unsigned
+__malloc_nextbin(unsigned bin)
+{
+	unsigned word, bits;
+
+	word = bin / MBITS;
+	if (word >= MMAPWORDS) {
+		return MNBINS;
+	}
+	bits = __malloc_binmap[word] & (~0U << (bin % MBITS));
+	while (bits == 0) {
+		if (++word == MMAPWORDS) {
+			return MNBINS;
+		}
+		bits = __malloc_binmap[word];
+	}
+	bin = word * MBITS;
+	while ((bits & 1) == 0) {
+		bits >>= 1;
+		bin++;
+	}
+	return bin;
+}
+
+/*
+ * First-fit search of one size class.
+ */
+static
+struct mheader *
+__malloc_search(unsigned bin, size_t size)
+{
+	struct mheader *mh;
+
+	for (mh = __malloc_bins[bin]; mh != NULL; mh = M_LINKS(mh)->ml_next) {
+		if (M_SIZE(mh) >= size) {
+			return mh;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+
 #ifdef MALLOCDEBUG
 
 /*
- * Debugging print function to iterate and dump the entire heap.
+ * Debugging print function to iterate and dump the entire heap, and
+ * check the free lists against it.
  */
 static
 void
@@ -235,10 +415,13 @@ __malloc_dump(void)
 	struct mheader *mh;
 	uintptr_t i;
 	size_t rightprevblock;
+	unsigned bin, nfree;
 
 	warnx("heap: ************************************************");
 
 	rightprevblock = 0;
+	nfree = 0;
+	mh = NULL;
 	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
 		mh = (struct mheader *) i;
 		if (!M_OK(mh)) {
@@ -255,6 +438,9 @@ __malloc_dump(void)
 			     (unsigned long) rightprevblock << MBLOCKSHIFT);
 		}
 		rightprevblock = mh->mh_nextblock;
+		if (!mh->mh_inuse) {
+			nfree++;
+		}
 
 		warnx("heap: 0x%lx 0x%-6lx (next: 0x%lx) %s",
 		      (unsigned long) i + MBLOCKSIZE,
@@ -265,10 +451,50 @@ __malloc_dump(void)
 	if (i!=__heaptop) {
 		errx(1, "malloc: Heap corrupt; ran off end");
 	}
+	if (mh != __heaplast) {
+		errx(1, "malloc: Heap corrupt; last block is %p, not %p",
+		     mh, __heaplast);
+	}
+
+	for (bin=0; bin<MNBINS; bin++) {
+		for (mh = __malloc_bins[bin]; mh != NULL;
+		     mh = M_LINKS(mh)->ml_next) {
+			if (mh->mh_inuse ||
+			    __malloc_binof(M_SIZE(mh)) != bin) {
+				errx(1, "malloc: Heap corrupt; block at %p "
+				     "on wrong free list %u", mh, bin);
+			}
+			nfree--;
+		}
+		if ((__malloc_bins[bin] != NULL) !=
+		    ((__malloc_binmap[bin / MBITS] &
+		      (1U << (bin % MBITS))) != 0)) {
+			errx(1, "malloc: Free list bitmap wrong for %u", bin);
+		}
+	}
+	if (nfree != 0) {
+		errx(1, "malloc: Heap corrupt; free blocks missing "
+		     "from the free lists");
+	}
 
 	warnx("heap: ************************************************");
 }
 
+/*
+ * Clear a range of memory with 0xdeadbeef.
+ * ptr must be suitably aligned.
+ */
+static
+void
+__malloc_deadbeef(void *ptr, size_t size)
+{
+	uint32_t *x = ptr;
+	size_t i, n = size/sizeof(uint32_t);
+	for (i=0; i<n; i++) {
+		x[i] = 0xdeadbeef;
+	}
+}
+
 #endif /* MALLOCDEBUG */
 
 ////////////////////////////////////////////////////////////
@@ -301,7 +527,8 @@ __malloc_sbrk(size_t size)
 /*
  * Make a new (free) block from the block passed in, leaving size
  * bytes for data in the current block. size must be a multiple of
- * MBLOCKSIZE.
+ * MBLOCKSIZE. The new block goes on its free list. The block after
+ * it must be in use, so there's nothing to merge it with.
  *
  * Only split if the excess space is at least twice the blocksize -
  * one blocksize to hold a header and one for data.
@@ -343,96 +570,26 @@ __malloc_split(struct mheader *mh, size_t size)
 	if (mhnext != (struct mheader *) __heaptop) {
 		mhnext->mh_prevblock = mhnew->mh_nextblock;
 	}
+	else {
+		__heaplast = mhnew;
+	}
+
+	__malloc_link(mhnew);
 }
 
 /*
- * malloc itself.
+ * Extend the heap so there's a block of at least SIZE bytes at the
+ * top, and return it (in use). The top block is reused if it's free.
  */
-void *
-malloc(size_t size)
+static
+struct mheader *
+__malloc_extend(size_t size)
 {
 	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
 	size_t morespace;
 	void *p;
 
-	if (__heapbase==0) {
-		__malloc_init();
-	}
-	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
-		warnx("malloc: Internal error - local data corrupt");
-		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx",
-		     (unsigned long) __heapbase, (unsigned long) __heaptop);
-	}
-
-#ifdef MALLOCDEBUG
-	warnx("malloc: about to allocate %lu (0x%lx) bytes",
-	      (unsigned long) size, (unsigned long) size);
-	__malloc_dump();
-#endif
-
-	/* Round size up to an integral number of blocks. */
-	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
-
-	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
-	 */
-	rightprevblock = 0;
-	mh = NULL;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i,
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
-
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
-		}
-
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
-		/*
-		 * Now, allocate.
-		 */
-		mh->mh_inuse = 1;
-
-#ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
-#endif
-		return M_DATA(mh);
-	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
-	}
-
-	/*
-	 * Didn't find anything. Expand the heap.
-	 *
-	 * If the heap is nonempty and the top block (the one mh is
-	 * left pointing to after the above loop) is free, we can
-	 * expand it. Otherwise we need a new block.
-	 */
+	mh = __heaplast;
 	if (mh != NULL && !mh->mh_inuse) {
 		assert(size > M_SIZE(mh));
 		morespace = size - M_SIZE(mh);
@@ -451,25 +608,95 @@ malloc(size_t size)
 
 	if (mh != NULL && !mh->mh_inuse) {
 		/* update old header */
+		__malloc_unlink(mh);
 		mh->mh_nextblock = M_MKFIELD(M_NEXTOFF(mh) + morespace);
 		mh->mh_inuse = 1;
 	}
 	else {
 		/* fill out new header */
 		mh = p;
-		mh->mh_prevblock = rightprevblock;
+		mh->mh_prevblock = __heaplast ? __heaplast->mh_nextblock : 0;
 		mh->mh_magic1 = MMAGIC;
 		mh->mh_magic2 = MMAGIC;
 		mh->mh_pad = 0;
 		mh->mh_inuse = 1;
 		mh->mh_nextblock = M_MKFIELD(morespace);
+		__heaplast = mh;
+	}
+	return mh;
+}
+
+/*
+ * malloc itself.
+ */
+void *
+malloc(size_t size)
+{
+	struct mheader *mh;
+	unsigned bin;
+
+	if (__heapbase==0) {
+		__malloc_init();
+	}
+	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
+		warnx("malloc: Internal error - local data corrupt");
+		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx",
+		     (unsigned long) __heapbase, (unsigned long) __heaptop);
+	}
+
+#ifdef MALLOCDEBUG
+	warnx("malloc: about to allocate %lu (0x%lx) bytes",
+	      (unsigned long) size, (unsigned long) size);
+	__malloc_dump();
+#endif
+
+	/* Don't let the rounding below wrap around. */
+	if (size > (size_t)-1 - 2*PAGE_SIZE) {
+		return NULL;
+	}
+
+	/* Round size up to an integral number of blocks (at least one). */
+	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	if (size == 0) {
+		size = MBLOCKSIZE;
 	}
 
 	/*
-	 * Either way, try splitting the block we got as because of
-	 * the page rounding it might be quite a bit bigger than we
-	 * needed.
+	 * Small sizes: every block on the exact-size list fits. Other
+	 * sizes: search this size's list first fit. Failing that, the
+	 * first block from any bigger class fits, except that blocks
+	 * on the large list have to be searched too.
 	 */
+	bin = __malloc_binof(size);
+	if (bin < MNSMALL) {
+		mh = __malloc_bins[bin];
+	}
+	else {
+		mh = __malloc_search(bin, size);
+	}
+	if (mh == NULL && bin < MLARGEBIN) {
+		bin = __malloc_nextbin(bin + 1);
+		if (bin == MLARGEBIN) {
+			mh = __malloc_search(bin, size);
+		}
+		else if (bin < MNBINS) {
+			mh = __malloc_bins[bin];
+		}
+	}
+
+	if (mh != NULL) {
+		__malloc_unlink(mh);
+		mh->mh_inuse = 1;
+	}
+	else {
+		/* Nothing fits (or it's large); expand the heap. */
+		mh = __malloc_extend(size);
+		if (mh == NULL) {
+			return NULL;
+		}
+	}
+
+	/* Give back whatever we don't need. */
 	__malloc_split(mh, size);
 
 #ifdef MALLOCDEBUG
@@ -482,26 +709,12 @@ malloc(size_t size)
 ////////////////////////////////////////////////////////////
 
 /*
- * Clear a range of memory with 0xdeadbeef.
- * ptr must be suitably aligned.
+ * Merge two adjacent free blocks (mh below mhnext), neither of which
+ * is on a free list.
  */
 static
 void
-__malloc_deadbeef(void *ptr, size_t size)
-{
-	uint32_t *x = ptr;
-	size_t i, n = size/sizeof(uint32_t);
-	for (i=0; i<n; i++) {
-		x[i] = 0xdeadbeef;
-	}
-}
-
-/*
- * Attempt to merge two adjacent blocks (mh below mhnext).
- */
-static
-void
-__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
+__malloc_merge(struct mheader *mh, struct mheader *mhnext)
 {
 	struct mheader *mhnextnext;
 
@@ -509,10 +722,6 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
 		     mh, mhnext);
 	}
-	if (mh->mh_inuse || mhnext->mh_inuse) {
-		/* can't merge */
-		return;
-	}
 
 	mhnextnext = M_NEXT(mhnext);
 
@@ -522,9 +731,45 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	if (mhnextnext != (struct mheader *)__heaptop) {
 		mhnextnext->mh_prevblock = mh->mh_nextblock;
 	}
+	else {
+		__heaplast = mh;
+	}
 
+#ifdef MALLOCDEBUG
 	/* Deadbeef out the memory used by the now-obsolete header */
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
+#endif
+}
+
+/*
+ * If the free block MH is at the top of the heap and big enough,
+ * return all the whole pages in it except the first to the system.
+ */
+static
+void
+__malloc_trim(struct mheader *mh)
+{
+	size_t release;
+	void *x;
+
+	if (mh != __heaplast || M_SIZE(mh) < MTRIM) {
+		return;
+	}
+
+	release = (M_SIZE(mh) - MBLOCKSIZE) / PAGE_SIZE * PAGE_SIZE;
+	x = sbrk(-(intptr_t)release);
+	if (x == (void *)-1) {
+		/* never mind */
+		return;
+	}
+	if ((uintptr_t)x != __heaptop) {
+		errx(1, "free: Internal error - "
+		     "heap top moved itself from 0x%lx to 0x%lx",
+		     (unsigned long) __heaptop,
+		     (unsigned long) (uintptr_t) x);
+	}
+	__heaptop -= release;
+	mh->mh_nextblock = M_MKFIELD(M_NEXTOFF(mh) - release);
 }
 
 /*
@@ -569,21 +814,41 @@ free(void *x)
 	/* mark it free */
 	mh->mh_inuse = 0;
 
+#ifdef MALLOCDEBUG
 	/* wipe it */
 	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+#endif
 
 	/* Try merging with the block above (but not if we're at the top) */
-	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	if (mh != __heaplast) {
+		mhnext = M_NEXT(mh);
+		if (!M_OK(mhnext)) {
+			errx(1, "free: Heap corrupt; header at %p "
+			     "has bad magic bits", mhnext);
+		}
+		if (!mhnext->mh_inuse) {
+			__malloc_unlink(mhnext);
+			__malloc_merge(mh, mhnext);
+		}
 	}
 
 	/* Try merging with the block below (but not if we're at the bottom) */
 	if (mh != (struct mheader *)__heapbase) {
 		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+		if (!M_OK(mhprev)) {
+			errx(1, "free: Heap corrupt; header at %p "
+			     "has bad magic bits", mhprev);
+		}
+		if (!mhprev->mh_inuse) {
+			__malloc_unlink(mhprev);
+			__malloc_merge(mhprev, mh);
+			mh = mhprev;
+		}
 	}
 
+	__malloc_trim(mh);
+	__malloc_link(mh);
+
 #ifdef MALLOCDEBUG
 	warnx("free: freed %p", x);
 	__malloc_dump();
@@ -0,0 +1,19 @@
+/*
+ * elapsed.c
+ *
+ *	Timing helper for the benchmarks.
+ */
+
+#include <time.h>
+#include <test/elapsed.h>
+
+unsigned long
+elapsed_usec(time_t start_s, unsigned long start_ns)
+{
+	time_t now_s;
+	unsigned long now_ns;
+
+	__time(&now_s, &now_ns);
+	return (unsigned long)(now_s - start_s) * 1000000 +
+		now_ns / 1000 - start_ns / 1000;
+}
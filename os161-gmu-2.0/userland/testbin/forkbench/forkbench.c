@@ -0,0 +1,94 @@
+/*
+ * forkbench - measure fork latency.
+ * Usage: forkbench [nforks]
+ *
+ * Dirties a 1 MB buffer so the parent has a sizeable address space,
+ * then times NFORKS rounds of fork/_exit/waitpid in two variants:
+ *
+ *    exit  - the child exits immediately (the fork-then-exec case);
+ *    touch - the child writes one byte in every page of the buffer
+ *            first, so every shared page really has to be copied.
+ *
+ * With copy-on-write the first figure should be small and roughly
+ * independent of the buffer size; with an eager copy (dumbvm) both
+ * figures include copying the whole address space.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+#include <test/elapsed.h>
+
+#define BUFSIZE		(1024*1024)
+#define PAGESIZE	4096
+#define DEFAULT_NFORKS	50
+
+static char buf[BUFSIZE];
+
+static
+void
+touch(void)
+{
+	unsigned i;
+
+	for (i=0; i<BUFSIZE; i+=PAGESIZE) {
+		buf[i]++;
+	}
+}
+
+static
+void
+run(const char *name, int nforks, int childtouches)
+{
+	time_t start_s;
+	unsigned long start_ns, usec;
+	int i, status;
+	pid_t pid;
+
+	__time(&start_s, &start_ns);
+
+	for (i=0; i<nforks; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			if (childtouches) {
+				touch();
+			}
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+
+	usec = elapsed_usec(start_s, start_ns);
+	printf("%-6s %d forks in %lu us: %lu us/fork\n",
+	       name, nforks, usec, usec / nforks);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nforks = DEFAULT_NFORKS;
+
+	if (argc > 1) {
+		nforks = atoi(argv[1]);
+		if (nforks <= 0) {
+			errx(1, "Usage: forkbench [nforks]");
+		}
+	}
+
+	/* Make sure all of buf is really resident in the parent. */
+	touch();
+
+	printf("forkbench: %d KB dirty in parent\n", BUFSIZE / 1024);
+	run("exit", nforks, 0);
+	run("touch", nforks, 1);
+
+	return 0;
+}
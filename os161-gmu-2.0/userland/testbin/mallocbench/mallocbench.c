@@ -0,0 +1,158 @@
+/*
+ * mallocbench - measure malloc/free throughput.
+ * Usage: mallocbench [nops]
+ *
+ * Runs NOPS operations of each of three workloads and reports
+ * operations per second:
+ *
+ *    small  - malloc and immediately free one small (64-byte) block;
+ *    mixed  - keep a pool of up to NSLOTS live blocks of random sizes
+ *             (mostly under 1K, some up to 64K), and at each step
+ *             free a random one or allocate a new one in its place;
+ *    large  - malloc and free blocks of 64K to 256K, which go
+ *             through the large-block path and back to sbrk.
+ *
+ * With a first-fit allocator the mixed figure falls off as the heap
+ * fills with blocks; with size-class free lists it should not.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+#include <test/elapsed.h>
+
+#define NSLOTS		1024
+#define DEFAULT_NOPS	100000
+
+static void *slots[NSLOTS];
+static unsigned long seed = 1;
+
+/*
+ * Simple deterministic generator, so every run does the same work.
+ */
+static
+unsigned long
+rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) & 0xffffff;
+}
+
+static
+void
+report(const char *name, int nops, time_t start_s, unsigned long start_ns)
+{
+	unsigned long usec;
+
+	usec = elapsed_usec(start_s, start_ns);
+	if (usec < 1000) {
+		usec = 1000;
+	}
+	/* (in two steps to stay within 32 bits) */
+	printf("%-6s %d ops in %lu us: %lu ops/sec\n", name, nops, usec,
+	       (unsigned long)nops * 1000 / (usec / 1000));
+}
+
+static
+void
+small(int nops)
+{
+	time_t start_s;
+	unsigned long start_ns;
+	void *p;
+	int i;
+
+	__time(&start_s, &start_ns);
+	for (i=0; i<nops; i++) {
+		p = malloc(64);
+		if (p == NULL) {
+			errx(1, "small: malloc failed");
+		}
+		*(char *)p = 1;
+		free(p);
+	}
+	report("small", nops, start_s, start_ns);
+}
+
+static
+void
+mixed(int nops)
+{
+	time_t start_s;
+	unsigned long start_ns;
+	size_t size;
+	unsigned slot;
+	int i;
+
+	__time(&start_s, &start_ns);
+	for (i=0; i<nops; i++) {
+		slot = rnd() % NSLOTS;
+		if (slots[slot] != NULL) {
+			free(slots[slot]);
+			slots[slot] = NULL;
+			continue;
+		}
+		if (rnd() % 16 == 0) {
+			size = rnd() % 65536;
+		}
+		else {
+			size = rnd() % 1024;
+		}
+		slots[slot] = malloc(size);
+		if (slots[slot] == NULL) {
+			errx(1, "mixed: malloc of %lu failed",
+			     (unsigned long)size);
+		}
+		memset(slots[slot], 0, size < 16 ? size : 16);
+	}
+	for (slot=0; slot<NSLOTS; slot++) {
+		free(slots[slot]);
+		slots[slot] = NULL;
+	}
+	report("mixed", nops, start_s, start_ns);
+}
+
+static
+void
+large(int nops)
+{
+	time_t start_s;
+	unsigned long start_ns;
+	size_t size;
+	void *p;
+	int i;
+
+	__time(&start_s, &start_ns);
+	for (i=0; i<nops; i++) {
+		size = 65536 + rnd() % (3 * 65536);
+		p = malloc(size);
+		if (p == NULL) {
+			errx(1, "large: malloc of %lu failed",
+			     (unsigned long)size);
+		}
+		*(char *)p = 1;
+		free(p);
+	}
+	report("large", nops, start_s, start_ns);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nops = DEFAULT_NOPS;
+
+	if (argc > 1) {
+		nops = atoi(argv[1]);
+		if (nops <= 0) {
+			errx(1, "Usage: mallocbench [nops]");
+		}
+	}
+
+	small(nops);
+	mixed(nops);
+	large(nops / 10 > 0 ? nops / 10 : 1);
+
+	return 0;
+}
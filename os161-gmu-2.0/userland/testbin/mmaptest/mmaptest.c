@@ -0,0 +1,290 @@
+/*
+ * mmaptest - test file mappings.
+ * Usage: mmaptest
+ *
+ * Makes a small file and checks that:
+ *
+ *    - a mapping shows the file's contents, with zeros past its end;
+ *    - stores through a MAP_SHARED mapping are seen by read() at once
+ *      and by a forked child, and write() is seen through the mapping;
+ *    - stores through a MAP_PRIVATE mapping reach neither the file
+ *      nor other mappings;
+ *    - shared changes are in the file after munmap, and the pages are
+ *      gone (touching them kills the process);
+ *    - mprotect takes write access away and gives it back, but won't
+ *      give it to a shared mapping of a file opened read-only.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define FILENAME	"mmaptest.dat"
+#define PAGESIZE	4096
+#define FILESIZE	(3 * PAGESIZE + 100)
+#define MAPSIZE		(4 * PAGESIZE)
+
+static char buf[FILESIZE];
+
+static
+char
+pattern(unsigned i)
+{
+	return 'a' + (i * 7 + i / PAGESIZE) % 26;
+}
+
+static
+void
+makefile(void)
+{
+	unsigned i;
+	int fd;
+
+	for (i=0; i<FILESIZE; i++) {
+		buf[i] = pattern(i);
+	}
+	fd = open(FILENAME, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+	if (write(fd, buf, FILESIZE) != FILESIZE) {
+		err(1, "%s: write", FILENAME);
+	}
+	close(fd);
+}
+
+/*
+ * Read byte OFFSET of the file with read().
+ */
+static
+char
+readbyte(int fd, off_t offset)
+{
+	char c;
+
+	if (lseek(fd, offset, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	if (read(fd, &c, 1) != 1) {
+		err(1, "read at %ld", (long)offset);
+	}
+	return c;
+}
+
+static
+void
+writebyte(int fd, off_t offset, char c)
+{
+	if (lseek(fd, offset, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	if (write(fd, &c, 1) != 1) {
+		err(1, "write at %ld", (long)offset);
+	}
+}
+
+/*
+ * Fork a child that stores to P; return true if it survived.
+ */
+static
+int
+cantouch(volatile char *p)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		*p = 'X';
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static
+void
+test_shared(void)
+{
+	char *p, *q;
+	pid_t pid;
+	int fd, status;
+	unsigned i;
+
+	fd = open(FILENAME, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+	p = mmap(NULL, MAPSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap shared");
+	}
+
+	for (i=0; i<FILESIZE; i++) {
+		if (p[i] != pattern(i)) {
+			errx(1, "shared: byte %u is %d, not %d", i, p[i],
+			     pattern(i));
+		}
+	}
+	for (; i<MAPSIZE; i++) {
+		if (p[i] != 0) {
+			errx(1, "shared: byte %u past EOF is %d", i, p[i]);
+		}
+	}
+	printf("mmaptest: contents ok\n");
+
+	/* store through the mapping, look with read() */
+	p[10] = 'Z';
+	p[PAGESIZE + 10] = 'Y';
+	if (readbyte(fd, 10) != 'Z' || readbyte(fd, PAGESIZE + 10) != 'Y') {
+		errx(1, "shared: read() doesn't see stores");
+	}
+	/* write(), look through the mapping */
+	writebyte(fd, 2 * PAGESIZE + 5, 'W');
+	if (p[2 * PAGESIZE + 5] != 'W') {
+		errx(1, "shared: mapping doesn't see write()");
+	}
+
+	/* a second mapping of the same page sees the same data */
+	q = mmap(NULL, PAGESIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if (q == MAP_FAILED) {
+		err(1, "mmap second");
+	}
+	if (q == p || q[10] != 'Z') {
+		errx(1, "shared: second mapping differs");
+	}
+
+	/* a child's stores reach us */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		p[20] = 'C';
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (p[20] != 'C' || q[20] != 'C') {
+		errx(1, "shared: child's store not seen");
+	}
+	printf("mmaptest: shared mapping ok\n");
+
+	if (munmap(q, PAGESIZE) < 0) {
+		err(1, "munmap second");
+	}
+	if (munmap(p, MAPSIZE) < 0) {
+		err(1, "munmap");
+	}
+	if (cantouch(p)) {
+		errx(1, "munmap: page still there");
+	}
+	close(fd);
+
+	/* the changes are in the file, which didn't grow */
+	fd = open(FILENAME, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+	if (readbyte(fd, 10) != 'Z' || readbyte(fd, 20) != 'C' ||
+	    readbyte(fd, PAGESIZE + 10) != 'Y' ||
+	    readbyte(fd, 2 * PAGESIZE + 5) != 'W' ||
+	    readbyte(fd, 11) != pattern(11)) {
+		errx(1, "munmap: file contents wrong");
+	}
+	if (lseek(fd, 0, SEEK_END) != FILESIZE) {
+		errx(1, "munmap: file size changed");
+	}
+	close(fd);
+	printf("mmaptest: munmap ok\n");
+}
+
+static
+void
+test_private(void)
+{
+	char *p, *q;
+	int fd;
+
+	makefile();
+	fd = open(FILENAME, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+	p = mmap(NULL, MAPSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap private");
+	}
+	q = mmap(NULL, MAPSIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if (q == MAP_FAILED) {
+		err(1, "mmap shared read-only");
+	}
+
+	if (p[30] != pattern(30)) {
+		errx(1, "private: contents wrong");
+	}
+	p[30] = 'P';
+	p[MAPSIZE - 1] = 'P';
+	if (p[30] != 'P' || q[30] != pattern(30) ||
+	    readbyte(fd, 30) != pattern(30)) {
+		errx(1, "private: store leaked out");
+	}
+	if (cantouch(p + 40) == 0) {
+		errx(1, "private: child can't write");
+	}
+	if (p[40] != pattern(40)) {
+		errx(1, "private: child's store leaked into parent");
+	}
+	printf("mmaptest: private mapping ok\n");
+
+	/* mprotect */
+	if (mprotect(q, PAGESIZE, PROT_READ | PROT_WRITE) == 0 ||
+	    errno != EACCES) {
+		errx(1, "mprotect: made read-only shared mapping writeable");
+	}
+	if (mprotect(p, PAGESIZE, PROT_READ) < 0) {
+		err(1, "mprotect read-only");
+	}
+	if (cantouch(p)) {
+		errx(1, "mprotect: page still writeable");
+	}
+	if (cantouch(p + PAGESIZE) == 0) {
+		errx(1, "mprotect: next page not writeable");
+	}
+	if (mprotect(p, PAGESIZE, PROT_READ | PROT_WRITE) < 0) {
+		err(1, "mprotect read-write");
+	}
+	p[0] = 'Q';
+	if (p[0] != 'Q' || p[30] != 'P') {
+		errx(1, "mprotect: page contents lost");
+	}
+	printf("mmaptest: mprotect ok\n");
+
+	if (munmap(p, MAPSIZE) < 0 || munmap(q, MAPSIZE) < 0) {
+		err(1, "munmap");
+	}
+	close(fd);
+}
+
+int
+main(void)
+{
+	makefile();
+	test_shared();
+	test_private();
+	remove(FILENAME);
+	printf("mmaptest: passed\n");
+	return 0;
+}
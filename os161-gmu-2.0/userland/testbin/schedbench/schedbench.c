@@ -0,0 +1,136 @@
+/*
+ * schedbench - measure interactive response time next to CPU hogs.
+ * Usage: schedbench [nhogs] [seconds]
+ *
+ * The "interactive" job is a loop of small requests, each of which
+ * reads one byte of a file and so has to sleep for the disk. For
+ * SECONDS seconds it runs alone; then for SECONDS more next to NHOGS
+ * forked processes that do nothing but compute (like hog). For each
+ * run it prints how many requests it got through and how long they
+ * took on average and at worst.
+ *
+ * With plain round-robin scheduling every request waits behind each
+ * hog's time slice; a scheduler that favors threads that sleep should
+ * keep the response time close to that of the first run.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <err.h>
+#include <test/elapsed.h>
+
+#define FILENAME	"schedbench.dat"
+#define MAXHOGS		32
+#define DEFAULT_NHOGS	4
+#define DEFAULT_SECONDS	5
+
+/*
+ * Compute until time UNTIL, then exit.
+ */
+static
+void
+hog(time_t until)
+{
+	volatile int i;
+	volatile int k, l, m;
+
+	k = 1283;
+	m = 0;
+	while (time(NULL) < until) {
+		for (i=0; i<100000; i++) {
+			l = m + k;
+		}
+	}
+	(void)l;
+	_exit(0);
+}
+
+static
+void
+interactive(const char *name, int fd, unsigned seconds)
+{
+	time_t start_s, req_s;
+	unsigned long start_ns, req_ns, usec, total, worst;
+	unsigned n;
+	char ch;
+
+	n = 0;
+	total = worst = 0;
+	__time(&start_s, &start_ns);
+	while (elapsed_usec(start_s, start_ns) < seconds * 1000000UL) {
+		__time(&req_s, &req_ns);
+		if (lseek(fd, 0, SEEK_SET) < 0) {
+			err(1, "lseek");
+		}
+		if (read(fd, &ch, 1) != 1) {
+			err(1, "%s: read", FILENAME);
+		}
+		usec = elapsed_usec(req_s, req_ns);
+		total += usec;
+		if (usec > worst) {
+			worst = usec;
+		}
+		n++;
+	}
+
+	printf("%-10s %6u requests: %8lu us average, %8lu us worst\n",
+	       name, n, n ? total / n : 0, worst);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nhogs = DEFAULT_NHOGS;
+	int seconds = DEFAULT_SECONDS;
+	pid_t pids[MAXHOGS];
+	char label[16];
+	int fd, i, status;
+
+	if (argc > 1) {
+		nhogs = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		seconds = atoi(argv[2]);
+	}
+	if (nhogs < 0 || nhogs > MAXHOGS || seconds <= 0) {
+		errx(1, "Usage: schedbench [nhogs] [seconds]");
+	}
+
+	fd = open(FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+	if (write(fd, "x", 1) != 1) {
+		err(1, "%s: write", FILENAME);
+	}
+
+	interactive("alone", fd, seconds);
+
+	for (i=0; i<nhogs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			/* a second longer, to cover our own startup */
+			hog(time(NULL) + seconds + 1);
+		}
+	}
+
+	snprintf(label, sizeof(label), "%d hogs", nhogs);
+	interactive(label, fd, seconds);
+
+	for (i=0; i<nhogs; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+
+	close(fd);
+	remove(FILENAME);
+	return 0;
+}